@@ -4,11 +4,15 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <atomic>
 #include <iostream>
 #include <omp.h>  //OpenMP
 #include "ILMBase.h"
 #include "downsampling.h"
 #include "lodepng.h"
+#include "milp.h"
 
 using namespace std;
 
@@ -22,28 +26,84 @@ bool g_WantCaptureTextInput = false;
 //global stuff
 bool g_minimize_menu = false;  //minimize imGui menu drawing?
 
-//downsampling stuffs:
-int g_ds_bigpixel_width = 4;  //width and height of a big-pixel in terms of small pixels
-int g_ds_bigpixel_height = 4;
-bool g_ds_save = true;  //save result image?
-bool g_ds_print_debug = false;
-float g_ds_land_bias_ratio = 0;  //(for UI only) to calculate g_ds_land_bias as % of max-possible value
-int g_ds_land_weight = 2;  //w.r.t water_weight=1, land_weight=?
-int g_ds_png_treshold = 26;  //threshold for determining a grey pixel is black (0~256)
-bool g_ds_alternative_offsets = false;  //final optimal alternative offsets?
-int g_ds_h_offset = 0;  //best horizontal and vertical buffer offsets. for visualization
-int g_ds_v_offset = 0;
-Vec2i g_ds_input_size;  //w,h
-vector<bool> g_ds_input;  //saved input binary mask (0 or 1)
-Vec2i g_ds_output_size;  //w,h
-vector<bool> g_ds_output;  //saved output binary mask
-vector<int> g_ds_input_components;  //component indices of input
-vector<int> g_ds_output_components;  //component indices of output
-//boundaries for debug. each is a VC, type, and solved dist
-vector< vector<tuple<Vec2i, int, int>> > g_ds_output_boundaries;  
-bool g_ds_save_components_to_file = false;  //output component index map
-bool g_ds_local_constraint = true;
-int g_ds_neighobrhood_offset = 0;
+//split a comma-separated list (e.g., "4x4,8x8")
+static vector<string> SplitList(const string& value)
+{
+	vector<string> items;
+	size_t begin = 0;
+	while (begin <= value.size())
+	{
+		size_t end = value.find(',', begin);
+		if (end == string::npos)
+			end = value.size();
+		if (end > begin)
+			items.push_back(value.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return items;
+}
+
+//input files of a batch: the mask files (png, pbm, bmask) in a directory, or the lines of a list file
+//outputs of earlier runs in the directory ("input.png.WxH...png") are skipped
+static bool ListBatchFiles(const string& path, vector<string>& filenames)
+{
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	if (attributes == INVALID_FILE_ATTRIBUTES)
+	{
+		cout << "error: cannot find " << path << endl;
+		return false;
+	}
+
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+	{
+		string folder = path;
+		if (folder.back() != '/' && folder.back() != '\\')
+			folder += "/";
+
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA((folder + "*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE)
+			return true;
+		do
+		{
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				continue;
+
+			string name = data.cFileName;
+			for (int i = 0; i < name.size(); i++)
+				name[i] = tolower(name[i]);
+			size_t dot = name.rfind('.');
+			if (dot == string::npos)
+				continue;
+			string extension = name.substr(dot);
+			if (extension != ".png" && extension != ".pbm" && extension != ".bmask")
+				continue;
+			string stem = name.substr(0, dot);
+			if (stem.find(".png.") != string::npos || stem.find(".pbm.") != string::npos || stem.find(".bmask.") != string::npos)
+				continue;  //an output
+
+			filenames.push_back(folder + data.cFileName);
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+
+		sort(filenames.begin(), filenames.end());
+	}
+	else
+	{
+		//list file: a filename per line. empty lines and lines starting w/ '#' are ignored
+		ifstream file(path);
+		string line;
+		while (getline(file, line))
+		{
+			size_t begin = line.find_first_not_of(" \t\r");
+			size_t end = line.find_last_not_of(" \t\r");
+			if (begin == string::npos || line[begin] == '#')
+				continue;
+			filenames.push_back(line.substr(begin, end - begin + 1));
+		}
+	}
+	return true;
+}
 
 int main(int argc, char* argv[])
 {
@@ -54,54 +114,248 @@ int main(int argc, char* argv[])
 		strcpy(g_foldername, (string(g_foldername) + "/").c_str());
 	}
 
+	DSSpace::DownsampleOptions options;
+
+	//batch mode: input files, parameter grid, workers, summary file
+	string batch_path;
+	vector<string> grid_bigpixels, grid_land_weights, grid_neighborhood_offsets;
+	int batch_workers = 0;
+	string summary_filename = "batch_summary.csv";
+
+	//options ("--name=value") can be anywhere. the rest are positional args
+	vector<char*> args;
+	for (int i = 0; i < argc; i++)
+	{
+		string arg(argv[i]);
+		if (i == 0 || arg.compare(0, 2, "--") != 0)
+		{
+			args.push_back(argv[i]);
+			continue;
+		}
+
+		string name = arg.substr(2, arg.find('=') - 2);
+		string value = (arg.find('=') != string::npos) ? arg.substr(arg.find('=') + 1) : "";
+		if (name == "solver")
+		{
+			//MILP solver backend: gurobi or bnb (bundled branch-and-bound, no license needed)
+			if (value == "gurobi")
+				options.milp_backend = MILP_BACKEND_GUROBI;
+			else if (value == "bnb")
+				options.milp_backend = MILP_BACKEND_BNB;
+			else
+				cout << "unknown solver: " << value << endl;
+		}
+		else if (name == "vote")
+		{
+			options.vote = std::stoi(value);
+		}
+		else if (name == "warm_start")
+		{
+			options.warm_start = std::stoi(value);
+		}
+		else if (name == "offsets")
+		{
+			options.alternative_offsets = std::stoi(value);
+		}
+		else if (name == "offset_workers")
+		{
+			options.offset_workers = std::stoi(value);
+		}
+		else if (name == "target_iou")
+		{
+			options.target_IoU = std::stof(value);
+		}
+		else if (name == "milp_threads")
+		{
+			options.milp_threads = std::stoi(value);
+		}
+		else if (name == "time_limit")
+		{
+			options.time_limit = std::stof(value);
+		}
+		else if (name == "mip_gap")
+		{
+			options.mip_gap = std::stof(value);
+		}
+		else if (name == "node_limit")
+		{
+			options.node_limit = std::stod(value);
+		}
+		else if (name == "mem_limit")
+		{
+			options.mem_limit = std::stof(value);
+		}
+		else if (name == "seed")
+		{
+			options.seed = std::stoi(value);
+		}
+		else if (name == "decompose")
+		{
+			options.decompose = std::stoi(value);
+		}
+		else if (name == "presolve")
+		{
+			options.presolve = std::stoi(value);
+		}
+		else if (name == "presolve_dominance")
+		{
+			options.presolve_dominance = std::stof(value);
+		}
+		else if (name == "lazy_loops")
+		{
+			options.lazy_loops = std::stoi(value);
+		}
+		else if (name == "tile")
+		{
+			options.tile_size = std::stoi(value);
+		}
+		else if (name == "halo")
+		{
+			options.tile_halo = std::stoi(value);
+		}
+		else if (name == "band")
+		{
+			options.band_height = std::stoi(value);
+		}
+		else if (name == "pyramid")
+		{
+			options.pyramid_levels = std::stoi(value);
+		}
+		else if (name == "png_effort")
+		{
+			options.png_effort = std::stoi(value);
+		}
+		else if (name == "batch")
+		{
+			batch_path = value;
+		}
+		else if (name == "grid_bigpixel")
+		{
+			grid_bigpixels = SplitList(value);
+		}
+		else if (name == "grid_land_weight")
+		{
+			grid_land_weights = SplitList(value);
+		}
+		else if (name == "grid_neighborhood_offset")
+		{
+			grid_neighborhood_offsets = SplitList(value);
+		}
+		else if (name == "batch_workers")
+		{
+			batch_workers = std::stoi(value);
+		}
+		else if (name == "summary")
+		{
+			summary_filename = value;
+		}
+		else
+		{
+			cout << "unknown option: " << arg << endl;
+		}
+	}
+	argc = args.size();
+	argv = &args[0];
+
+	//batch mode: every input file x every combination of the grid parameters, in one process
+	if (!batch_path.empty())
+	{
+		vector<string> filenames;
+		if (!ListBatchFiles(batch_path, filenames))
+			return 1;
+
+		//parameters not in the grid keep their (single) values
+		if (grid_bigpixels.empty())
+			grid_bigpixels.push_back(to_string(options.bigpixel_width) + "x" + to_string(options.bigpixel_height));
+		if (grid_land_weights.empty())
+			grid_land_weights.push_back(to_string(options.land_weight));
+		if (grid_neighborhood_offsets.empty())
+			grid_neighborhood_offsets.push_back(to_string(options.neighborhood_offset));
+
+		vector<DSSpace::BatchJob> jobs;
+		for (int f = 0; f < filenames.size(); f++)
+		{
+			for (int b = 0; b < grid_bigpixels.size(); b++)
+			{
+				for (int l = 0; l < grid_land_weights.size(); l++)
+				{
+					for (int n = 0; n < grid_neighborhood_offsets.size(); n++)
+					{
+						DSSpace::BatchJob job;
+						job.input_filename = filenames[f];
+						job.options = options;
+						job.options.calculate_error_metrics = true;  //for the summary
+
+						//bigpixel size: "WxH" or "N" (N x N)
+						const string& bigpixel = grid_bigpixels[b];
+						size_t x = bigpixel.find_first_of("xX");
+						job.options.bigpixel_width = std::stoi(bigpixel.substr(0, x));
+						job.options.bigpixel_height = (x != string::npos) ? std::stoi(bigpixel.substr(x + 1)) : job.options.bigpixel_width;
+						job.options.land_weight = std::stoi(grid_land_weights[l]);
+						job.options.neighborhood_offset = std::stoi(grid_neighborhood_offsets[n]);
+						jobs.push_back(job);
+					}
+				}
+			}
+		}
+
+		cout << "batch: " << batch_path << " files:" << filenames.size() << " jobs:" << jobs.size() <<
+			" solver:" << (options.milp_backend == MILP_BACKEND_GUROBI ? "gurobi" : "bnb") << " summary:" << summary_filename << endl;
+		DSSpace::DownsampleBatch(jobs, batch_workers, summary_filename.c_str());
+		DSSpace::ReleaseMILPEnvironments();
+		return 0;
+	}
+
 	//command line mode:
 	if (argc > 1)
 	{
 		//do downsample png
 		string input_filename(argv[1]);
-		bool to_calculate_errors = false;
 
 		if (argc == 4)
 		{
-			g_ds_bigpixel_width = std::stoi(argv[2]);
-			g_ds_bigpixel_height = std::stoi(argv[3]);
+			options.bigpixel_width = std::stoi(argv[2]);
+			options.bigpixel_height = std::stoi(argv[3]);
 		}
 		else if (argc == 5)
 		{
-			g_ds_bigpixel_width = std::stoi(argv[2]);
-			g_ds_bigpixel_height = std::stoi(argv[3]);
-			g_ds_land_weight = std::stof(argv[4]);
+			options.bigpixel_width = std::stoi(argv[2]);
+			options.bigpixel_height = std::stoi(argv[3]);
+			options.land_weight = std::stof(argv[4]);
 		}
 		else if (argc == 6)
 		{
-			g_ds_bigpixel_width = std::stoi(argv[2]);
-			g_ds_bigpixel_height = std::stoi(argv[3]);
-			g_ds_land_weight = std::stof(argv[4]);
-			to_calculate_errors = std::stoi(argv[5]);
+			options.bigpixel_width = std::stoi(argv[2]);
+			options.bigpixel_height = std::stoi(argv[3]);
+			options.land_weight = std::stof(argv[4]);
+			options.calculate_error_metrics = std::stoi(argv[5]);
 		}
 		else if (argc == 7)
 		{
-			g_ds_bigpixel_width = std::stoi(argv[2]);
-			g_ds_bigpixel_height = std::stoi(argv[3]);
-			g_ds_land_weight = std::stof(argv[4]);
-			to_calculate_errors = std::stoi(argv[5]);
-			g_ds_save_components_to_file = std::stoi(argv[6]);
+			options.bigpixel_width = std::stoi(argv[2]);
+			options.bigpixel_height = std::stoi(argv[3]);
+			options.land_weight = std::stof(argv[4]);
+			options.calculate_error_metrics = std::stoi(argv[5]);
+			options.save_components_to_file = std::stoi(argv[6]);
 		}
 		else if (argc == 8)
 		{
-			g_ds_bigpixel_width = std::stoi(argv[2]);
-			g_ds_bigpixel_height = std::stoi(argv[3]);
-			g_ds_land_weight = std::stof(argv[4]);
-			to_calculate_errors = std::stoi(argv[5]);
-			g_ds_save_components_to_file = std::stoi(argv[6]);
-			g_ds_neighobrhood_offset = std::stoi(argv[7]);
+			options.bigpixel_width = std::stoi(argv[2]);
+			options.bigpixel_height = std::stoi(argv[3]);
+			options.land_weight = std::stof(argv[4]);
+			options.calculate_error_metrics = std::stoi(argv[5]);
+			options.save_components_to_file = std::stoi(argv[6]);
+			options.neighborhood_offset = std::stoi(argv[7]);
 		}
 
-		cout << "filename: " << input_filename << " bigpixel:" << g_ds_bigpixel_width <<
-			"X" << g_ds_bigpixel_height << " land_weight:" << g_ds_land_weight << 
-			" calculate_errors:" << to_calculate_errors << " save_components:" << g_ds_save_components_to_file << 
-			" neighobrhood_offset:" << g_ds_neighobrhood_offset << endl;
-		DSSpace::DownsamplePng(input_filename.c_str(), to_calculate_errors);
+		cout << "filename: " << input_filename << " bigpixel:" << options.bigpixel_width <<
+			"X" << options.bigpixel_height << " land_weight:" << options.land_weight << 
+			" calculate_errors:" << options.calculate_error_metrics << " save_components:" << options.save_components_to_file << 
+			" neighobrhood_offset:" << options.neighborhood_offset << 
+			" solver:" << (options.milp_backend == MILP_BACKEND_GUROBI ? "gurobi" : "bnb") << endl;
+		DSSpace::DownsampleResult result;
+		DSSpace::DownsamplePng(input_filename.c_str(), options, result);
+		DSSpace::ReleaseMILPEnvironments();
 		return 0;
 	}
 
@@ -5,8 +5,19 @@
 #include <map>
 #include <unordered_map>
 #include <queue>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <climits>
+#include <cmath>
 #include <omp.h>  //OpenMP
-#include "gurobi_c++.h"
+#ifndef _WIN32
+#include <sys/mman.h>  //mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "milp.h"
 #include "lodepng.h"
 #include "ILMBase.h"
 #include "downsampling.h"
@@ -16,347 +27,469 @@
 #define MAX3(a,b,c) ( ( (MAX2(a,b)) > (c) ) ? (MAX2(a,b)) : (c) )
 #define MIN3(a,b,c) ( ( (MIN2(a,b)) > (c) ) ? (MIN2(a,b)) : (c) )
 
-extern int g_ds_bigpixel_width;
-extern int g_ds_bigpixel_height;
-extern bool g_ds_save;
-extern bool g_ds_print_debug;
-extern float g_ds_land_bias_ratio;
-extern int g_ds_land_weight;
-extern Vec2i g_ds_input_size;  //w,h
-extern vector<bool> g_ds_input;  //saved input binary mask
-extern Vec2i g_ds_output_size;  //w,h
-extern vector<bool> g_ds_output;  //saved output binary mask
-extern vector<int> g_ds_output_components;
-extern vector<int> g_ds_input_components;
-extern bool g_ds_save_components_to_file;
-extern vector< vector<tuple<Vec2i, int, int>> > g_ds_output_boundaries;  //pos, type, solved dist
-extern bool g_ds_alternative_offsets;
-extern int g_ds_h_offset;
-extern int g_ds_v_offset;
-extern int g_ds_png_treshold;
-extern bool g_ds_local_constraint;
-extern int g_ds_neighobrhood_offset;
-
 using namespace DSSpace;
 
-//label topology (i.e., lands (=islands) and water (= sea and lakes) of a given mask
-//we will mark every pixel of the mask as:
-//{type (false=land, true=water), index (# of island; # of sea (0) or lakes (>0)) }
-//num_islands = "h0", num_waters = "h1" for betti numbers
-//labels (result): key: row-major index, value: pos and label 
-//Eulers: Euler characterstics of all components (lands then waters)
-void DSSpace::LabelTopology(int width, int height, bool* mask, unordered_map<int, pair<Vec2i,pair<bool, int>>> &labels,
-	int & num_lands, int &num_waters, vector<tuple<int,int,int>> &Eulers, vector<bool> &is_boundary_flags)
+DownsampleOptions::DownsampleOptions()
 {
-	num_lands = 0;  //current # of land
-	num_waters = 0;  //current # of water
+	bigpixel_width = 4;
+	bigpixel_height = 4;
+	land_weight = 2;
+	land_bias_ratio = 0;
+	png_threshold = 26;
+	neighborhood_offset = 0;
+	local_constraint = true;
+	parallel_boundaries = false;
+	vote = false;
+
+#ifndef DS_NO_GUROBI
+	milp_backend = MILP_BACKEND_GUROBI;
+#else
+	milp_backend = MILP_BACKEND_BNB;
+#endif
+	milp_threads = 0;
+	time_limit = 60;
+	mip_gap = 0;
+	node_limit = 0;
+	mem_limit = 0;
+	seed = 0;
+	warm_start = true;
+	decompose = true;
+
+	tile_size = 0;
+	tile_halo = 2;
+	band_height = 0;
+	pyramid_levels = 0;
+	presolve = true;
+	presolve_dominance = 0;
+	lazy_loops = false;
+
+	alternative_offsets = false;
+	offset_workers = 0;
+	target_IoU = 0;
+
+	calculate_error_metrics = false;
+	save = true;
+	png_effort = 2;
+	save_components_to_file = false;
+	print_debug = false;
+}
 
-	labels.clear();
+SolverStats::SolverStats()
+{
+	num_solves = 0;
+	status = 0;
+	runtime = 0;
+	node_count = 0;
+	gap = INFINITY;
+}
+
+void SolverStats::Add(const SolverStats& stats)
+{
+	if (stats.num_solves == 0)
+		return;
+
+	num_solves += stats.num_solves;
+	status = stats.status;
+	runtime += stats.runtime;
+	node_count += stats.node_count;
+	if (stats.gap < INFINITY)  //(a solve w/o a solution has none)
+		gap = (gap < INFINITY) ? max(gap, stats.gap) : stats.gap;
+}
+
+DownsampleResult::DownsampleResult()
+{
+	h_offset = v_offset = 0;
+	IoU = Dice = Precision = Recall = 0;
+}
+
+//
+//bit masks
+//
+
+//number of 1 bits of a word
+inline int PopCount(unsigned long long word)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt64(word);
+#else
+	return __builtin_popcountll(word);
+#endif
+}
 
-	while (true)
+void DSSpace::PackMask(int width, int height, const bool* mask, BitMask& bits)
+{
+	bits.Resize(width, height);
+	for (int y = 0; y < height; y++)
 	{
-		bool filled = false;  //filled a new component at this pass?
+		unsigned long long* row = bits.Row(y);
+		const bool* pixels = mask + (size_t)y * width;
+		for (int x = 0; x < width; x++)
+		{
+			if (pixels[x])
+				row[x >> 6] |= 1ULL << (x & 63);
+		}
+	}
+}
 
-		for (int y = 0; y < height; y++)
+void DSSpace::UnpackMask(const BitMask& bits, bool* mask)
+{
+	for (int y = 0; y < bits.height; y++)
+	{
+		const unsigned long long* row = bits.Row(y);
+		bool* pixels = mask + (size_t)y * bits.width;
+		for (int x = 0; x < bits.width; x++)
 		{
-			for (int x = 0; x < width; x++)
-			{
-				int index = y * width + x;
+			pixels[x] = (row[x >> 6] >> (x & 63)) & 1;
+		}
+	}
+}
 
-				if (labels.count(index) > 0)
-					continue;  //already labelled
+//shift a mask by (h_offset, v_offset) >= 0 pixels: output(x, y) = input(x - h_offset, y - v_offset), 0 outside
+static void ShiftMask(const BitMask& input, int h_offset, int v_offset, BitMask& output)
+{
+	output.Resize(input.width, input.height);
 
-				bool is_land = mask[index];
+	const int word_shift = h_offset >> 6;
+	const int bit_shift = h_offset & 63;
+	const int last_bits = input.width & 63;
+	for (int y = v_offset; y < input.height; y++)
+	{
+		const unsigned long long* in = input.Row(y - v_offset);
+		unsigned long long* out = output.Row(y);
+		for (int w = word_shift; w < input.words_per_row; w++)
+		{
+			unsigned long long word = in[w - word_shift] << bit_shift;
+			if (bit_shift > 0 && w - word_shift - 1 >= 0)
+				word |= in[w - word_shift - 1] >> (64 - bit_shift);
+			out[w] = word;
+		}
+		if (last_bits > 0)
+			out[input.words_per_row - 1] &= (1ULL << last_bits) - 1;  //keep the padding 0
+	}
+}
 
-				//let's start a flooding of either a land or a water from here
-				unordered_map<int, Vec2i> visited;
-				visited[index] = Vec2i(x, y);
-				queue<Vec2i> Q;
-				Q.push(Vec2i(x, y));
-				while (!Q.empty())
-				{
-					Vec2i p = Q.front();
-					Q.pop();
+//union-find helpers for LabelComponents
+//parent[l] <= l always holds, so the root of a set is its smallest (i.e., earliest created) label
+int FindRootLabel(vector<int>& parent, int l)
+{
+	while (parent[l] != l)
+	{
+		parent[l] = parent[parent[l]];  //path halving
+		l = parent[l];
+	}
+	return l;
+}
+void UnionLabels(vector<int>& parent, int a, int b)
+{
+	a = FindRootLabel(parent, a);
+	b = FindRootLabel(parent, b);
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
 
-					//try to flood to adjacent land or water
-					//land component: consider all the 8 neighbors in a 3x3 mask
-					//water component: only 4-neighbors
-					for (int dir = 0; dir < 8; dir++)
-					{
-						if (!is_land)
-						{
-							if (dir == 0 || dir == 2 || dir == 4 || dir == 6)
-								continue;
-						}
+//bit-quad vertex counting: a grid vertex belongs to every component among its (up to) 4 adjacent pixels
+//a, b, c, d: component indices of the 2x2 pixels around the vertex. -1 = outside of the image
+void CountQuadVertex(vector<ComponentInfo>& components, int a, int b, int c, int d)
+{
+	if (a >= 0)
+		components[a].num_vertices++;
+	if (b >= 0 && b != a)
+		components[b].num_vertices++;
+	if (c >= 0 && c != a && c != b)
+		components[c].num_vertices++;
+	if (d >= 0 && d != a && d != b && d != c)
+		components[d].num_vertices++;
+}
 
-						Vec2i p2;
-						if (dir == 0)
-							p2 = p + Vec2i(-1, -1);
-						else if (dir == 1)
-							p2 = p + Vec2i(0, -1);
-						else if (dir == 2)
-							p2 = p + Vec2i(1, -1);
-						else if (dir == 3)
-							p2 = p + Vec2i(1, 0);
-						else if (dir == 4)
-							p2 = p + Vec2i(1, 1);
-						else if (dir == 5)
-							p2 = p + Vec2i(0, 1);
-						else if (dir == 6)
-							p2 = p + Vec2i(-1, 1);
-						else if (dir == 7)
-							p2 = p + Vec2i(-1, 0);
-
-						int p2_index = p2.y * width + p2.x;
-
-						//is p2 within and not visited yet?
-						if (p2.x >= 0 && p2.x < width && p2.y >= 0 && p2.y < height &&
-							visited.count(p2_index) == 0)
-						{
-							bool to_add = false;  //both land or both water?
-							if ((is_land && mask[p2_index] == true) ||
-								(!is_land && mask[p2_index] == false))
-								to_add = true;
+//pixel readers for the labeling pass
+struct BoolMaskPixels
+{
+	const bool* mask;
+	int width;
 
-							if (to_add)
-							{
-								//go here!
-								visited[p2_index] = p2;
-								Q.push(p2);
-							}
-						}
-					}
-				}
+	bool operator()(int x, int y) const { return mask[y * width + x]; }
+};
+struct BitMaskPixels
+{
+	const BitMask* mask;
 
-				//label this mass
-				pair<bool, int> type_;
-				if (is_land)
-				{
-					type_.first = false;
-					type_.second = num_lands;
-					num_lands++;
-				}
-				else
-				{
-					type_.first = true;
-					type_.second = num_waters;
-					num_waters++;
-				}
+	bool operator()(int x, int y) const { return mask->Get(x, y); }
+};
 
-				for (unordered_map<int, Vec2i>::iterator itr = visited.begin(); itr != visited.end(); itr++)
-				{
-					labels[(*itr).first] = make_pair((*itr).second, type_);
-				}
+template <class Pixels>
+void LabelPixels(int width, int height, const Pixels& pixel, LabelMap& labels, bool print_debug)
+{
+	labels.width = width;
+	labels.height = height;
 
-				filled = true;
-			}
-		}
+	int& num_lands = labels.num_lands;
+	int& num_waters = labels.num_waters;
+	num_lands = 0;
+	num_waters = 0;
 
-		if (!filled)
-		{
-			//all pixels are visited/filled, done!
-			break;
-		}
-	}
+	vector<int>& label_image = labels.ids;
+	label_image.assign(width * height, -1);
 
-	//find Euler characteristics of components
+	vector<ComponentInfo>& components = labels.components;
+	components.clear();
 
-	//for each components:
-	vector<unordered_map<int, bool>> faces_all(num_lands + num_waters);  //width * height
-	vector<unordered_map<int, bool>> vertices_all(num_lands + num_waters);  //(width+1) * (height + 1)
-	vector<unordered_map<int, bool>> hedges_all(num_lands + num_waters);  //width * (height + 1)
-	vector<unordered_map<int, bool>> vedges_all(num_lands + num_waters);  //(width+1) * height
-	for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+	//pass 1: assign provisional labels in raster order and record their equivalences
+	//a component's first pixel always opens a new label, so its root label is created before any other of its labels
+	vector<int> parent;  //union-find forest of provisional labels
+	vector<bool> label_is_land;  //type of each provisional label
+	for (int y = 0; y < height; y++)
 	{
-		int c = -1;
-		if (!(*itr).second.second.first)
-			c = (*itr).second.second.second;
-		else
-			c = num_lands + (*itr).second.second.second;
-
-		Vec2i XY = (*itr).second.first;  //face's pos
+		for (int x = 0; x < width; x++)
+		{
+			int index = y * width + x;
+			bool is_land = pixel(x, y);
+
+			//already-visited neighbors: left, up, upper-left, upper-right
+			//land component: 8-neighbors. water component: only 4-neighbors
+			int neighbors[4];
+			int num_neighbors = 0;
+			if (x > 0 && pixel(x - 1, y) == is_land)
+				neighbors[num_neighbors++] = label_image[index - 1];
+			if (y > 0)
+			{
+				if (pixel(x, y - 1) == is_land)
+					neighbors[num_neighbors++] = label_image[index - width];
+				if (is_land && x > 0 && pixel(x - 1, y - 1))
+					neighbors[num_neighbors++] = label_image[index - width - 1];
+				if (is_land && x < width - 1 && pixel(x + 1, y - 1))
+					neighbors[num_neighbors++] = label_image[index - width + 1];
+			}
 
-		faces_all[c][XY.y * width + XY.x] = true;
+			if (num_neighbors == 0)
+			{
+				//open a new label
+				label_image[index] = parent.size();
+				parent.push_back(parent.size());
+				label_is_land.push_back(is_land);
+			}
+			else
+			{
+				label_image[index] = neighbors[0];
+				for (int i = 1; i < num_neighbors; i++)
+				{
+					UnionLabels(parent, neighbors[0], neighbors[i]);
+				}
+			}
+		}
+	}
 
-		//mark this faces' adjacent vertices and edges
-		vertices_all[c][XY.y * (width + 1) + XY.x] = true;
-		vertices_all[c][XY.y * (width + 1) + (XY.x + 1)] = true;
-		vertices_all[c][(XY.y + 1) * (width + 1) + (XY.x + 1)] = true;
-		vertices_all[c][(XY.y + 1) * (width + 1) + XY.x] = true;
+	//number the root labels in creation order, i.e., raster order of every component's first pixel
+	vector<int> final_labels(parent.size(), -1);
+	for (int l = 0; l < parent.size(); l++)
+	{
+		if (parent[l] != l)
+			continue;
 
-		//mark adjcent hedges and vedges
-		hedges_all[c][XY.y * width + XY.x] = true;
-		hedges_all[c][(XY.y + 1) * width + XY.x] = true;
-		vedges_all[c][XY.y * (width + 1) + XY.x] = true;
-		vedges_all[c][XY.y * (width + 1) + (XY.x + 1)] = true;
+		if (label_is_land[l])
+			final_labels[l] = num_lands++;
+		else
+			final_labels[l] = num_waters++;
 	}
-	//calculate the Euler characteristics:
-	for (int c = 0; c < num_lands + num_waters; c++)
+	components.resize(num_lands + num_waters);
+	for (int l = 0; l < parent.size(); l++)
 	{
-		int Euler = vertices_all[c].size() - (hedges_all[c].size() + vedges_all[c].size()) + faces_all[c].size();
-
-		if (g_ds_print_debug)
+		if (parent[l] == l)
 		{
-			if (c < num_lands)
-				cout << "land  ";
-			else
-				cout << "water ";
-			cout << "C#" << c << " V:" << vertices_all[c].size() << " E:" << hedges_all[c].size() + vedges_all[c].size() <<
-				" F:" << faces_all[c].size() << " Euler:" << Euler << endl;
+			ComponentInfo info;
+			info.is_water = !label_is_land[l];
+			info.index = final_labels[l];
+			info.num_pixels = 0;
+			info.num_vertices = 0;
+			info.num_edges = 0;
+			info.bbox_min = Vec2i(width, height);
+			info.bbox_max = Vec2i(-1, -1);
+			info.touches_border = false;
+
+			//to the actual component index (lands first then waters):
+			if (info.is_water)
+				final_labels[l] += num_lands;
+			components[final_labels[l]] = info;
+		}
+		else
+		{
+			//parent[l] < l, so its final label is already resolved
+			final_labels[l] = final_labels[parent[l]];
 		}
-
-		Eulers.push_back(make_tuple(vertices_all[c].size(), hedges_all[c].size() + vedges_all[c].size(), 
-			faces_all[c].size()));
-		//Eulers.push_back(Euler);
 	}
 
-	//find is_boundary flags for every component:
-	is_boundary_flags.clear();
-	is_boundary_flags.resize(num_lands + num_waters, false);
-	for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+	//pass 2: write the final labels and collect the components' metadata
+	//#V and #E are counted from local configurations: pixels left, above and above-left are final already
+	for (int y = 0; y < height; y++)
 	{
-		//boundary pixel?
-		Vec2i xy = (*itr).second.first;
-		if (xy.x == 0 || xy.x == width - 1 || xy.y == 0 || xy.y == height - 1)
+		for (int x = 0; x < width; x++)
 		{
-			int c = -1;
-			if (!(*itr).second.second.first)
-				c = (*itr).second.second.second;
-			else
-				c = num_lands + (*itr).second.second.second;
-
-			is_boundary_flags[c] = true;
+			int index = y * width + x;
+			int c = final_labels[label_image[index]];
+			label_image[index] = c;
+
+			int c_left = (x > 0) ? label_image[index - 1] : -1;
+			int c_up = (y > 0) ? label_image[index - width] : -1;
+			int c_up_left = (x > 0 && y > 0) ? label_image[index - width - 1] : -1;
+
+			ComponentInfo& info = components[c];
+			info.num_pixels++;
+			info.bbox_min.x = MIN2(info.bbox_min.x, x);
+			info.bbox_min.y = MIN2(info.bbox_min.y, y);
+			info.bbox_max.x = MAX2(info.bbox_max.x, x);
+			info.bbox_max.y = MAX2(info.bbox_max.y, y);
+			if (x == 0 || x == width - 1 || y == 0 || y == height - 1)
+				info.touches_border = true;
+
+			//4 edges per pixel, minus the ones shared with the same component's left and upper pixels
+			info.num_edges += 4;
+			if (c_left == c)
+				info.num_edges--;
+			if (c_up == c)
+				info.num_edges--;
+
+			//the top-left vertex of this pixel (and the top-right one at the last column)
+			CountQuadVertex(components, c_up_left, c_up, c_left, c);
+			if (x == width - 1)
+				CountQuadVertex(components, c_up, -1, c, -1);
 		}
 	}
+	//vertices of the bottom edge of the image
+	for (int x = 0; x <= width && height > 0; x++)
+	{
+		int c_left = (x > 0) ? label_image[(height - 1) * width + x - 1] : -1;
+		int c_right = (x < width) ? label_image[(height - 1) * width + x] : -1;
+		CountQuadVertex(components, c_left, c_right, -1, -1);
+	}
 
-	if (g_ds_print_debug)
+	if (print_debug)
 	{
-		cout << "[LabelTopology] #labels:" << labels.size() << " num_lands:" << num_lands << " num_waters" << num_waters << endl;
+		cout << "[LabelComponents] #provisional labels:" << parent.size() << " num_lands:" << num_lands << " num_waters" << num_waters << endl;
 	}
 }
 
-void DSSpace::LabelTopology2(int width, int height, bool* mask, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
-	int& num_lands, int& num_waters)
+void DSSpace::LabelComponents(int width, int height, bool* mask, LabelMap& labels, bool print_debug)
 {
-	num_lands = 0;  //current # of land
-	num_waters = 0;  //current # of water
+	BoolMaskPixels pixels = { mask, width };
+	LabelPixels(width, height, pixels, labels, print_debug);
+}
 
-	labels.clear();
+void DSSpace::LabelComponents(const BitMask& mask, LabelMap& labels, bool print_debug)
+{
+	BitMaskPixels pixels = { &mask };
+	LabelPixels(mask.width, mask.height, pixels, labels, print_debug);
+}
 
-	while (true)
-	{
-		bool filled = false;  //filled a new component at this pass?
+//label topology (i.e., lands (=islands) and water (= sea and lakes) of a given mask
+//we will mark every pixel of the mask as:
+//{type (false=land, true=water), index (# of island; # of sea (0) or lakes (>0)) }
+//num_islands = "h0", num_waters = "h1" for betti numbers
+//labels (result): key: row-major index, value: pos and label 
+//Eulers: Euler characterstics of all components (lands then waters)
+void DSSpace::LabelTopology(int width, int height, bool* mask, unordered_map<int, pair<Vec2i,pair<bool, int>>> &labels,
+	int & num_lands, int &num_waters, vector<tuple<int,int,int>> &Eulers, vector<bool> &is_boundary_flags, bool print_debug)
+{
+	LabelMap label_map;
+	LabelTopology(width, height, mask, label_map, Eulers, print_debug);
 
-		for (int y = 0; y < height; y++)
+	num_lands = label_map.num_lands;
+	num_waters = label_map.num_waters;
+
+	labels.clear();
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
 		{
-			for (int x = 0; x < width; x++)
-			{
-				int index = y * width + x;
+			ComponentInfo& info = label_map.components[label_map.At(x, y)];
+			labels[y * width + x] = make_pair(Vec2i(x, y), make_pair(info.is_water, info.index));
+		}
+	}
 
-				if (labels.count(index) > 0)
-					continue;  //already labelled
+	//find is_boundary flags for every component:
+	is_boundary_flags.clear();
+	for (int c = 0; c < label_map.NumComponents(); c++)
+	{
+		is_boundary_flags.push_back(label_map.components[c].touches_border);
+	}
+}
 
-				bool is_land = mask[index];
+void DSSpace::LabelTopology(int width, int height, bool* mask, LabelMap& labels, vector<tuple<int, int, int>>& Eulers,
+	bool print_debug)
+{
+	LabelComponents(width, height, mask, labels, print_debug);
 
-				//let's start a flooding of either a land or a water from here
-				unordered_map<int, Vec2i> visited;
-				visited[index] = Vec2i(x, y);
-				queue<Vec2i> Q;
-				Q.push(Vec2i(x, y));
-				while (!Q.empty())
-				{
-					Vec2i p = Q.front();
-					Q.pop();
+	//find Euler characteristics of components
+	ComponentEulers(labels, Eulers, print_debug);
 
-					//try to flood to adjacent land or water
-					//land component: consider all the 8 neighbors in a 3x3 mask
-					//water component: only 4-neighbors
-					for (int dir = 0; dir < 8; dir++)
-					{
-						if (!is_land)
-						{
-							if (dir == 0 || dir == 2 || dir == 4 || dir == 6)
-								continue;
-						}
+	if (print_debug)
+	{
+		cout << "[LabelTopology] #labels:" << labels.ids.size() << " num_lands:" << labels.num_lands << " num_waters" << labels.num_waters << endl;
+	}
+}
 
-						Vec2i p2;
-						if (dir == 0)
-							p2 = p + Vec2i(-1, -1);
-						else if (dir == 1)
-							p2 = p + Vec2i(0, -1);
-						else if (dir == 2)
-							p2 = p + Vec2i(1, -1);
-						else if (dir == 3)
-							p2 = p + Vec2i(1, 0);
-						else if (dir == 4)
-							p2 = p + Vec2i(1, 1);
-						else if (dir == 5)
-							p2 = p + Vec2i(0, 1);
-						else if (dir == 6)
-							p2 = p + Vec2i(-1, 1);
-						else if (dir == 7)
-							p2 = p + Vec2i(-1, 0);
-
-						int p2_index = p2.y * width + p2.x;
-
-						//is p2 within and not visited yet?
-						if (p2.x >= 0 && p2.x < width && p2.y >= 0 && p2.y < height &&
-							visited.count(p2_index) == 0)
-						{
-							bool to_add = false;  //both land or both water?
-							if ((is_land && mask[p2_index] == true) ||
-								(!is_land && mask[p2_index] == false))
-								to_add = true;
+void DSSpace::LabelTopology(const BitMask& mask, LabelMap& labels, vector<tuple<int, int, int>>& Eulers, bool print_debug)
+{
+	LabelComponents(mask, labels, print_debug);
 
-							if (to_add)
-							{
-								//go here!
-								visited[p2_index] = p2;
-								Q.push(p2);
-							}
-						}
-					}
-				}
+	//find Euler characteristics of components
+	ComponentEulers(labels, Eulers, print_debug);
 
-				//label this mass
-				pair<bool, int> type_;
-				if (is_land)
-				{
-					type_.first = false;
-					type_.second = num_lands;
-					num_lands++;
-				}
-				else
-				{
-					type_.first = true;
-					type_.second = num_waters;
-					num_waters++;
-				}
+	if (print_debug)
+	{
+		cout << "[LabelTopology] #labels:" << labels.ids.size() << " num_lands:" << labels.num_lands << " num_waters" << labels.num_waters << endl;
+	}
+}
 
-				for (unordered_map<int, Vec2i>::iterator itr = visited.begin(); itr != visited.end(); itr++)
-				{
-					labels[(*itr).first] = make_pair((*itr).second, type_);
-				}
+void DSSpace::ComponentEulers(const LabelMap& labels, vector<tuple<int, int, int>>& Eulers, bool print_debug)
+{
+	//#V, #E, #F were already counted by LabelComponents
+	for (int c = 0; c < labels.NumComponents(); c++)
+	{
+		const ComponentInfo& info = labels.components[c];
+		int Euler = info.num_vertices - info.num_edges + info.num_pixels;
 
-				filled = true;
-			}
+		if (print_debug)
+		{
+			if (c < labels.num_lands)
+				cout << "land  ";
+			else
+				cout << "water ";
+			cout << "C#" << c << " V:" << info.num_vertices << " E:" << info.num_edges <<
+				" F:" << info.num_pixels << " Euler:" << Euler << endl;
 		}
 
-		if (!filled)
+		Eulers.push_back(make_tuple(info.num_vertices, info.num_edges, info.num_pixels));
+	}
+}
+
+void DSSpace::LabelTopology2(int width, int height, bool* mask, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
+	int& num_lands, int& num_waters, bool print_debug)
+{
+	LabelMap label_map;
+	LabelComponents(width, height, mask, label_map, print_debug);
+
+	num_lands = label_map.num_lands;
+	num_waters = label_map.num_waters;
+
+	labels.clear();
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
 		{
-			//all pixels are visited/filled, done!
-			break;
+			ComponentInfo& info = label_map.components[label_map.At(x, y)];
+			labels[y * width + x] = make_pair(Vec2i(x, y), make_pair(info.is_water, info.index));
 		}
 	}
 
-	if (g_ds_print_debug)
+	if (print_debug)
 	{
 		cout << "[LabelTopology] #labels:" << labels.size() << " num_lands:" << num_lands << " num_waters" << num_waters << endl;
 	}
 }
 
 bool DSSpace::EnumerateBoundaries(int width, int height, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
-	int num_lands, int num_waters, vector<pair<Vec2i,int>> &boundaries)
+	int num_lands, int num_waters, vector<pair<Vec2i,int>> &boundaries, bool print_debug)
 {
 	//check every half-edge (horizontal and vertical), look for component boundary edges
 	//we assume land is at e->f and water is at eo->f
@@ -461,76 +594,1712 @@ bool DSSpace::EnumerateBoundaries(int width, int height, unordered_map<int, pair
 					}
 					F1 = labels[Y1 * width + X1];
 
-					F0F1s.push_back(make_pair(F0, F1));
-				}
-			}
+					F0F1s.push_back(make_pair(F0, F1));
+				}
+			}
+		}
+	}
+
+	//key: 0-based land_index * (num_components) + 0-based water_index. value: <index-index, size>
+	unordered_map<int, pair<Vec2i,int>> boundaries_map; 
+	for (int i = 0; i < F0F1s.size(); i++)
+	{
+		pair<Vec2i, pair<bool, int>>& F0 = F0F1s[i].first;
+		pair<Vec2i, pair<bool, int>>& F1 = F0F1s[i].second;
+		
+		//is F0 a land pixel and F1 a water pixel?
+		if (F0.second.first == false && F1.second.first == true)
+		{
+			boundaries_map[F0.second.second * (num_lands+num_waters) + F1.second.second].first = 
+				Vec2i(F0.second.second, F1.second.second + num_lands /*actual component index of this water component*/);
+			boundaries_map[F0.second.second * (num_lands + num_waters) + F1.second.second].second++;
+		}
+	}
+	//to vector
+	for (unordered_map<int, pair<Vec2i,int>>::iterator itr = boundaries_map.begin(); itr != boundaries_map.end(); itr++)
+	{
+		if(print_debug)
+			cout << (*itr).second.first << " size:" << (*itr).second.second << endl;
+		boundaries.push_back((*itr).second);
+	}
+
+	return true;
+}
+
+
+//compact open-addressing table of land-water edge counts, keyed by a (land, water) component pair
+//keys are 0-based land_index * num_waters + 0-based water_index
+static const unsigned long long EMPTY_BOUNDARY_KEY = ~0ULL;
+struct BoundaryCounter
+{
+	vector<unsigned long long> keys;
+	vector<int> counts;
+	int num_used;
+
+	//last touched key and slot: neighboring edges of a coastline mostly hit the same pair
+	unsigned long long last_key;
+	int last_slot;
+
+	BoundaryCounter()
+	{
+		keys.assign(64, EMPTY_BOUNDARY_KEY);
+		counts.assign(64, 0);
+		num_used = 0;
+		last_key = EMPTY_BOUNDARY_KEY;
+		last_slot = -1;
+	}
+
+	int Slot(unsigned long long key) const
+	{
+		size_t mask = keys.size() - 1;
+		size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+		while (keys[i] != EMPTY_BOUNDARY_KEY && keys[i] != key)
+			i = (i + 1) & mask;
+		return (int)i;
+	}
+
+	void Add(unsigned long long key, int count)
+	{
+		if (key == last_key)
+		{
+			counts[last_slot] += count;
+			return;
+		}
+
+		//keep the load factor <= 1/2
+		if ((num_used + 1) * 2 > keys.size())
+			Grow();
+
+		int i = Slot(key);
+		if (keys[i] == EMPTY_BOUNDARY_KEY)
+		{
+			keys[i] = key;
+			num_used++;
+		}
+		counts[i] += count;
+
+		last_key = key;
+		last_slot = i;
+	}
+
+	void Grow()
+	{
+		vector<unsigned long long> old_keys;
+		vector<int> old_counts;
+		old_keys.swap(keys);
+		old_counts.swap(counts);
+
+		keys.assign(old_keys.size() * 2, EMPTY_BOUNDARY_KEY);
+		counts.assign(old_keys.size() * 2, 0);
+		for (int i = 0; i < old_keys.size(); i++)
+		{
+			if (old_keys[i] == EMPTY_BOUNDARY_KEY)
+				continue;
+			int j = Slot(old_keys[i]);
+			keys[j] = old_keys[i];
+			counts[j] = old_counts[i];
+		}
+
+		last_key = EMPTY_BOUNDARY_KEY;
+		last_slot = -1;
+	}
+
+	void Merge(const BoundaryCounter& other)
+	{
+		for (int i = 0; i < other.keys.size(); i++)
+		{
+			if (other.keys[i] != EMPTY_BOUNDARY_KEY)
+				Add(other.keys[i], other.counts[i]);
+		}
+	}
+};
+
+//count the land-water edges of row y into counter:
+//vertical edges between (x-1,y) and (x,y), and horizontal edges between (x,y-1) and (x,y)
+static void CountBoundaryRow(const LabelMap& labels, int y, BoundaryCounter& counter)
+{
+	const int width = labels.width;
+	const int num_lands = labels.num_lands;
+	const unsigned long long num_waters = labels.num_waters;
+	const int* row = &labels.ids[y * width];
+	const int* row_above = (y > 0) ? &labels.ids[(y - 1) * width] : NULL;
+
+	for (int x = 0; x < width; x++)
+	{
+		int c = row[x];
+		
+		//an edge is a boundary in exactly one of its two orientations (he->f is land, he->o->f is water)
+		if (x > 0)
+		{
+			int c_left = row[x - 1];
+			if (c < num_lands && c_left >= num_lands)
+				counter.Add(c * num_waters + (c_left - num_lands), 1);
+			else if (c_left < num_lands && c >= num_lands)
+				counter.Add(c_left * num_waters + (c - num_lands), 1);
+		}
+		if (row_above)
+		{
+			int c_above = row_above[x];
+			if (c < num_lands && c_above >= num_lands)
+				counter.Add(c * num_waters + (c_above - num_lands), 1);
+			else if (c_above < num_lands && c >= num_lands)
+				counter.Add(c_above * num_waters + (c - num_lands), 1);
+		}
+	}
+}
+
+bool DSSpace::EnumerateBoundaries(const LabelMap& labels, vector<pair<Vec2i, int>>& boundaries, bool row_parallel,
+	bool print_debug)
+{
+	const int width = labels.width;
+	const int height = labels.height;
+	const int num_lands = labels.num_lands;
+	const int num_waters = labels.num_waters;
+
+	if (labels.ids.size() != width * height)
+	{
+		cout << "[EnumerateBoundaries] wrong label map size" << endl;
+		return false;
+	}
+
+	//scan every interior edge (horizontal and vertical) once, and count land-water edges per component pair
+	BoundaryCounter counter;
+	if (row_parallel && height > 1)
+	{
+		//per-thread partial tables, merged at the end
+		vector<BoundaryCounter> partial_counters(omp_get_max_threads());
+#pragma omp parallel
+		{
+			BoundaryCounter& partial_counter = partial_counters[omp_get_thread_num()];
+#pragma omp for schedule(static)
+			for (int y = 0; y < height; y++)
+			{
+				CountBoundaryRow(labels, y, partial_counter);
+			}
+		}
+		for (int i = 0; i < partial_counters.size(); i++)
+		{
+			counter.Merge(partial_counters[i]);
+		}
+	}
+	else
+	{
+		for (int y = 0; y < height; y++)
+		{
+			CountBoundaryRow(labels, y, counter);
+		}
+	}
+
+	//to vector, in (land_index, water_index) order so that the result does not depend on the threads
+	vector<pair<unsigned long long, int>> sorted_boundaries;
+	sorted_boundaries.reserve(counter.num_used);
+	for (int i = 0; i < counter.keys.size(); i++)
+	{
+		if (counter.keys[i] != EMPTY_BOUNDARY_KEY)
+			sorted_boundaries.push_back(make_pair(counter.keys[i], counter.counts[i]));
+	}
+	sort(sorted_boundaries.begin(), sorted_boundaries.end());
+
+	for (int i = 0; i < sorted_boundaries.size(); i++)
+	{
+		int land_index = sorted_boundaries[i].first / num_waters;
+		int water_index = sorted_boundaries[i].first % num_waters;
+		pair<Vec2i, int> boundary(Vec2i(land_index, water_index + num_lands /*actual component index*/), sorted_boundaries[i].second);
+		if (print_debug)
+			cout << boundary.first << " size:" << boundary.second << endl;
+		boundaries.push_back(boundary);
+	}
+
+	return true;
+}
+
+//unfilter one png scanline (filter types 0-4) into recon. precon: the previous unfiltered scanline, NULL for the first one.
+//bytewidth: bytes per complete pixel, at least 1
+static bool UnfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+	size_t bytewidth, unsigned char filter_type, size_t length)
+{
+	switch (filter_type)
+	{
+	case 0:  //none
+		memcpy(recon, scanline, length);
+		break;
+	case 1:  //sub
+		for (size_t i = 0; i < length; i++)
+			recon[i] = scanline[i] + (i >= bytewidth ? recon[i - bytewidth] : 0);
+		break;
+	case 2:  //up
+		for (size_t i = 0; i < length; i++)
+			recon[i] = scanline[i] + (precon ? precon[i] : 0);
+		break;
+	case 3:  //average
+		for (size_t i = 0; i < length; i++)
+		{
+			int left = i >= bytewidth ? recon[i - bytewidth] : 0;
+			int up = precon ? precon[i] : 0;
+			recon[i] = scanline[i] + ((left + up) >> 1);
+		}
+		break;
+	case 4:  //paeth
+		for (size_t i = 0; i < length; i++)
+		{
+			int a = i >= bytewidth ? recon[i - bytewidth] : 0;  //left
+			int b = precon ? precon[i] : 0;  //up
+			int c = (precon && i >= bytewidth) ? precon[i - bytewidth] : 0;  //upper left
+			int pa = abs(b - c);
+			int pb = abs(a - c);
+			int pc = abs(a + b - 2 * c);
+			recon[i] = scanline[i] + (pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+		}
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+//binarize one unfiltered scanline in its native color type into a bit row:
+//land if r, g and b (or the grey level, or the palette color) >= threshold. alpha is ignored.
+//this matches thresholding lodepng's RGBA8 conversion: 16-bit samples use their high byte, low bit depth greys are scaled to 0-255
+static void ThresholdScanline(const unsigned char* recon, const LodePNGColorMode& color, const bool* palette_lands,
+	int threshold, int width, unsigned long long* bits)
+{
+	const int bitdepth = color.bitdepth;
+	const int channels = lodepng_get_channels(&color);
+	const int sample_bytes = bitdepth / 8;  //0 for bit depths below 8
+	const int pixel_bytes = channels * sample_bytes;
+	const int max_value = (1 << (bitdepth < 8 ? bitdepth : 8)) - 1;
+
+	unsigned long long word = 0;
+	for (int x = 0; x < width; x++)
+	{
+		bool land;
+		if (bitdepth < 8)
+		{
+			//grey or palette index, packed high bit first
+			int bit = x * bitdepth;
+			int value = (recon[bit >> 3] >> (8 - bitdepth - (bit & 7))) & max_value;
+			if (color.colortype == LCT_PALETTE)
+				land = palette_lands[value];
+			else
+				land = value * 255 / max_value >= threshold;
+		}
+		else
+		{
+			const unsigned char* pixel = recon + x * pixel_bytes;
+			switch (color.colortype)
+			{
+			case LCT_PALETTE:
+				land = palette_lands[pixel[0]];
+				break;
+			case LCT_GREY:
+			case LCT_GREY_ALPHA:
+				land = pixel[0] >= threshold;
+				break;
+			default:  //LCT_RGB, LCT_RGBA
+				land = pixel[0] >= threshold && pixel[sample_bytes] >= threshold && pixel[2 * sample_bytes] >= threshold;
+				break;
+			}
+		}
+
+		if (land)
+			word |= 1ull << (x & 63);
+		if ((x & 63) == 63 || x == width - 1)
+		{
+			bits[x >> 6] = word;
+			word = 0;
+		}
+	}
+}
+
+bool DSSpace::LoadPngMask(const char* filename, int threshold, BitMask& mask)
+{
+	//signature + IHDR: is the image interlaced?
+	unsigned char header[33];
+	unsigned width = 0, height = 0;
+	lodepng::State state;
+	unsigned error = 0;
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		error = 78;
+	else
+	{
+		if (fread(header, 1, 33, file) != 33)
+			error = 27;
+		fclose(file);
+	}
+	if (!error)
+		error = lodepng_inspect(&width, &height, &state, header, 33);
+	if (error)
+	{
+		cout << filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+		return false;
+	}
+
+	//interlaced: let lodepng put the passes together (as 8-bit RGB), then threshold that
+	if (state.info_png.interlace_method != 0)
+	{
+		std::vector<unsigned char> png, rgb;
+		error = lodepng::load_file(png, filename);
+		if (!error)
+			error = lodepng::decode(rgb, width, height, png, LCT_RGB, 8);
+		if (error)
+		{
+			cout << filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+			return false;
+		}
+
+		mask.Resize(width, height);
+		LodePNGColorMode rgb_color = lodepng_color_mode_make(LCT_RGB, 8);
+		for (int y = 0; y < height; y++)
+			ThresholdScanline(&rgb[y * width * 3], rgb_color, NULL, threshold, width, mask.Row(y));
+		return true;
+	}
+
+	//otherwise the whole image is a single band of a PngBandReader (w/o a halo): the file is inflated incrementally,
+	//and unfiltered and thresholded row by row. besides the mask, only the 32KB window and two scanlines are kept
+	PngBandReader reader;
+	int band_y = 0;
+	return reader.Open(filename, threshold) && reader.ReadBand(reader.height, 0, mask, band_y);
+}
+
+//mirror the bit order of a byte
+static unsigned char ReverseBits(unsigned char b)
+{
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+bool DSSpace::SavePngMask(const char* filename, const BitMask& mask, int effort)
+{
+	//1-bit grey pixels, leftmost pixel in the high bit (mask words are leftmost-in-low-bit).
+	//lodepng's raw images have no padding between rows, so rows are byte-aligned only if width is a multiple of 8
+	std::vector<unsigned char> image(((size_t)mask.width * mask.height + 7) / 8);
+	if ((mask.width & 7) == 0)
+	{
+		const int line_bytes = mask.width / 8;
+		for (int y = 0; y < mask.height; y++)
+		{
+			const unsigned long long* row = mask.Row(y);
+			for (int i = 0; i < line_bytes; i++)
+				image[(size_t)y * line_bytes + i] = ReverseBits((row[i >> 3] >> ((i & 7) * 8)) & 0xff);
+		}
+	}
+	else
+	{
+		size_t bit = 0;
+		for (int y = 0; y < mask.height; y++)
+		{
+			for (int x = 0; x < mask.width; x++, bit++)
+			{
+				if (mask.Get(x, y))
+					image[bit >> 3] |= 0x80 >> (bit & 7);
+			}
+		}
+	}
+
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 1;
+	state.info_png.color.colortype = LCT_GREY;
+	state.info_png.color.bitdepth = 1;
+	state.encoder.auto_convert = 0;
+	state.encoder.filter_strategy = LFS_ZERO;  //filters don't pay off below 8 bits per pixel
+
+	LodePNGCompressSettings& zlib = state.encoder.zlibsettings;
+	if (effort <= 0)
+	{
+		zlib.btype = 0;  //stored, no compression
+	}
+	else if (effort == 1)
+	{
+		zlib.windowsize = 256;
+		zlib.nicematch = 32;
+		zlib.lazymatching = 0;
+	}
+	else if (effort >= 3)
+	{
+		zlib.windowsize = 32768;
+		zlib.nicematch = 258;
+	}
+
+	std::vector<unsigned char> png;
+	unsigned error = lodepng::encode(png, image, mask.width, mask.height, state);
+	if (!error)
+		error = lodepng::save_file(png, filename);
+	if (error)
+	{
+		cout << filename << " lodepng::encode error:" << error << " " << lodepng_error_text(error) << endl;
+		return false;
+	}
+	return true;
+}
+
+//read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	const unsigned char* data;
+	size_t size;
+
+	MappedFile()
+	{
+		data = NULL;
+		size = 0;
+#ifdef _WIN32
+		file = mapping = NULL;
+#endif
+	}
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const char* filename)
+	{
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			file = NULL;
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		{
+			Close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+			data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+		{
+			Close();
+			return false;
+		}
+		size = (size_t)file_size.QuadPart;
+#else
+		int file = open(filename, O_RDONLY);
+		if (file < 0)
+			return false;
+		struct stat file_stat;
+		if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+		{
+			void* address = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (address != MAP_FAILED)
+			{
+				data = (const unsigned char*)address;
+				size = file_stat.st_size;
+			}
+		}
+		close(file);
+		if (!data)
+			return false;
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file)
+			CloseHandle(file);
+		file = mapping = NULL;
+#else
+		if (data)
+			munmap((void*)data, size);
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+	MappedFile(const MappedFile&);  //not copyable
+	MappedFile& operator=(const MappedFile&);
+};
+
+static unsigned ReadLittleEndian32(const unsigned char* bytes)
+{
+	return (unsigned)bytes[0] | ((unsigned)bytes[1] << 8) | ((unsigned)bytes[2] << 16) | ((unsigned)bytes[3] << 24);
+}
+
+//binary PBM: "P4", width and height (whitespace separated, # comments), 1 whitespace, then rows of (width + 7) / 8 bytes,
+//leftmost pixel in the highest bit, 1 = black
+static bool LoadPbmMask(const MappedFile& file, BitMask& mask)
+{
+	const unsigned char* data = file.data;
+	const size_t size = file.size;
+	size_t pos = 2;  //after "P4"
+	long long values[2];
+	for (int i = 0; i < 2; i++)
+	{
+		//whitespace and comments
+		while (pos < size && (isspace(data[pos]) || data[pos] == '#'))
+		{
+			if (data[pos] == '#')
+			{
+				while (pos < size && data[pos] != '\n')
+					pos++;
+			}
+			else
+			{
+				pos++;
+			}
+		}
+		if (pos >= size || !isdigit(data[pos]))
+			return false;
+		values[i] = 0;
+		while (pos < size && isdigit(data[pos]) && values[i] <= INT_MAX)
+			values[i] = values[i] * 10 + (data[pos++] - '0');
+	}
+	const long long width = values[0];
+	const long long height = values[1];
+	if (width <= 0 || height <= 0 || width > INT_MAX || height > INT_MAX || pos >= size || !isspace(data[pos]))
+		return false;
+	pos++;
+
+	const size_t line_bytes = (size_t)(width + 7) / 8;
+	if ((size - pos) / line_bytes < (size_t)height)
+		return false;
+
+	mask.Resize((int)width, (int)height);
+	const unsigned long long last_word_mask = (width & 63) ? (1ull << (width & 63)) - 1 : ~0ull;
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned char* line = data + pos + y * line_bytes;
+		unsigned long long* row = mask.Row(y);
+		for (size_t i = 0; i < line_bytes; i++)
+			row[i >> 3] |= (unsigned long long)ReverseBits(~line[i]) << ((i & 7) * 8);
+		row[mask.words_per_row - 1] &= last_word_mask;
+	}
+	return true;
+}
+
+//raw bit mask file: a view of the mapping
+static bool LoadRawMask(const shared_ptr<MappedFile>& file, BitMask& mask)
+{
+	if (file->size < 16)
+		return false;
+	const long long width = ReadLittleEndian32(file->data + 4);
+	const long long height = ReadLittleEndian32(file->data + 8);
+	if (width <= 0 || height <= 0 || width > INT_MAX || height > INT_MAX)
+		return false;
+	const size_t words_per_row = (size_t)(width + 63) / 64;
+	if ((file->size - 16) / 8 / words_per_row < (size_t)height)
+		return false;
+
+	//the algorithms rely on zero padding bits
+	const unsigned long long* words = (const unsigned long long*)(file->data + 16);
+	if (width & 63)
+	{
+		for (size_t y = 0; y < (size_t)height; y++)
+		{
+			if (words[y * words_per_row + words_per_row - 1] >> (width & 63))
+				return false;
+		}
+	}
+
+	mask = BitMask();
+	mask.width = (int)width;
+	mask.height = (int)height;
+	mask.words_per_row = (int)words_per_row;
+	mask.view = words;
+	mask.view_owner = file;
+	return true;
+}
+
+bool DSSpace::LoadMask(const char* filename, int threshold, BitMask& mask)
+{
+	shared_ptr<MappedFile> file(new MappedFile());
+	if (!file->Open(filename))
+	{
+		cout << filename << " error: can't open/map the file" << endl;
+		return false;
+	}
+
+	if (file->size >= 8 && memcmp(file->data, "\x89PNG", 4) == 0)
+	{
+		file.reset();
+		return LoadPngMask(filename, threshold, mask);
+	}
+
+	bool ok = false;
+	if (file->size >= 2 && memcmp(file->data, "P4", 2) == 0)
+		ok = LoadPbmMask(*file, mask);
+	else if (file->size >= 4 && memcmp(file->data, "BMSK", 4) == 0)
+		ok = LoadRawMask(file, mask);
+	else
+	{
+		cout << filename << " error: unknown mask format (png, PBM P4 and raw bit masks are supported)" << endl;
+		return false;
+	}
+
+	if (!ok)
+		cout << filename << " error: broken header or too little pixel data" << endl;
+	return ok;
+}
+
+bool DSSpace::SaveRawMask(const char* filename, const BitMask& mask)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		cout << filename << " error: can't open the file for writing" << endl;
+		return false;
+	}
+
+	unsigned char header[16] = { 'B', 'M', 'S', 'K' };
+	for (int i = 0; i < 4; i++)
+	{
+		header[4 + i] = ((unsigned)mask.width >> (i * 8)) & 0xff;
+		header[8 + i] = ((unsigned)mask.height >> (i * 8)) & 0xff;
+	}
+	bool ok = fwrite(header, 1, 16, file) == 16;
+	for (int y = 0; y < mask.height && ok; y++)
+		ok = fwrite(mask.Row(y), sizeof(unsigned long long), mask.words_per_row, file) == mask.words_per_row;
+	fclose(file);
+
+	if (!ok)
+		cout << filename << " error: writing failed" << endl;
+	return ok;
+}
+
+//png integers are big-endian
+static unsigned ReadBigEndian32(const unsigned char* bytes)
+{
+	return ((unsigned)bytes[0] << 24) | ((unsigned)bytes[1] << 16) | ((unsigned)bytes[2] << 8) | (unsigned)bytes[3];
+}
+
+//canonical huffman code of the inflater. codes of up to 9 bits are decoded by a table lookup
+struct InflateHuffman
+{
+	short fast[512];  //(length << 9) | symbol, indexed by the next 9 (reversed) bits. -1: longer code
+	short counts[16];  //# of codes of every length
+	vector<short> symbols;  //symbols ordered by code
+
+	//return false if the code is over-subscribed
+	bool Build(const unsigned char* lengths, int num_symbols)
+	{
+		fill(counts, counts + 16, 0);
+		for (int i = 0; i < num_symbols; i++)
+			counts[lengths[i]]++;
+		counts[0] = 0;
+
+		int left = 1;
+		for (int len = 1; len < 16; len++)
+		{
+			left = (left << 1) - counts[len];
+			if (left < 0)
+				return false;
+		}
+
+		int offsets[16];
+		offsets[1] = 0;
+		for (int len = 1; len < 15; len++)
+			offsets[len + 1] = offsets[len] + counts[len];
+		symbols.assign(num_symbols, 0);
+		for (int i = 0; i < num_symbols; i++)
+		{
+			if (lengths[i] != 0)
+				symbols[offsets[lengths[i]]++] = i;
+		}
+
+		//codes are stored bit-reversed in the stream
+		fill(fast, fast + 512, -1);
+		int code = 0, index = 0;
+		for (int len = 1; len <= 9; len++)
+		{
+			for (int i = 0; i < counts[len]; i++, code++, index++)
+			{
+				int reversed = 0;
+				for (int b = 0; b < len; b++)
+					reversed |= ((code >> b) & 1) << (len - 1 - b);
+				for (int j = reversed; j < 512; j += 1 << len)
+					fast[j] = (short)((len << 9) | symbols[index]);
+			}
+			code <<= 1;
+		}
+		return true;
+	}
+};
+
+static const short INFLATE_LENGTH_BASES[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short INFLATE_LENGTH_EXTRAS[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int INFLATE_DISTANCE_BASES[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short INFLATE_DISTANCE_EXTRAS[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+//crc-32 of the png chunks, updated a byte at a time (lodepng_crc32 needs the whole chunk in memory)
+struct Crc32Table
+{
+	unsigned values[256];
+
+	Crc32Table()
+	{
+		for (unsigned i = 0; i < 256; i++)
+		{
+			unsigned c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			values[i] = c;
+		}
+	}
+};
+static const Crc32Table CRC32_TABLE;
+
+//decoder state of a PngBandReader: the file, an incremental zlib inflater over the IDAT chunks,
+//and the unfiltering scanlines.
+//(lodepng's inflater needs the whole output buffer, so this one follows the same format w/ a 32KB window instead)
+struct PngBandReader::Stream
+{
+	FILE* file;
+	vector<unsigned char> file_buffer;
+	size_t file_pos, file_end;
+	unsigned idat_left;  //bytes left in the current IDAT chunk
+	unsigned idat_crc;  //crc of the current IDAT chunk so far (w/o the final xor)
+	bool idat_done;
+
+	unsigned error;  //lodepng error code
+
+	//bit reader
+	unsigned long long bits;
+	int num_bits;
+	int num_padding_bytes;  //zero bytes appended past the end of the data
+
+	//inflater
+	enum { BLOCK_HEADER, STORED_BLOCK, HUFFMAN_BLOCK, END_OF_STREAM } state;
+	bool final_block;
+	unsigned stored_left;
+	int match_left, match_distance;
+	InflateHuffman literals, distances;
+	vector<unsigned char> window;
+	unsigned long long num_out;
+	unsigned adler_a, adler_b;  //adler-32 of the output so far (reduced every 5552 bytes)
+	int adler_count;
+
+	//png
+	LodePNGColorMode color;
+	bool palette_lands[256];
+	int width;
+	int threshold;
+	size_t line_bytes, bytewidth;
+	vector<unsigned char> filtered, recon, precon;
+	int num_rows_decoded;
+
+	BitMask history;  //already decoded rows that the next band needs again (its upper halo)
+	int history_y;
+
+	Stream()
+	{
+		file = NULL;
+		file_pos = file_end = 0;
+		idat_left = 0;
+		idat_crc = 0;
+		idat_done = false;
+		error = 0;
+		bits = 0;
+		num_bits = 0;
+		num_padding_bytes = 0;
+		state = BLOCK_HEADER;
+		final_block = false;
+		stored_left = 0;
+		match_left = match_distance = 0;
+		num_out = 0;
+		adler_a = 1;
+		adler_b = 0;
+		adler_count = 0;
+		width = threshold = 0;
+		line_bytes = bytewidth = 0;
+		num_rows_decoded = 0;
+		history_y = 0;
+	}
+	~Stream()
+	{
+		if (file)
+			fclose(file);
+	}
+
+	//buffered file reads
+	bool FileRead(unsigned char* out, size_t size)
+	{
+		while (size > 0)
+		{
+			if (file_pos == file_end)
+			{
+				file_buffer.resize(1 << 16);
+				file_end = fread(&file_buffer[0], 1, file_buffer.size(), file);
+				file_pos = 0;
+				if (file_end == 0)
+					return false;
+			}
+			size_t n = min(size, file_end - file_pos);
+			if (out)
+			{
+				memcpy(out, &file_buffer[file_pos], n);
+				out += n;
+			}
+			file_pos += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	//read a chunk header. type: 4 chars + '\0'
+	bool ReadChunkHeader(unsigned& length, char* type)
+	{
+		unsigned char header[8];
+		if (!FileRead(header, 8))
+			return false;
+		length = ReadBigEndian32(header);
+		memcpy(type, header + 4, 4);
+		type[4] = 0;
+		if (length > 2147483647u)
+		{
+			error = 63;
+			return false;
+		}
+		return true;
+	}
+
+	//an IDAT chunk's data follows (its header has been read)
+	void BeginIdat(unsigned length)
+	{
+		idat_left = length;
+		idat_crc = 0xffffffffu;
+		const char* type = "IDAT";
+		for (int i = 0; i < 4; i++)
+			idat_crc = CRC32_TABLE.values[(idat_crc ^ (unsigned char)type[i]) & 255] ^ (idat_crc >> 8);
+	}
+
+	//next byte of the zlib stream (the IDAT chunks' data put together). -1: end of data.
+	//every IDAT chunk's crc is checked once its data is read
+	int NextByte()
+	{
+		while (idat_left == 0)
+		{
+			if (idat_done)
+				return -1;
+			unsigned length;
+			char type[5];
+			unsigned char crc[4];
+			if (!FileRead(crc, 4))
+			{
+				idat_done = true;
+				return -1;
+			}
+			if (ReadBigEndian32(crc) != (idat_crc ^ 0xffffffffu))
+			{
+				if (!error)
+					error = 57;  //invalid CRC
+				idat_done = true;
+				return -1;
+			}
+			if (!ReadChunkHeader(length, type) || strcmp(type, "IDAT") != 0)
+			{
+				idat_done = true;
+				return -1;
+			}
+			BeginIdat(length);
+		}
+		unsigned char byte;
+		if (file_pos == file_end)
+		{
+			if (!FileRead(&byte, 1))
+			{
+				idat_done = true;
+				return -1;
+			}
+		}
+		else
+		{
+			byte = file_buffer[file_pos++];
+		}
+		idat_left--;
+		idat_crc = CRC32_TABLE.values[(idat_crc ^ byte) & 255] ^ (idat_crc >> 8);
+		return byte;
+	}
+
+	//make at least n (<= 56) bits available. past the end of the data, zeros are shifted in
+	//(to allow peeking), and consuming them is an error
+	void NeedBits(int n)
+	{
+		while (num_bits < n)
+		{
+			int byte = NextByte();
+			if (byte < 0)
+			{
+				byte = 0;
+				num_padding_bytes++;
+			}
+			bits |= (unsigned long long)byte << num_bits;
+			num_bits += 8;
+		}
+	}
+	void ConsumeBits(int n)
+	{
+		bits >>= n;
+		num_bits -= n;
+		if (num_bits < num_padding_bytes * 8 && !error)
+			error = 23;  //end of in buffer memory reached while inflating
+	}
+	int ReadBits(int n)
+	{
+		if (n == 0)
+			return 0;
+		NeedBits(n);
+		int value = (int)(bits & ((1ull << n) - 1));
+		ConsumeBits(n);
+		return value;
+	}
+
+	int DecodeSymbol(const InflateHuffman& huffman)
+	{
+		NeedBits(15);
+		int entry = huffman.fast[bits & 511];
+		if (entry >= 0)
+		{
+			ConsumeBits(entry >> 9);
+			return entry & 511;
+		}
+
+		//longer code: walk the canonical code bit by bit
+		int code = 0, first = 0, index = 0;
+		for (int len = 1; len < 16; len++)
+		{
+			code |= (int)((bits >> (len - 1)) & 1);
+			int count = huffman.counts[len];
+			if (code - first < count)
+			{
+				ConsumeBits(len);
+				return huffman.symbols[index + code - first];
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		error = 11;  //error in code tree
+		return -1;
+	}
+
+	bool ReadZlibHeader()
+	{
+		int cmf = ReadBits(8);
+		int flg = ReadBits(8);
+		if (error)
+			return false;
+		if ((cmf * 256 + flg) % 31 != 0)
+			error = 24;
+		else if ((cmf & 15) != 8 || (cmf >> 4) > 7)
+			error = 25;
+		else if ((flg >> 5) & 1)
+			error = 26;
+		return !error;
+	}
+
+	bool ReadDynamicTables()
+	{
+		static const int ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		int num_literals = ReadBits(5) + 257;
+		int num_distances = ReadBits(5) + 1;
+		int num_code_lengths = ReadBits(4) + 4;
+		if (num_literals > 286 || num_distances > 30)
+		{
+			error = 13;
+			return false;
+		}
+
+		unsigned char code_length_lengths[19] = { 0 };
+		for (int i = 0; i < num_code_lengths; i++)
+			code_length_lengths[ORDER[i]] = ReadBits(3);
+		InflateHuffman code_lengths;
+		if (!code_lengths.Build(code_length_lengths, 19))
+		{
+			error = 16;
+			return false;
+		}
+
+		unsigned char lengths[286 + 30] = { 0 };
+		int n = 0;
+		while (n < num_literals + num_distances && !error)
+		{
+			int symbol = DecodeSymbol(code_lengths);
+			if (symbol < 0)
+				return false;
+			if (symbol < 16)
+			{
+				lengths[n++] = symbol;
+				continue;
+			}
+
+			int value = 0, repeat = 0;
+			if (symbol == 16)
+			{
+				if (n == 0)
+				{
+					error = 54;  //repeat symbol w/o a previous value
+					return false;
+				}
+				value = lengths[n - 1];
+				repeat = 3 + ReadBits(2);
+			}
+			else if (symbol == 17)
+			{
+				repeat = 3 + ReadBits(3);
+			}
+			else
+			{
+				repeat = 11 + ReadBits(7);
+			}
+			if (n + repeat > num_literals + num_distances)
+			{
+				error = 14;
+				return false;
+			}
+			while (repeat-- > 0)
+				lengths[n++] = value;
+		}
+		if (error)
+			return false;
+		if (lengths[256] == 0)
+		{
+			error = 64;
+			return false;
+		}
+
+		if (!literals.Build(lengths, num_literals) || !distances.Build(lengths + num_literals, num_distances))
+		{
+			error = 16;
+			return false;
+		}
+		return true;
+	}
+
+	bool ReadBlockHeader()
+	{
+		final_block = ReadBits(1);
+		int type = ReadBits(2);
+		if (type == 0)
+		{
+			//stored: from the next byte boundary
+			ConsumeBits(num_bits & 7);
+			int len = ReadBits(16);
+			int nlen = ReadBits(16);
+			if (len + nlen != 65535)
+			{
+				error = 21;
+				return false;
+			}
+			stored_left = len;
+			state = STORED_BLOCK;
+		}
+		else if (type == 1)
+		{
+			unsigned char lengths[288 + 30];
+			fill(lengths, lengths + 144, 8);
+			fill(lengths + 144, lengths + 256, 9);
+			fill(lengths + 256, lengths + 280, 7);
+			fill(lengths + 280, lengths + 288, 8);
+			fill(lengths + 288, lengths + 318, 5);
+			literals.Build(lengths, 288);
+			distances.Build(lengths + 288, 30);
+			state = HUFFMAN_BLOCK;
+		}
+		else if (type == 2)
+		{
+			if (!ReadDynamicTables())
+				return false;
+			state = HUFFMAN_BLOCK;
+		}
+		else
+		{
+			error = 20;
+			return false;
+		}
+		return !error;
+	}
+
+	void Emit(unsigned char byte, unsigned char* out, size_t& produced)
+	{
+		window[num_out & 32767] = byte;
+		num_out++;
+		out[produced++] = byte;
+
+		adler_a += byte;
+		adler_b += adler_a;
+		if (++adler_count == 5552)  //(the largest run w/o an overflow)
+		{
+			adler_a %= 65521;
+			adler_b %= 65521;
+			adler_count = 0;
+		}
+	}
+
+	//after the final block: the adler-32 of the output (from the next byte boundary),
+	//then the rest of the IDAT chunks are read to check their crcs
+	void EndOfStream()
+	{
+		state = END_OF_STREAM;
+		ConsumeBits(num_bits & 7);
+		unsigned adler = 0;
+		for (int i = 0; i < 4; i++)
+			adler = (adler << 8) | (unsigned)ReadBits(8);
+		if (error)
+			return;
+		if (adler != ((adler_b % 65521) << 16 | (adler_a % 65521)))
+		{
+			error = 58;  //invalid ADLER32
+			return;
+		}
+		while (NextByte() >= 0)
+			;
+	}
+
+	//inflate up to size more bytes. return: # of bytes produced (fewer only at the end of the stream or on errors)
+	size_t Inflate(unsigned char* out, size_t size)
+	{
+		size_t produced = 0;
+		while (produced < size && !error)
+		{
+			if (match_left > 0)
+			{
+				Emit(window[(num_out - match_distance) & 32767], out, produced);
+				match_left--;
+			}
+			else if (state == STORED_BLOCK)
+			{
+				if (stored_left == 0)
+				{
+					if (final_block)
+						EndOfStream();
+					else
+						state = BLOCK_HEADER;
+					continue;
+				}
+				Emit(ReadBits(8), out, produced);
+				stored_left--;
+			}
+			else if (state == HUFFMAN_BLOCK)
+			{
+				int symbol = DecodeSymbol(literals);
+				if (symbol < 0)
+					break;
+				if (symbol < 256)
+				{
+					Emit(symbol, out, produced);
+				}
+				else if (symbol == 256)
+				{
+					if (final_block)
+						EndOfStream();
+					else
+						state = BLOCK_HEADER;
+				}
+				else
+				{
+					symbol -= 257;
+					if (symbol >= 29)
+					{
+						error = 16;
+						break;
+					}
+					match_left = INFLATE_LENGTH_BASES[symbol] + ReadBits(INFLATE_LENGTH_EXTRAS[symbol]);
+
+					int distance_symbol = DecodeSymbol(distances);
+					if (distance_symbol < 0)
+						break;
+					if (distance_symbol >= 30)
+					{
+						error = 18;
+						break;
+					}
+					match_distance = INFLATE_DISTANCE_BASES[distance_symbol] + ReadBits(INFLATE_DISTANCE_EXTRAS[distance_symbol]);
+					if (match_distance > num_out)
+					{
+						error = 52;
+						break;
+					}
+				}
+			}
+			else if (state == BLOCK_HEADER)
+			{
+				ReadBlockHeader();
+			}
+			else
+			{
+				break;  //end of stream
+			}
+		}
+		return produced;
+	}
+
+	//decode the next row into a bit row
+	bool ReadRow(unsigned long long* row)
+	{
+		if (Inflate(&filtered[0], filtered.size()) != filtered.size())
+		{
+			if (!error)
+				error = 91;  //invalid decompressed idat size
+			return false;
+		}
+		if (!UnfilterScanline(&recon[0], &filtered[1], num_rows_decoded > 0 ? &precon[0] : NULL, bytewidth, filtered[0], line_bytes))
+		{
+			error = 36;
+			return false;
+		}
+		ThresholdScanline(&recon[0], color, palette_lands, threshold, width, row);
+		recon.swap(precon);
+		num_rows_decoded++;
+		return true;
+	}
+
+	//after the last row: the stream must end there (its checksums are checked by EndOfStream)
+	bool Finish()
+	{
+		unsigned char extra;
+		if (Inflate(&extra, 1) != 0 && !error)
+			error = 91;  //invalid decompressed idat size
+		if (!error && state != END_OF_STREAM)
+			error = 23;  //end of in buffer memory reached while inflating
+		return !error;
+	}
+};
+
+PngBandReader::PngBandReader()
+{
+	width = height = next_row = 0;
+	stream = NULL;
+}
+
+PngBandReader::~PngBandReader()
+{
+	Close();
+}
+
+void PngBandReader::Close()
+{
+	delete stream;
+	stream = NULL;
+}
+
+bool PngBandReader::Open(const char* filename, int threshold)
+{
+	Close();
+	width = height = next_row = 0;
+	stream = new Stream();
+	Stream& s = *stream;
+
+	s.file = fopen(filename, "rb");
+	unsigned error = s.file ? 0 : 78;
+
+	//signature and header
+	unsigned char signature[8];
+	unsigned char header[13];
+	unsigned length = 0;
+	char type[5] = { 0 };
+	if (!error && (!s.FileRead(signature, 8) || !s.ReadChunkHeader(length, type)))
+		error = s.error ? s.error : 27;
+	if (!error && (signature[0] != 137 || signature[1] != 80 || signature[2] != 78 || signature[3] != 71))
+		error = 28;
+	if (!error && strcmp(type, "IHDR") != 0)
+		error = 29;
+	if (!error && length != 13)
+		error = 94;
+	if (!error && !s.FileRead(header, 13))
+		error = 27;
+
+	if (!error)
+	{
+		width = ReadBigEndian32(header);
+		height = ReadBigEndian32(header + 4);
+		unsigned bitdepth = header[8];
+		LodePNGColorType colortype = (LodePNGColorType)header[9];
+		bool valid_depth = false;
+		if (colortype == LCT_GREY)
+			valid_depth = bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8 || bitdepth == 16;
+		else if (colortype == LCT_PALETTE)
+			valid_depth = bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8;
+		else if (colortype == LCT_RGB || colortype == LCT_GREY_ALPHA || colortype == LCT_RGBA)
+			valid_depth = bitdepth == 8 || bitdepth == 16;
+		else
+			error = 31;
+
+		if (width <= 0 || height <= 0)
+			error = 93;
+		else if (!error && !valid_depth)
+			error = 37;
+		else if (!error && header[10] != 0)
+			error = 32;
+		else if (!error && header[11] != 0)
+			error = 33;
+		else if (!error && header[12] > 1)
+			error = 34;
+		else if (!error && header[12] == 1)
+		{
+			cout << filename << " interlaced pngs can't be read in bands" << endl;
+			Close();
+			return false;
 		}
+		s.color = lodepng_color_mode_make(colortype, bitdepth);
 	}
 
-	//key: 0-based land_index * (num_components) + 0-based water_index. value: <index-index, size>
-	unordered_map<int, pair<Vec2i,int>> boundaries_map; 
-	for (int i = 0; i < F0F1s.size(); i++)
+	//chunks before the image data: keep the palette
+	fill(s.palette_lands, s.palette_lands + 256, 0 >= threshold);  //lodepng makes out-of-palette indices black
+	while (!error)
 	{
-		pair<Vec2i, pair<bool, int>>& F0 = F0F1s[i].first;
-		pair<Vec2i, pair<bool, int>>& F1 = F0F1s[i].second;
-		
-		//is F0 a land pixel and F1 a water pixel?
-		if (F0.second.first == false && F1.second.first == true)
+		if (!s.FileRead(NULL, 4/*CRC*/) || !s.ReadChunkHeader(length, type))
 		{
-			boundaries_map[F0.second.second * (num_lands+num_waters) + F1.second.second].first = 
-				Vec2i(F0.second.second, F1.second.second + num_lands /*actual component index of this water component*/);
-			boundaries_map[F0.second.second * (num_lands + num_waters) + F1.second.second].second++;
+			error = s.error ? s.error : 30;
+			break;
+		}
+		if (strcmp(type, "IDAT") == 0)
+		{
+			s.BeginIdat(length);
+			break;
+		}
+
+		vector<unsigned char> data(length);
+		if (length > 0 && !s.FileRead(&data[0], length))
+		{
+			error = 30;
+			break;
+		}
+		if (strcmp(type, "PLTE") == 0)
+		{
+			for (unsigned i = 0; i < length / 3 && i < 256; i++)
+				s.palette_lands[i] = data[i * 3] >= threshold && data[i * 3 + 1] >= threshold && data[i * 3 + 2] >= threshold;
+		}
+		else if (strcmp(type, "IEND") == 0)
+		{
+			error = 91;  //no image data
 		}
 	}
-	//to vector
-	for (unordered_map<int, pair<Vec2i,int>>::iterator itr = boundaries_map.begin(); itr != boundaries_map.end(); itr++)
+
+	if (!error)
 	{
-		if(g_ds_print_debug)
-			cout << (*itr).second.first << " size:" << (*itr).second.second << endl;
-		boundaries.push_back((*itr).second);
+		s.width = width;
+		s.threshold = threshold;
+		s.line_bytes = lodepng_get_raw_size(width, 1, &s.color);
+		s.bytewidth = (lodepng_get_bpp(&s.color) + 7) / 8;
+		s.filtered.resize(s.line_bytes + 1);
+		s.recon.resize(s.line_bytes);
+		s.precon.resize(s.line_bytes);
+		s.window.resize(32768);
+		s.history.Resize(width, 0);
+		s.ReadZlibHeader();
+		error = s.error;
 	}
 
+	if (error)
+	{
+		cout << filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+		Close();
+		return false;
+	}
 	return true;
 }
 
-
-bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_metrics)
+bool PngBandReader::ReadBand(int num_rows, int halo, BitMask& band, int& band_y)
 {
-	std::vector<unsigned char> in_buffer; //the raw pixels (RGBA)
-	unsigned width = 0, height = 0;
-	unsigned error = lodepng::decode(in_buffer, width, height, input_filename);
-	if (error)
+	if (!stream)
+		return false;
+	Stream& s = *stream;
+
+	if (next_row >= height)
+	{
+		band.Resize(width, 0);
+		band_y = height;
+		return true;
+	}
+
+	//core rows [core_begin, core_end), band rows [begin, end)
+	int core_begin = next_row;
+	int core_end = min(height, next_row + max(1, num_rows));
+	int begin = max(0, core_begin - halo);
+	int end = min(height, core_end + halo);
+	if (begin < s.history_y && begin < s.num_rows_decoded)
 	{
-		cout << input_filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+		cout << "[PngBandReader] error: the halo grew between bands" << endl;
 		return false;
 	}
 
-	if ((width % g_ds_bigpixel_width) != 0 || (height % g_ds_bigpixel_height) != 0)
+	band.Resize(width, end - begin);
+	band_y = begin;
+	const size_t row_bytes = band.words_per_row * sizeof(unsigned long long);
+	for (int y = begin; y < end; y++)
+	{
+		if (y < s.num_rows_decoded)
+		{
+			memcpy(band.Row(y - begin), s.history.Row(y - s.history_y), row_bytes);
+		}
+		else if (!s.ReadRow(band.Row(y - begin)) || (y == height - 1 && !s.Finish()))
+		{
+			cout << "[PngBandReader] row " << y << " lodepng::decode error:" << s.error << " " << lodepng_error_text(s.error) << endl;
+			return false;
+		}
+	}
+
+	//keep the rows the next band's upper halo will need
+	int keep_begin = max(begin, core_end - halo);
+	s.history.Resize(width, end - keep_begin);
+	s.history_y = keep_begin;
+	for (int y = keep_begin; y < end; y++)
+		memcpy(s.history.Row(y - keep_begin), band.Row(y - begin), row_bytes);
+
+	next_row = core_end;
+	return true;
+}
+
+//band mode of DownsamplePng: the input is streamed in bands of options.band_height big-pixel rows
+//(+ tile_halo rows of big-pixels above and below), and each band is downsampled on its own.
+//topology is preserved within the bands; components crossing band seams are only seen through the halos
+//weighted vote of big-pixel rows (defined w/ DownsampleVote below), the fallback of failed bands
+static int VoteFootprint(const DownsampleOptions& options, vector<int>& half_widths);
+static void DownsampleVoteRows(const BitMask& band, int band_y, int image_height, const DownsampleOptions& options,
+	const vector<int>& half_widths, int Y0, int Y1, BitMask& output);
+
+static bool DownsamplePngBands(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result)
+{
+	PngBandReader reader;
+	if (!reader.Open(input_filename, options.png_threshold))
+		return false;
+
+	const int width = reader.width;
+	const int height = reader.height;
+	if ((width % options.bigpixel_width) != 0 || (height % options.bigpixel_height) != 0)
 	{
 		cout << "error: width / height not dividable!" << endl;
 		return false;
 	}
 
-	//turn the image buffer to a binary mask buffer
-	bool* mask_ori = new bool[width * height];
-	for (int y = 0; y < height; y++)
+	const int new_width = width / options.bigpixel_width;
+	const int new_height = height / options.bigpixel_height;
+	const int band_rows = options.band_height * options.bigpixel_height;
+	const int halo_rows = max(0, options.tile_halo) * options.bigpixel_height;
+	vector<int> vote_half_widths;
+	VoteFootprint(options, vote_half_widths);
+
+	result.input = BitMask();
+	result.output.Resize(new_width, new_height);
+	result.input_components.clear();
+	result.output_components.clear();
+
+	DWORD time_begin = timeGetTime();
+	int num_bands = 0, num_failed_bands = 0;
+	BitMask band;
+	while (reader.next_row < height)
 	{
-		for (int x = 0; x < width; x++)
+		int core_begin = reader.next_row;
+		int band_y = 0;
+		if (!reader.ReadBand(band_rows, halo_rows, band, band_y))
+			return false;
+		int core_end = reader.next_row;
+
+		LabelMap labels;
+		LabelComponents(band, labels, options.print_debug);
+
+		const int band_new_height = band.height / options.bigpixel_height;
+		vector<char> output_buffer(new_width * band_new_height);
+		bool* output = (bool*)&output_buffer[0];
+		int status = 0;
+		if (options.tile_size > 0)
+			status = DownsampleTiled(labels, options, output, NULL, NULL, &result.solver_stats);
+		else
+			status = Downsample(labels, options, output, NULL, NULL, NULL, NULL, &result.solver_stats);
+		if (status != 0)
 		{
-			int offset = (y * width + x) * 4;
-			Vec4<unsigned char> p(in_buffer[offset], in_buffer[offset + 1], in_buffer[offset + 2], in_buffer[offset + 3]);
+			//cutting components at the band's edges can make it infeasible. fall back to the weighted vote (see DownsampleVote) there.
+			//the band is taken as the whole image: rows out of the band are never read. the same as --vote if the halo covers
+			//the vote footprint's radius (otherwise the core rows near the band's edges lose the rest of their footprints)
+			cout << "[DownsamplePng] warning: band of rows " << core_begin << "-" << core_end << " failed. weighted vote used" << endl;
+			int core_Y0 = (core_begin - band_y) / options.bigpixel_height;
+			int core_Y1 = (core_end - band_y) / options.bigpixel_height;
+			BitMask vote_output(new_width, band_new_height);
+			DownsampleVoteRows(band, 0, band.height, options, vote_half_widths, core_Y0, core_Y1, vote_output);
+			for (int Y = core_Y0; Y < core_Y1; Y++)
+			{
+				for (int X = 0; X < new_width; X++)
+					output[Y * new_width + X] = vote_output.Get(X, Y);
+			}
+			num_failed_bands++;
+		}
 
-			//binarilization: <threshold = black, >threshold = white
-			if (p[0] >= g_ds_png_treshold && p[1] >= g_ds_png_treshold && p[2] >= g_ds_png_treshold)
+		//keep the core rows of the band
+		for (int Y = core_begin / options.bigpixel_height; Y < core_end / options.bigpixel_height; Y++)
+		{
+			int band_Y = Y - band_y / options.bigpixel_height;
+			for (int X = 0; X < new_width; X++)
 			{
-				mask_ori[y * width + x] = true;
+				if (output[band_Y * new_width + X])
+					result.output.Set(X, Y, true);
 			}
-			else
+		}
+		num_bands++;
+	}
+	cout << "[DownsamplePng] bands:" << num_bands << " (" << options.band_height << " big-pixel rows + halo " << options.tile_halo <<
+		") failed bands:" << num_failed_bands << " time:" << timeGetTime() - time_begin << endl;
+	if (options.calculate_error_metrics)
+		cout << "[DownsamplePng] error metrics need the whole input, skipped in band mode" << endl;
+
+	result.h_offset = result.v_offset = 0;
+	if (options.save)
+	{
+		string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
+		output_filename += ".lw" + to_string(options.land_weight);
+		if (options.neighborhood_offset != 0)
+			output_filename += ".no" + to_string(options.neighborhood_offset);
+		output_filename += ".png";
+
+		SavePngMask(output_filename.c_str(), result.output, options.png_effort);
+	}
+	return true;
+}
+
+//pyramid mode of DownsamplePng: level k has big-pixels 2^k times the size of options' (k = 0 ~ options.pyramid_levels - 1).
+//every level is downsampled from the input, so the levels share its label map and component indices.
+//a level's output components, upsampled 2x, are the warm start hints of the next finer level
+static bool DownsamplePngPyramid(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result)
+{
+	BitMask& mask = result.input;
+	if (!LoadMask(input_filename, options.png_threshold, mask))
+		return false;
+	const int width = mask.width;
+	const int height = mask.height;
+
+	//levels whose big-pixels divide the image
+	int num_levels = 0;
+	while (num_levels < options.pyramid_levels &&
+		(width % (options.bigpixel_width << num_levels)) == 0 && (height % (options.bigpixel_height << num_levels)) == 0)
+		num_levels++;
+	if (num_levels == 0)
+	{
+		cout << "error: width / height not dividable!" << endl;
+		return false;
+	}
+	if (num_levels < options.pyramid_levels)
+		cout << "[DownsamplePng] pyramid: only " << num_levels << " levels divide the image" << endl;
+	if (options.alternative_offsets || options.save_components_to_file)
+		cout << "[DownsamplePng] pyramid: alternative offsets and component maps are not supported, skipped" << endl;
+
+	DWORD time_begin = timeGetTime();
+	LabelMap labels;
+	LabelComponents(mask, labels, options.print_debug);
+
+	result.levels.assign(num_levels, BitMask());
+	vector<int> hints;  //hinted component of every big-pixel of the level (empty = no hints)
+	int num_hinted_levels = 0;
+	for (int level = num_levels - 1; level >= 0; level--)
+	{
+		DownsampleOptions level_options = options;
+		level_options.bigpixel_width = options.bigpixel_width << level;
+		level_options.bigpixel_height = options.bigpixel_height << level;
+		int new_width = width / level_options.bigpixel_width;
+		int new_height = height / level_options.bigpixel_height;
+
+		DWORD time_level = timeGetTime();
+		vector<char> output_buffer(new_width * new_height);
+		vector<int> output_components(new_width * new_height, -1);
+		bool* output = (bool*)&output_buffer[0];
+		int status = 0;
+		if (options.tile_size > 0)
+			status = DownsampleTiled(labels, level_options, output, &output_components[0], NULL, &result.solver_stats);  //(tiles have their own labels)
+		else
+			status = Downsample(labels, level_options, output, &output_components[0], NULL, NULL, hints.empty() ? NULL : &hints[0], &result.solver_stats);
+		if (!hints.empty())
+			num_hinted_levels++;
+
+		hints.clear();
+		if (status != 0)
+		{
+			cout << "[DownsamplePng] pyramid level " << level << " (" << new_width << "x" << new_height << ") failed" << endl;
+			continue;  //the next level goes w/o hints
+		}
+
+		BitMask& level_output = result.levels[level];
+		PackMask(new_width, new_height, output, level_output);
+
+		float IoU = 0, Dice = 0, Precision = 0, Recall = 0;
+		if (options.calculate_error_metrics)
+			ErrorMetrics(mask, level_output, IoU, Dice, Precision, Recall);
+		if (level == 0)
+		{
+			result.IoU = IoU;
+			result.Dice = Dice;
+			result.Precision = Precision;
+			result.Recall = Recall;
+		}
+		cout << "[DownsamplePng] pyramid level " << level << " (" << new_width << "x" << new_height << ") time:" <<
+			timeGetTime() - time_level << endl;
+
+		if (options.save)
+		{
+			string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
+			output_filename += ".lw" + to_string(options.land_weight);
+			if (options.neighborhood_offset != 0)
+				output_filename += ".no" + to_string(options.neighborhood_offset);
+			output_filename += ".png";
+
+			SavePngMask(output_filename.c_str(), level_output, options.png_effort);
+		}
+
+		//hints of the next finer level: every big-pixel takes the component of its coarse big-pixel
+		if (level > 0)
+		{
+			int fine_width = new_width * 2;
+			int fine_height = new_height * 2;
+			hints.resize(fine_width * fine_height);
+			for (int Y = 0; Y < fine_height; Y++)
 			{
-				mask_ori[y * width + x] = false;
+				for (int X = 0; X < fine_width; X++)
+				{
+					hints[Y * fine_width + X] = output_components[(Y / 2) * new_width + X / 2];
+				}
 			}
 		}
 	}
+	cout << "[DownsamplePng] pyramid levels:" << num_levels << " hinted levels:" << num_hinted_levels <<
+		" time:" << timeGetTime() - time_begin << endl;
+
+	result.h_offset = result.v_offset = 0;
+	result.output = result.levels[0];
+	return result.output.width > 0;
+}
+
+bool DSSpace::DownsamplePng(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result)
+{
+	//no topology preservation: a weighted majority vote per big-pixel
+	if (options.vote)
+		return DownsampleVotePng(input_filename, options, result);
+
+	//too large to load? stream it in bands
+	if (options.band_height > 0)
+		return DownsamplePngBands(input_filename, options, result);
+
+	//all levels of a pyramid in one run
+	if (options.pyramid_levels > 1)
+		return DownsamplePngPyramid(input_filename, options, result);
+
+	//load the input straight into a binary mask (the result's input mask)
+	BitMask& mask_ori = result.input;
+	if (!LoadMask(input_filename, options.png_threshold, mask_ori))
+		return false;
+	const int width = mask_ori.width;
+	const int height = mask_ori.height;
+
+	if ((width % options.bigpixel_width) != 0 || (height % options.bigpixel_height) != 0)
+	{
+		cout << "error: width / height not dividable!" << endl;
+		return false;
+	}
 
 	//test fill holes?
 	//FillHoles(width, height, 2, mask_ori);
@@ -551,153 +2320,179 @@ bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_met
 		delete tmp;
 	}*/
 
-	//save input buffer to global
-	g_ds_input_size = Vec2i(width, height);
-	g_ds_input.clear();
-	g_ds_input.resize(width * height);
-	for (int i = 0; i < width * height; i++)
-	{
-		g_ds_input[i] = mask_ori[i];
-	}
-
 	//multuple input masks w/ alternative offsets?
-	vector<bool*> masks;
-	vector<Vec2i> offsets;  //corresponding {h-offset and v-offset} for every masks
-	
-	masks.push_back(mask_ori);  //default:
-	offsets.push_back(Vec2i(0, 0));
+	vector<Vec2i> offsets;  //{h-offset and v-offset} for every mask
+	offsets.push_back(Vec2i(0, 0));  //default:
 
-	if (g_ds_alternative_offsets)
+	if (options.alternative_offsets)
 	{
-		int h_offset_step = g_ds_bigpixel_width / 4;
-		int v_offset_step = g_ds_bigpixel_height / 4;
+		int h_offset_step = options.bigpixel_width / 4;
+		int v_offset_step = options.bigpixel_height / 4;
 		/*h_offset_step = 1;
 		v_offset_step = 1;*/
 
 		//create more alternative versions of mask buffers w/ horizontal and vertical shifts
-		for (int h_offset = 0; h_offset <= g_ds_bigpixel_width / 2; h_offset += h_offset_step)
+		for (int h_offset = 0; h_offset <= options.bigpixel_width / 2; h_offset += h_offset_step)
 		{
-			for (int v_offset = 0; v_offset <= g_ds_bigpixel_height / 2; v_offset += v_offset_step)
+			for (int v_offset = 0; v_offset <= options.bigpixel_height / 2; v_offset += v_offset_step)
 			{
 				if (h_offset == 0 && v_offset == 0)
 					continue;  //skip default one
 
-				bool* mask_ = new bool[width * height];
-				for (int y = 0; y < height; y++)
-				{
-					for (int x = 0; x < width; x++)
-					{
-						//corresponding pos in original buffer?
-						int x_ = x - h_offset;
-						int y_ = y - v_offset;
-						if (x_ < 0 || y_ < 0)
-						{
-							mask_[y * width + x] = false;
-						}
-						else
-						{
-							mask_[y * width + x] = mask_ori[y_ * width + x_];
-						}
-					}
-				}
-
-				masks.push_back(mask_);
 				offsets.push_back(Vec2i(h_offset, v_offset));
 			}
 		}
 	}
+	
+	//shifted versions of the mask
+	vector<BitMask> masks(offsets.size());
+	for (int i = 1; i < offsets.size(); i++)
+	{
+		ShiftMask(mask_ori, offsets[i].x, offsets[i].y, masks[i]);
+	}
 
-	int new_width = width / g_ds_bigpixel_width;
-	int new_height = height / g_ds_bigpixel_height;
+	int new_width = width / options.bigpixel_width;
+	int new_height = height / options.bigpixel_height;
+	int num_variants = masks.size();
+
+	//the mask variants are solved concurrently. the solver threads are split between the workers
+	int num_workers = (options.offset_workers > 0) ? options.offset_workers : omp_get_max_threads();
+	num_workers = max(1, min(num_workers, num_variants));
+	DownsampleOptions worker_options = options;
+	if (options.milp_threads > 0)
+		worker_options.milp_threads = max(1, options.milp_threads / num_workers);
+	else if (num_workers > 1)
+		worker_options.milp_threads = max(1, omp_get_num_procs() / num_workers);
+
+	//results of every variant
+	vector<int> statuses(num_variants, -1);  //-1 = not solved (cancelled)
+	vector<float> IoUs(num_variants, 0), Dices(num_variants, 0), Precisions(num_variants, 0), Recalls(num_variants, 0);
+	vector<BitMask> outputs(num_variants);
+	vector<vector<int>> input_components(num_variants);
+	vector<vector<int>> output_components(num_variants);
+	vector<SolverStats> solver_stats(num_variants);
+
+	//first-acceptable policy: once a variant reaches the target IoU, the rest are cancelled
+	atomic<bool> accepted(false);
 
-	//try all mask buffers, keep the one w/ best error metrics
-	float best_score = -1;
-	for (int i = 0; i < masks.size(); i++)
+	DWORD time_begin = timeGetTime();
+#pragma omp parallel for schedule(dynamic) num_threads(num_workers) if(num_workers > 1)
+	for (int i = 0; i < num_variants; i++)
 	{
-		bool* output = new bool[new_width * new_height];
-		float IoU = 0, Dice = 0, Precision = 0, Recall = 0;
-		if (Downsample(width, height, masks[i], g_ds_bigpixel_width, g_ds_bigpixel_height, output) == 0)
+		if (accepted)
+			continue;
+
+		const BitMask& mask = (i == 0) ? mask_ori : masks[i];
+		LabelMap labels;
+		LabelComponents(mask, labels, options.print_debug);
+
+		vector<char> output_buffer(new_width * new_height);
+		output_components[i].resize(new_width * new_height);
+		bool* output = (bool*)&output_buffer[0];
+		int status = 0;
+		if (options.tile_size > 0)
+			status = DownsampleTiled(labels, worker_options, output, &output_components[i][0], &accepted, &solver_stats[i]);
+		else
+			status = Downsample(labels, worker_options, output, &output_components[i][0], NULL, &accepted, NULL, &solver_stats[i]);
+		if (status == 0)
 		{
+			PackMask(new_width, new_height, output, outputs[i]);
+
 			//calculate error metrics?
 			//(must need to do if alternative offsets are taken)
-			if(calculate_error_metrics || g_ds_alternative_offsets)
-				ErrorMetrics(width, height, masks[i], new_width, new_height, output, 
-					IoU, Dice, Precision, Recall);
+			if (options.calculate_error_metrics || options.alternative_offsets)
+				ErrorMetrics(mask, outputs[i], IoUs[i], Dices[i], Precisions[i], Recalls[i]);
 
-			//best one so far? save to output
-			if (g_ds_output.size() == 0 /*first one?*/ || IoU > best_score /*consider what?*/)
-			{
-				g_ds_output_size = Vec2i(new_width, new_height);
-				g_ds_output.clear();
-				g_ds_output.resize(new_width * new_height);
-				for (int i = 0; i < new_width * new_height; i++)
-				{
-					g_ds_output[i] = output[i];
-				}
+			if (options.save_components_to_file)
+				input_components[i] = labels.ids;
 
-				best_score = IoU;
+			if (options.target_IoU > 0 && IoUs[i] >= options.target_IoU)
+				accepted = true;
+		}
+		statuses[i] = status;
+	}
 
-				//record the best offset:
-				g_ds_h_offset = offsets[i].x;
-				g_ds_v_offset = offsets[i].y;
-			}
+	//keep the one w/ best error metrics (the first one among ties)
+	int best = -1;
+	for (int i = 0; i < num_variants; i++)
+	{
+		if (statuses[i] == 0 && (best < 0 || IoUs[i] > IoUs[best] /*consider what?*/))
+			best = i;
+	}
+
+	if (options.alternative_offsets)
+	{
+		int num_solved = 0;
+		for (int i = 0; i < num_variants; i++)
+		{
+			if (statuses[i] >= 0)
+				num_solved++;
 		}
-		
-		delete output;
+		cout << "[DownsamplePng] offset variants:" << num_variants << " solved:" << num_solved << " workers:" << num_workers <<
+			" solver threads:" << worker_options.milp_threads << (accepted ? " (target IoU reached)" : "") << " time:" << timeGetTime() - time_begin << endl;
+		if (best >= 0)
+			cout << "[DownsamplePng] best offset:" << offsets[best] << " IoU:" << IoUs[best] << endl;
 	}
 
-	for (int i = 0; i < masks.size(); i++)
+	const SolverStats& stats = solver_stats[best >= 0 ? best : 0];
+	if (options.print_debug)
 	{
-		delete masks[i];
+		cout << "[DownsamplePng] solver: solves:" << stats.num_solves << " status:" << stats.status << " time:" << stats.runtime <<
+			" nodes:" << stats.node_count << " gap:" << stats.gap << endl;
 	}
-	
-	if (g_ds_output.size() == 0)  //failed?
+
+	//save the best one to the result
+	result.output = BitMask();
+	result.input_components.clear();
+	result.output_components.clear();
+	result.solver_stats = stats;
+	if (best >= 0)
+	{
+		result.output = outputs[best];
+
+		//record the best offset and its error metrics:
+		result.h_offset = offsets[best].x;
+		result.v_offset = offsets[best].y;
+		result.IoU = IoUs[best];
+		result.Dice = Dices[best];
+		result.Precision = Precisions[best];
+		result.Recall = Recalls[best];
+
+		if (options.save_components_to_file)
+		{
+			result.input_components = input_components[best];
+			result.output_components = output_components[best];
+			for (int i = 0; i < new_width * new_height; i++)
+			{
+				if (result.output_components[i] < 0)
+					result.output_components[i] = 999999;
+			}
+		}
+	}
+
+	if (best < 0)  //failed?
 	{
 		return false;
 	}
 	else
 	{
 		//save output to a png file
-		if (g_ds_save)
+		if (options.save)
 		{
-			std::vector<unsigned char> out_buffer(new_width * new_height * 4);
-			for (int y = 0; y < new_height; y++)
-			{
-				for (int x = 0; x < new_width; x++)
-				{
-					int offset = (y * new_width + x) * 4;
-
-					if (g_ds_output[y * new_width + x])
-					{
-						//white
-						out_buffer[offset] = 255;
-						out_buffer[offset + 1] = 255;
-						out_buffer[offset + 2] = 255;
-						out_buffer[offset + 3] = 255;
-					}
-					else
-					{
-						//black
-						out_buffer[offset] = 0;
-						out_buffer[offset + 1] = 0;
-						out_buffer[offset + 2] = 0;
-						out_buffer[offset + 3] = 255;
-					}
-				}
-			}
-
 			string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
-			output_filename += ".lw" + to_string(g_ds_land_weight);
+			output_filename += ".lw" + to_string(options.land_weight);
+			if (options.neighborhood_offset != 0)
+				output_filename += ".no" + to_string(options.neighborhood_offset);
 			output_filename += ".png";
 
-			lodepng::encode(output_filename, out_buffer, new_width, new_height);
+			SavePngMask(output_filename.c_str(), result.output, options.png_effort);
 		}
 
 		//save component flags?
-		if (g_ds_save_components_to_file)
+		if (options.save_components_to_file)
 		{
 			//save input component indices to png file:
-			if (g_ds_input_components.size() == width * height)
+			if (result.input_components.size() == width * height)
 			{
 				std::vector<unsigned char> buffer(width * height * 4);
 				for (int y = 0; y < height; y++)
@@ -707,7 +2502,7 @@ bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_met
 						int offset = (y * width + x) * 4;
 
 						//to color:
-						int index = g_ds_input_components[y * width + x] * 5;
+						int index = result.input_components[y * width + x] * 5;
 						Vec3i color(index % 256, (index / 256) % 256, (index / 65536) % 256);
 
 						buffer[offset] = color[0];
@@ -722,7 +2517,7 @@ bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_met
 			}
 
 			//save output component indices to png file:
-			if (g_ds_output_components.size() == new_width * new_height)
+			if (result.output_components.size() == new_width * new_height)
 			{
 				std::vector<unsigned char> buffer(new_width* new_height * 4);
 				for (int y = 0; y < new_height; y++)
@@ -732,7 +2527,7 @@ bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_met
 						int offset = (y * new_width + x) * 4;
 
 						//to color:
-						int index = g_ds_output_components[y * new_width + x] * 5;
+						int index = result.output_components[y * new_width + x] * 5;
 						Vec3i color(index % 256, (index / 256) % 256, (index / 65536) % 256);
 
 						buffer[offset] = color[0];
@@ -752,13 +2547,109 @@ bool DSSpace::DownsamplePng(const char* input_filename, bool calculate_error_met
 	}
 }
 
-bool DSSpace::Thinning(int width, int height, bool* input/*size = width*height*/, bool* output/*size = width*height */)
+int DSSpace::DownsampleBatch(vector<BatchJob>& jobs, int num_workers, const char* summary_filename)
 {
-	//copy input to output. we will work on output buffer only
-	for (int i = 0; i < width * height; i++)
+	int num_jobs = jobs.size();
+	if (num_workers <= 0)
+		num_workers = omp_get_max_threads();
+	num_workers = max(1, min(num_workers, num_jobs));
+
+	DWORD time_begin = timeGetTime();
+	int num_succeeded = 0;
+#pragma omp parallel for schedule(dynamic) num_threads(num_workers) if(num_workers > 1) reduction(+:num_succeeded)
+	for (int i = 0; i < num_jobs; i++)
+	{
+		BatchJob& job = jobs[i];
+
+		//split the solver threads between the workers (like the offset variants of DownsamplePng)
+		DownsampleOptions options = job.options;
+		if (options.milp_threads > 0)
+			options.milp_threads = max(1, options.milp_threads / num_workers);
+		else if (num_workers > 1)
+			options.milp_threads = max(1, omp_get_num_procs() / num_workers);
+
+		DWORD job_begin = timeGetTime();
+		DownsampleResult result;
+		job.success = DownsamplePng(job.input_filename.c_str(), options, result);
+		job.time = timeGetTime() - job_begin;
+		job.output_width = result.output.width;
+		job.output_height = result.output.height;
+		job.IoU = result.IoU;
+		job.Dice = result.Dice;
+		job.Precision = result.Precision;
+		job.Recall = result.Recall;
+		job.solver_stats = result.solver_stats;
+		if (job.success)
+			num_succeeded++;
+	}
+	cout << "[DownsampleBatch] jobs:" << num_jobs << " succeeded:" << num_succeeded << " workers:" << num_workers <<
+		" time:" << timeGetTime() - time_begin << endl;
+
+	//summary: a row per job, in the order of the jobs
+	if (summary_filename != NULL && summary_filename[0] != 0)
 	{
-		output[i] = input[i];
+		FILE* file = fopen(summary_filename, "w");
+		if (!file)
+		{
+			cout << "error: cannot write " << summary_filename << endl;
+			return num_succeeded;
+		}
+		fprintf(file, "input,bigpixel_width,bigpixel_height,land_weight,neighborhood_offset,success,time_ms,"
+			"output_width,output_height,IoU,Dice,Precision,Recall,solver_status,solver_time,nodes,gap\n");
+		for (int i = 0; i < num_jobs; i++)
+		{
+			const BatchJob& job = jobs[i];
+
+			//quote the filename (doubling its quotes) if it has a comma or a quote
+			string input = job.input_filename;
+			if (input.find_first_of(",\"") != string::npos)
+			{
+				string quoted = "\"";
+				for (int c = 0; c < input.size(); c++)
+				{
+					if (input[c] == '"')
+						quoted += '"';
+					quoted += input[c];
+				}
+				input = quoted + "\"";
+			}
+
+			fprintf(file, "%s,%d,%d,%d,%d,%d,%d,%d,%d,", input.c_str(), job.options.bigpixel_width, job.options.bigpixel_height,
+				job.options.land_weight, job.options.neighborhood_offset, job.success ? 1 : 0, job.time, job.output_width, job.output_height);
+			if (job.success && (job.options.calculate_error_metrics || job.options.alternative_offsets) && job.options.band_height <= 0)
+				fprintf(file, "%f,%f,%f,%f,", job.IoU, job.Dice, job.Precision, job.Recall);
+			else
+				fprintf(file, ",,,,");  //not calculated (or band mode)
+			const SolverStats& stats = job.solver_stats;
+			fprintf(file, "%d,%f,%.0f,", stats.status, stats.runtime, stats.node_count);
+			if (stats.gap < INFINITY)
+				fprintf(file, "%g\n", stats.gap);
+			else
+				fprintf(file, "\n");  //no solution found
+		}
+		fclose(file);
 	}
+	return num_succeeded;
+}
+
+bool DSSpace::Thinning(int width, int height, bool* input/*size = width*height*/, bool* output/*size = width*height */)
+{
+	BitMask input_bits, output_bits;
+	PackMask(width, height, input, input_bits);
+	if (!Thinning(input_bits, output_bits))
+		return false;
+	UnpackMask(output_bits, output);
+	return true;
+}
+
+bool DSSpace::Thinning(const BitMask& input, BitMask& output)
+{
+	const int width = input.width;
+	const int height = input.height;
+	const int words_per_row = input.words_per_row;
+
+	//copy input to output. we will work on output buffer only
+	output = input;
 
 	//thinning cut-out masks
 	//0:must be 0, 1:must be 1, 2:don't care. in left-to-right, bottom-to-top row order
@@ -870,11 +2761,20 @@ bool DSSpace::Thinning(int width, int height, bool* input/*size = width*height*/
 		masks.push_back(mask1);
 	}
 
+	//only the interior pixels (not on the image border) are thinned
+	vector<unsigned long long> interior(words_per_row, 0);
+	for (int x = 1; x < width - 1; x++)
+	{
+		interior[x >> 6] |= 1ULL << (x & 63);
+	}
+
+	vector<unsigned long long> matches((size_t)words_per_row * height, 0);
+
 	int iter_max = 1e5;
 	for (int iter = 0; iter < iter_max; iter++)
 	{
 		//find pixels w/ 3x3 neighborhood exactly matching a mask, setting it to 0
-		//do in-place refinements
+		//64 pixels at a time: a match is the AND of the 9 neighbor bits (or their complements) 
 
 		int num_modified = 0;
 
@@ -885,33 +2785,43 @@ bool DSSpace::Thinning(int width, int height, bool* input/*size = width*height*/
 
 			for (int y = 1; y < height - 1; y++)
 			{
-				for (int x = 1; x < width - 1; x++)
+				for (int w = 0; w < words_per_row; w++)
 				{
 					//compare:
-					bool match = true;
+					unsigned long long match = interior[w];
 					for (int yy = 0; yy <= 2; yy++)
 					{
+						const unsigned long long* row = output.Row(y + yy - 1);
+						unsigned long long center = row[w];
+						unsigned long long prev = (w > 0) ? row[w - 1] : 0;
+						unsigned long long next = (w < words_per_row - 1) ? row[w + 1] : 0;
+
+						//bit x of neighbors[xx] = pixel (x + xx - 1)
+						unsigned long long neighbors[3] = { (center << 1) | (prev >> 63), center, (center >> 1) | (next << 63) };
 						for (int xx = 0; xx <= 2; xx++)
 						{
-							int s = (int)output[(y + yy - 1) * width + (x + xx - 1)];
 							int t = mask[yy * 3 + xx];
-							if (t != 2 && (s != t))
-							{
-								match = false;
-								break;
-							}
+							if (t == 1)
+								match &= neighbors[xx];
+							else if (t == 0)
+								match &= ~neighbors[xx];
 						}
 					}
-
-					if (match)
-					{
-						//match! set to 0:
-						output[y * width + x] = 0;
-						num_modified++;;
-					}
+					matches[(size_t)y * words_per_row + w] = match;
 				}
 			}
 
+			//match! set to 0:
+			for (int y = 1; y < height - 1; y++)
+			{
+				unsigned long long* row = output.Row(y);
+				for (int w = 0; w < words_per_row; w++)
+				{
+					unsigned long long match = matches[(size_t)y * words_per_row + w];
+					row[w] &= ~match;
+					num_modified += PopCount(match);
+				}
+			}
 		}
 
 		if (num_modified == 0)
@@ -933,21 +2843,24 @@ bool DSSpace::Thinning(int width, int height, bool* input/*size = width*height*/
 
 bool DSSpace::FillHole(int width, int height, bool* mask)
 {
-	//let's analyze the topology of input buffer first
 	//let's label the topology of current mask first
-	unordered_map<int, pair<Vec2i, pair<bool, int>>> labels;
-	int num_lands = 0;
-	int num_waters = 0;
-	vector<tuple<int,int,int>> Eulers;
-	vector<bool> is_boundary_flags;
-	LabelTopology(width, height, mask, labels, num_lands, num_waters, Eulers, is_boundary_flags);
+	LabelMap labels;
+	LabelComponents(width, height, mask, labels);
+
+	return FillHole(labels, mask);
+}
+
+bool DSSpace::FillHole(const LabelMap& labels, bool* mask)
+{
+	const int width = labels.width;
+	const int height = labels.height;
 
 	//find the smallest water component
 	int smallest_water_size = -1;
 	int smallest_index = -1;
-	for (int i = num_waters; i < Eulers.size()/*same as # of components*/; i++)
+	for (int i = labels.num_lands; i < labels.NumComponents(); i++)
 	{	
-		int num_pixels = get<2>(Eulers[i]);
+		int num_pixels = labels.components[i].num_pixels;
 		if (smallest_water_size <0 || num_pixels < smallest_water_size)
 		{
 			//new smallest!
@@ -958,22 +2871,13 @@ bool DSSpace::FillHole(int width, int height, bool* mask)
 	cout << "[FillHoles] smallest_index:" << smallest_index << " size:" << smallest_water_size << endl;
 	
 	//now, fill pixels of the smallest component components
-	for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+	for (int i = 0; i < width * height; i++)
 	{
-		Vec2i xy = (*itr).second.first;
-
-		//the actual component index:
-		int c = -1;
-		if (!(*itr).second.second.first)
-			c = (*itr).second.second.second;
-		else
-			c = num_lands + (*itr).second.second.second;
-
-		if (c == smallest_index)
+		if (labels.ids[i] == smallest_index)
 		{
 			//turn this water pixel to land!
-			cout << "fill " << xy << endl;
-			mask[xy.y * width + xy.x] = true;
+			cout << "fill " << Vec2i(i % width, i / width) << endl;
+			mask[i] = true;
 		}
 	}
 
@@ -1046,8 +2950,22 @@ void NeighborhoodMask(float dist, vector<Vec2i>& mask)
 	//cout << endl;
 }
 
-int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_width, int bigpixel_height, bool* output)
+int DSSpace::DownsampleByEuler(int width, int height, bool* mask, const DownsampleOptions& options, bool* output)
+{
+	//let's label the topology of the mask first
+	LabelMap labels;
+	LabelComponents(width, height, mask, labels, options.print_debug);
+
+	return DownsampleByEuler(labels, options, output);
+}
+
+int DSSpace::DownsampleByEuler(const LabelMap& labels, const DownsampleOptions& options, bool* output)
 {
+	const int width = labels.width;
+	const int height = labels.height;
+	const int bigpixel_width = options.bigpixel_width;
+	const int bigpixel_height = options.bigpixel_height;
+
 	if (width % bigpixel_width != 0 || height % bigpixel_width != 0)
 	{
 		cout << "[Downsampling] error: width / height not dividable" << endl;
@@ -1056,35 +2974,25 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 	DWORD time_begin = timeGetTime();
 	
-	GRBEnv env;
-	
-	int cur_width = width;
-	int cur_height = height;
-	bool* cur_mask = new bool[cur_width * cur_height];
-	memcpy(cur_mask, mask, sizeof(bool) * cur_width * cur_height);
-
-	//let's label the topology of current mask first
-	unordered_map<int, pair<Vec2i, pair<bool, int>>> labels;
-	int num_lands = 0;
-	int num_waters = 0;
+	const int num_lands = labels.num_lands;
+	const int num_waters = labels.num_waters;
 	vector<tuple<int,int,int>> Eulers;
-	vector<bool> is_boundary_flags;
 
 	DWORD time = time_begin;
 
-	LabelTopology(cur_width, cur_height, cur_mask, labels, num_lands, num_waters, Eulers, is_boundary_flags);
+	ComponentEulers(labels, Eulers, options.print_debug);
 
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
-		cout << "[Downsampling] LabelTopology time:" << timeGetTime() - time << endl;
+		cout << "[Downsampling] ComponentEulers time:" << timeGetTime() - time << endl;
 		time = timeGetTime();
 	}
 
 	//size of the new mask:
-	int new_width = cur_width / bigpixel_width;
-	int new_height = cur_height / bigpixel_height;
+	int new_width = width / bigpixel_width;
+	int new_height = height / bigpixel_height;
 
-	GRBModel model(env);
+	MILPProblem model;
 
 	//for every connected compoent (islands and waters), collect its overlapping big-pixels
 	//and create the Boolean vars for each of its big-pixels
@@ -1092,7 +3000,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 	{
 		Vec2i pos;  //in output grid
 		int score;  //"score" of this big-pixel w.s.t. the component
-		GRBVar var;
+		MILPVar var;
 
 		BigPixel()
 		{
@@ -1110,23 +3018,19 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 	//"pixel-neighborhood" way:
 	if (true)
 	{
-		const int land_weight = g_ds_land_weight;
+		const int land_weight = options.land_weight;
 		const int water_weight = 1;
 
 		//get dist-based neighborhood mask
 		vector<Vec2i> neighborhood;
 		NeighborhoodMask(bigpixel_width / 4, neighborhood);
 
-		for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+		for (int i = 0; i < width * height; i++)
 		{
-			Vec2i xy = (*itr).second.first;
+			Vec2i xy(i % width, i / width);
 
 			//the actual component index:
-			int c = -1;
-			if (!(*itr).second.second.first)
-				c = (*itr).second.second.second;
-			else
-				c = num_lands + (*itr).second.second.second;
+			int c = labels.ids[i];
 
 			unordered_map<int, BigPixel>& component = components[c];
 
@@ -1153,7 +3057,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 					{
 						component[XY.y * new_width + XY.x].pos = XY;
 						component[XY.y * new_width + XY.x].score = weight;
-						component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, GRB_BINARY);
+						component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, MILP_BINARY);
 
 						bigpixels_map[XY.y * new_width + XY.x][c] = true;
 					}
@@ -1173,20 +3077,16 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 		int weight_inside_land = 0;
 		int weight_inside_water = 0;
 		int weight_outside = 0;
-		int land_bias = ceil((float)(bigpixel_width * bigpixel_height) / 2) * g_ds_land_bias_ratio;
+		int land_bias = ceil((float)(bigpixel_width * bigpixel_height) / 2) * options.land_bias_ratio;
 		CalculatePixelWeights(bigpixel_width * bigpixel_height,
 			ceil((float)(bigpixel_width * bigpixel_height) / 2) - land_bias,
 			weight_inside_land, weight_inside_water);
-		for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+		for (int i = 0; i < width * height; i++)
 		{
-			Vec2i xy = (*itr).second.first;
+			Vec2i xy(i % width, i / width);
 
 			//the actual component index:
-			int c = -1;
-			if (!(*itr).second.second.first)
-				c = (*itr).second.second.second;
-			else
-				c = num_lands + (*itr).second.second.second;
+			int c = labels.ids[i];
 
 			unordered_map<int, BigPixel>& component = components[c];
 
@@ -1204,7 +3104,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 			{
 				component[XY.y * new_width + XY.x].pos = XY;
 				component[XY.y * new_width + XY.x].score = weight;
-				component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, GRB_BINARY);
+				component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, MILP_BINARY);
 
 				bigpixels_map[XY.y * new_width + XY.x][c] = true;
 			}
@@ -1256,7 +3156,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 					//create a new big-pixel for the component, w/ outside_weight
 					component[XY.y * new_width + XY.x].pos = XY;
 					component[XY.y * new_width + XY.x].score = weight_outside;
-					component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, GRB_BINARY);
+					component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, MILP_BINARY);
 
 					bigpixels_map[XY.y * new_width + XY.x][c] = true;
 				}
@@ -1268,10 +3168,10 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 	//the Boolean vars of the vertices and edges
 
 	vector< vector</*for every vertex*/ tuple< Vec2i/*itself position*/, 
-		vector<Vec2i>/*adjacent vars of big-pixels of a vertex*/, GRBVar>> > component_vertices;
+		vector<Vec2i>/*adjacent vars of big-pixels of a vertex*/, MILPVar>> > component_vertices;
 	for (int i = 0; i < components.size(); i++)
 	{
-		vector<tuple<Vec2i, vector<Vec2i>, GRBVar>> vertices;
+		vector<tuple<Vec2i, vector<Vec2i>, MILPVar>> vertices;
 
 		//let's check every possible vertex positions (vx,vy) to find its adjacent big-pixels of this component
 		//note: some vertices will NOT have adjacent active big-pixels so they are not present
@@ -1300,7 +3200,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 				if (faces.size() > 0)
 				{
 					//this vertex do has adjacent valid faces of the component. let's create it
-					vertices.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, GRB_BINARY)));
+					vertices.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, MILP_BINARY)));
 				}
 			}
 		}
@@ -1308,13 +3208,13 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 		component_vertices.push_back(vertices);
 	}
 
-	vector< vector<tuple<Vec2i, vector<Vec2i>/*adjacent big-pixels of an edge*/, GRBVar>> > component_hedges;
+	vector< vector<tuple<Vec2i, vector<Vec2i>/*adjacent big-pixels of an edge*/, MILPVar>> > component_hedges;
 	//vertical edges:
-	vector< vector<tuple<Vec2i, vector<Vec2i>/*adjacent big-pixels of an edge*/, GRBVar>> > component_vedges;
+	vector< vector<tuple<Vec2i, vector<Vec2i>/*adjacent big-pixels of an edge*/, MILPVar>> > component_vedges;
 	for (int i = 0; i < components.size(); i++)
 	{
 		//create horizontal edges:
-		vector<tuple<Vec2i, vector<Vec2i>, GRBVar>> hedges;
+		vector<tuple<Vec2i, vector<Vec2i>, MILPVar>> hedges;
 		//(x0,y0) is the left or lower vertex position of a horizontal or vertical edge, respectively
 		for (int vy = 0; vy <= new_height; vy++)
 		{
@@ -1349,14 +3249,14 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 				if (faces.size() > 0)
 				{
-					hedges.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, GRB_BINARY)));
+					hedges.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, MILP_BINARY)));
 				}
 			}
 		}
 		component_hedges.push_back(hedges);
 
 		//vertical edges:
-		vector<tuple<Vec2i, vector<Vec2i>, GRBVar>> vedges;
+		vector<tuple<Vec2i, vector<Vec2i>, MILPVar>> vedges;
 		//(vx,vy) is the lower vertex
 		for (int vy = 0; vy < new_height; vy++)
 		{
@@ -1391,17 +3291,15 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 				if (faces.size() > 0)
 				{
-					vedges.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, GRB_BINARY)));
+					vedges.push_back(make_tuple(Vec2i(vx,vy), faces, model.addVar(0, 1, 0, MILP_BINARY)));
 				}
 			}
 		}
 		component_vedges.push_back(vedges);
 	}
 
-	model.update();
-
 	//objective function: maximize scores of active big pixels
-	GRBLinExpr obj;
+	MILPLinExpr obj;
 	for (int i = 0; i < components.size(); i++)
 	{
 		unordered_map<int, BigPixel>& component = components[i];
@@ -1410,14 +3308,14 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 			obj += (*itr).second.score * (*itr).second.var;
 		}
 	}
-	model.setObjective(obj, GRB_MAXIMIZE);
+	model.setObjective(obj, MILP_MAXIMIZE);
 
 	//for every big-pixel, it is occupied by exactly one big-pixel var (of different components)
 	for (int Y = 0; Y < new_width; Y++)
 	{
 		for (int X = 0; X < new_width; X++)
 		{
-			GRBLinExpr sum;
+			MILPLinExpr sum;
 
 			unordered_map<int,bool>& components_here = bigpixels_map[Y * new_width + X];
 			for (unordered_map<int, bool>::iterator itr = components_here.begin(); itr != components_here.end(); itr++)
@@ -1432,7 +3330,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 	//for every connected component, at least one of its big-pixels needs to be active
 	for (int i = 0; i < components.size(); i++)
 	{			
-		GRBLinExpr sum;
+		MILPLinExpr sum;
 
 		unordered_map<int, BigPixel>& component = components[i];
 		for (unordered_map<int, BigPixel>::iterator itr = component.begin(); itr != component.end(); itr++)
@@ -1477,14 +3375,14 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 						//two possible diagonal ways:
 						if (F0 && F2)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPVar FF0 = C[f0.y * new_width + f0.x].var;
+							MILPVar FF2 = C[f2.y * new_width + f2.x].var;
 							model.addConstr(FF0 + FF2 <= 1);
 						}
 						else if (F1 && F3)
 						{
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPVar FF1 = C[f1.y * new_width + f1.x].var;
+							MILPVar FF3 = C[f3.y * new_width + f3.x].var;
 							model.addConstr(FF1 + FF3 <= 1);
 						}
 					}
@@ -1493,39 +3391,39 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 						//4 possible ways:
 						if (!F0)
 						{
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPVar FF1 = C[f1.y * new_width + f1.x].var;
+							MILPVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPVar FF3 = C[f3.y * new_width + f3.x].var;
 							model.addConstr(FF1 + (1 - FF2) + FF3 <= 2);
 						}
 						else if (!F1)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPVar FF0 = C[f0.y * new_width + f0.x].var;
+							MILPVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPVar FF3 = C[f3.y * new_width + f3.x].var;
 							model.addConstr(FF0 + (1 - FF3) + FF2 <= 2);
 						}
 						else if (!F2)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPVar FF0 = C[f0.y * new_width + f0.x].var;
+							MILPVar FF1 = C[f1.y * new_width + f1.x].var;
+							MILPVar FF3 = C[f3.y * new_width + f3.x].var;
 							model.addConstr(FF1 + (1 - FF0) + FF3 <= 2);
 						}
 						else if (!F3)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPVar FF0 = C[f0.y * new_width + f0.x].var;
+							MILPVar FF1 = C[f1.y * new_width + f1.x].var;
+							MILPVar FF2 = C[f2.y * new_width + f2.x].var;
 							model.addConstr(FF0 + (1 - FF1) + FF2 <= 2);
 						}
 					}
 					else if (count == 4) //all present:
 					{
-						GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-						GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-						GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-						GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+						MILPVar FF0 = C[f0.y * new_width + f0.x].var;
+						MILPVar FF1 = C[f1.y * new_width + f1.x].var;
+						MILPVar FF2 = C[f2.y * new_width + f2.x].var;
+						MILPVar FF3 = C[f3.y * new_width + f3.x].var;
 						model.addConstr(FF0 + (1 - FF1) + FF2 + (1 - FF3) <= 3);
 						model.addConstr((1 - FF0) + FF1 + (1 - FF2) + FF3 <= 3);
 					}
@@ -1642,7 +3540,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 				bool c0_is_land = (c0 < num_lands);
 
 				//collect incompatible big-pixel candidates at FO:
-				GRBLinExpr sum;
+				MILPLinExpr sum;
 				for (unordered_map<int, bool>::iterator itr = FO_cs.begin(); itr != FO_cs.end(); itr++)
 				{
 					int c1 = (*itr).first;
@@ -1668,7 +3566,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 					}
 				}
 
-				GRBVar F_var = components[c0][F.y * new_width + F.x].var;
+				MILPVar F_var = components[c0][F.y * new_width + F.x].var;
 				model.addConstr(F_var + sum <= 1);
 			}
 		}
@@ -1681,7 +3579,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 		for (int Case = 0; Case < 3; Case++)  //vertices, hedges, vedges
 		{
-			vector<tuple<Vec2i, vector<Vec2i>, GRBVar>>* elements;
+			vector<tuple<Vec2i, vector<Vec2i>, MILPVar>>* elements;
 			if (Case == 0)
 				elements = &component_vertices[i];
 			else if(Case == 1)
@@ -1694,14 +3592,14 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 			{
 				vector<Vec2i>& adj_big_pixels = std::get<1>( (*elements)[pos] );
 				int N = adj_big_pixels.size();
-				GRBLinExpr sum;
+				MILPLinExpr sum;
 				for (int j = 0; j < adj_big_pixels.size(); j++)
 				{
 					Vec2i XY = adj_big_pixels[j];
 					sum += component[XY.y * new_width + XY.x].var;
 				}
 
-				GRBVar var = std::get<2>((*elements)[pos]);
+				MILPVar var = std::get<2>((*elements)[pos]);
 				
 				
 				model.addConstr(-N + 1 <= sum - N * var);
@@ -1714,25 +3612,25 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 	for (int i = 0; i < components.size(); i++)
 	{
 		//test: skip this for "oceans" (waters touching boundaries)?
-		if (i >= num_lands && is_boundary_flags[i])
+		if (i >= num_lands && labels.components[i].touches_border)
 		{
 			//cout << "skip Euler constraint for component#" << i << endl;
 			continue;
 		}
 
-		GRBLinExpr sum_F;
+		MILPLinExpr sum_F;
 		for (unordered_map<int, BigPixel>::iterator itr= components[i].begin(); itr != components[i].end(); itr++)
 		{
 			sum_F += (*itr).second.var;
 		}
 
-		GRBLinExpr sum_V;
+		MILPLinExpr sum_V;
 		for (int j = 0; j < component_vertices[i].size(); j++)
 		{
 			sum_V += std::get<2>(component_vertices[i][j]);
 		}
 
-		GRBLinExpr sum_E;
+		MILPLinExpr sum_E;
 		for (int j = 0; j < component_hedges[i].size(); j++)
 		{
 			sum_E += std::get<2>(component_hedges[i][j]);
@@ -1747,30 +3645,35 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 		model.addConstr(sum_V - sum_E + sum_F == Euler);
 	}
 
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
 		cout << "[Downsampling] program setup time:" << timeGetTime() - time << endl;
 		time = timeGetTime();
 	}
 
 	//solve!
-	model.getEnv().set(GRB_IntParam_OutputFlag, false);  //silent
-	model.optimize();
-	int status = model.get(GRB_IntAttr_Status);
-	if (status == 3)
+	model.setOutputFlag(false);  //silent
+	int status = options.decompose ? SolveMILPDecomposed(model, options.milp_backend) : model.optimize(options.milp_backend);
+	if (status == MILP_INFEASIBLE)
 	{
 		//infeasible
 		printf("[Downsampling] the problem is infeasible.");
 		return 2;
 	}
-	else if (status != 9/*time-out*/ && status != 2 && status != 11 && status != 13)
+	else if (status != MILP_TIME_LIMIT && status != MILP_OPTIMAL && status != MILP_INTERRUPTED && status != MILP_SUBOPTIMAL)
 	{
 		//some other failure
 		printf("[Downsampling] optimize failed! status:%d", status);
 		return 1;
 	}
+	else if (!model.hasSolution())
+	{
+		//stopped before finding a solution
+		printf("[Downsampling] no solution found! status:%d", status);
+		return 1;
+	}
 
-	float runtime = model.get(GRB_DoubleAttr_Runtime);
+	float runtime = model.runtime;
 
 	printf("[Downsampling] optimize done! time:%f", runtime);
 
@@ -1783,7 +3686,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 		{
 			Vec2i XY = (*itr).second.pos;
 
-			bool flag = (bool)((*itr).second.var.get(GRB_DoubleAttr_X));
+			bool flag = (bool)(model.getX((*itr).second.var));
 			if (flag)
 			{
 				if (i < num_lands)
@@ -1794,7 +3697,7 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 		}
 	}
 		
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
 		/*cout << "output:" << endl;
 		for (int y = 0; y < new_height; y++)
@@ -1822,17 +3725,17 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 			for (unordered_map<int, BigPixel>::iterator itr = components[i].begin(); itr != components[i].end(); itr++)
 			{
-				bool flag = (*itr).second.var.get(GRB_DoubleAttr_X);
+				bool flag = model.getX((*itr).second.var);
 
 				if (flag)
 					sum_F++;
 			}
 
 			int sum_V = 0;			
-			vector<tuple< Vec2i, vector<Vec2i>, GRBVar>>& vertices = component_vertices[i];
+			vector<tuple< Vec2i, vector<Vec2i>, MILPVar>>& vertices = component_vertices[i];
 			for (int j = 0; j < vertices.size(); j++)
 			{
-				bool flag = std::get<2>(vertices[j]).get(GRB_DoubleAttr_X);
+				bool flag = model.getX(std::get<2>(vertices[j]));
 
 				if (flag)
 					sum_V++;
@@ -1840,18 +3743,18 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 
 			int sum_E = 0;
 
-			vector<tuple< Vec2i, vector<Vec2i>, GRBVar>>& hedges = component_hedges[i];
+			vector<tuple< Vec2i, vector<Vec2i>, MILPVar>>& hedges = component_hedges[i];
 			for (int j = 0; j < hedges.size(); j++)
 			{
-				bool flag = std::get<2>(hedges[j]).get(GRB_DoubleAttr_X);
+				bool flag = model.getX(std::get<2>(hedges[j]));
 
 				if (flag)
 					sum_E++;
 			}
-			vector<tuple< Vec2i, vector<Vec2i>, GRBVar>>& vedges = component_vedges[i];
+			vector<tuple< Vec2i, vector<Vec2i>, MILPVar>>& vedges = component_vedges[i];
 			for (int j = 0; j < vedges.size(); j++)
 			{
-				bool flag = std::get<2>(vedges[j]).get(GRB_DoubleAttr_X);
+				bool flag = model.getX(std::get<2>(vedges[j]));
 
 				if (flag)
 					sum_E++;
@@ -1867,10 +3770,254 @@ int DSSpace::DownsampleByEuler(int width, int height, bool* mask, int bigpixel_w
 }
 
 
-int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, int bigpixel_height, bool* output)
+int DSSpace::Downsample(int width, int height, bool* mask, const DownsampleOptions& options, bool* output)
+{
+	//let's label the topology of the mask first
+	LabelMap labels;
+	LabelComponents(width, height, mask, labels, options.print_debug);
+
+	return Downsample(labels, options, output);
+}
+
+int DSSpace::Downsample(const BitMask& mask, const DownsampleOptions& options, BitMask& output)
+{
+	//let's label the topology of the mask first
+	LabelMap labels;
+	LabelComponents(mask, labels, options.print_debug);
+
+	int new_width = mask.width / options.bigpixel_width;
+	int new_height = mask.height / options.bigpixel_height;
+	vector<char> output_buffer(new_width * new_height + 1);
+	int status = Downsample(labels, options, (bool*)&output_buffer[0]);
+	if (status == 0)
+		PackMask(new_width, new_height, (bool*)&output_buffer[0], output);
+	return status;
+}
+
+//a candidate of Downsample: a big-pixel that a component may occupy
+struct BigPixelCandidate
+{
+	int component;
+	int bigpixel;  //row-major index in the output grid
+	int score;  //"score" of this big-pixel w.s.t. the component
+	int order;  //order of discovery (= order of the vars)
+	MILPVar var;  //(none if fixed)
+	bool fixed;  //fixed to 1 by the presolve?
+
+	BigPixelCandidate()
+	{
+		component = bigpixel = -1;
+		score = 0;
+		order = 0;
+		fixed = false;
+	}
+
+	//the var, or 1 if fixed
+	MILPLinExpr Value() const
+	{
+		return fixed ? MILPLinExpr(1) : MILPLinExpr(var);
+	}
+};
+
+//candidates of Downsample in CSR form (instead of a hash map per component and per big-pixel):
+//the candidates of big-pixel i are entries[bigpixel_begins[i] ~ bigpixel_begins[i + 1] - 1], sorted by component,
+//and those of component c are entries[component_entries[component_begins[c] ~ component_begins[c + 1] - 1]], sorted by big-pixel.
+//a big-pixel has a few candidates, so a lookup is a short linear scan
+class CandidateTable
+{
+public:
+	vector<BigPixelCandidate> entries;
+	vector<int> bigpixel_begins;  //size = # of big-pixels + 1
+	vector<int> component_begins;  //size = # of components + 1
+	vector<int> component_entries;  //entry indices
+
+	//from the candidates of every big-pixel
+	void Build(const vector<vector<BigPixelCandidate>>& cells, int num_components)
+	{
+		bigpixel_begins.resize(cells.size() + 1);
+		int num_entries = 0;
+		for (int i = 0; i < cells.size(); i++)
+		{
+			bigpixel_begins[i] = num_entries;
+			num_entries += cells[i].size();
+		}
+		bigpixel_begins[cells.size()] = num_entries;
+
+		entries.resize(num_entries);
+		vector<int> num_component_entries(num_components + 1, 0);
+		for (int i = 0; i < cells.size(); i++)
+		{
+			vector<BigPixelCandidate>::iterator slice = entries.begin() + bigpixel_begins[i];
+			copy(cells[i].begin(), cells[i].end(), slice);
+			sort(slice, slice + cells[i].size(), LessComponent);
+			for (int k = 0; k < cells[i].size(); k++)
+				num_component_entries[slice[k].component + 1]++;
+		}
+
+		//counting sort by component. entries are in big-pixel order, and so are the ones of every component
+		component_begins.resize(num_components + 1);
+		component_begins[0] = 0;
+		for (int c = 0; c < num_components; c++)
+			component_begins[c + 1] = component_begins[c] + num_component_entries[c + 1];
+		component_entries.resize(num_entries);
+		vector<int> positions(component_begins.begin(), component_begins.end() - 1);
+		for (int e = 0; e < num_entries; e++)
+			component_entries[positions[entries[e].component]++] = e;
+	}
+
+	int NumCandidates(int bigpixel) const
+	{
+		return bigpixel_begins[bigpixel + 1] - bigpixel_begins[bigpixel];
+	}
+
+	//entry index of a component at a big-pixel (-1 = not a candidate)
+	int Find(int bigpixel, int component) const
+	{
+		for (int e = bigpixel_begins[bigpixel]; e < bigpixel_begins[bigpixel + 1]; e++)
+		{
+			if (entries[e].component == component)
+				return e;
+		}
+		return -1;
+	}
+
+	//candidate of a component at a big-pixel (must exist)
+	const BigPixelCandidate& At(int bigpixel, int component) const
+	{
+		return entries[Find(bigpixel, component)];
+	}
+
+	//bounding box (in big-pixels) of the candidates of a component. false if it has none
+	bool ComponentBBox(int component, int new_width, Vec2i& bbox_min, Vec2i& bbox_max) const
+	{
+		int begin = component_begins[component];
+		int end = component_begins[component + 1];
+		if (begin == end)
+			return false;
+
+		//sorted by big-pixel: the first and the last ones are on the top and bottom rows
+		bbox_min = Vec2i(new_width, entries[component_entries[begin]].bigpixel / new_width);
+		bbox_max = Vec2i(-1, entries[component_entries[end - 1]].bigpixel / new_width);
+		for (int k = begin; k < end; k++)
+		{
+			int X = entries[component_entries[k]].bigpixel % new_width;
+			bbox_min.x = MIN2(bbox_min.x, X);
+			bbox_max.x = MAX2(bbox_max.x, X);
+		}
+		return true;
+	}
+
+private:
+	static bool LessComponent(const BigPixelCandidate& a, const BigPixelCandidate& b)
+	{
+		return a.component < b.component;
+	}
+};
+
+//value of a node of a boundary's loop in Downsample: its VC var, or 1 for a fixed node (w/o a var)
+static MILPLinExpr NodeValue(const MILPVar& var)
+{
+	return (var.index >= 0) ? MILPLinExpr(var) : MILPLinExpr(1);
+}
+
+//lazy constraints of Downsample (lazy_loops): the active VCs of a boundary shall make one loop (or one open chain,
+//which ends at the "last" VC). w/o the dist vars, the model allows more, so a solution w/ more is cut off:
+//a closed loop L can't be all active along w/ another part P of the boundary, i.e., sum<L> + sum<P> <= |L| + |P| - 1
+//(an active VC has one active next and one active previous VC at most, so an active loop is a whole part)
+class BoundaryLoopCuts : public MILPLazyConstraints
+{
+public:
+	const vector< vector<MILPVar> >& VC_vars;  //of the VC nodes of every boundary (none for a fixed node)
+	const vector< vector< vector<int> > >& VC_nexts;  //next nodes of every node of every boundary
+
+	BoundaryLoopCuts(const vector< vector<MILPVar> >& VC_vars_, const vector< vector< vector<int> > >& VC_nexts_) :
+		VC_vars(VC_vars_), VC_nexts(VC_nexts_)
+	{
+	}
+
+	void Separate(const vector<double>& solution, vector<MILPTempConstr>& cuts) const
+	{
+		for (int b = 0; b < VC_vars.size(); b++)
+		{
+			const vector<MILPVar>& vars = VC_vars[b];
+			const int num_VCs = vars.size();
+
+			//active VCs and their active next VCs
+			vector<bool> actives(num_VCs);
+			for (int i = 0; i < num_VCs; i++)
+				actives[i] = (vars[i].index < 0 || solution[vars[i].index] > 0.5);
+			vector<int> nexts(num_VCs, -1);
+			vector<bool> has_prev(num_VCs, false);
+			for (int i = 0; i < num_VCs; i++)
+			{
+				if (!actives[i])
+					continue;
+				for (int k = 0; k < VC_nexts[b][i].size(); k++)
+				{
+					int j = VC_nexts[b][i][k];
+					if (actives[j])
+					{
+						nexts[i] = j;
+						has_prev[j] = true;
+						break;
+					}
+				}
+			}
+
+			//parts of the boundary: open chains (from a VC w/o a previous one), then the closed loops
+			vector<vector<int>> parts;
+			vector<bool> closed;
+			vector<bool> visited(num_VCs, false);
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (int i = 0; i < num_VCs; i++)
+				{
+					if (!actives[i] || visited[i] || (pass == 0 && has_prev[i]))
+						continue;
+
+					vector<int> part;
+					int cur = i;
+					while (cur >= 0 && !visited[cur])
+					{
+						visited[cur] = true;
+						part.push_back(cur);
+						cur = nexts[cur];
+					}
+					parts.push_back(part);
+					closed.push_back(pass == 1 && cur == i);
+				}
+			}
+			if (parts.size() < 2)
+				continue;
+
+			//every closed loop excludes the next part
+			for (int p = 0; p < parts.size(); p++)
+			{
+				if (!closed[p])
+					continue;
+
+				const vector<int>& other = parts[(p + 1) % parts.size()];
+				MILPLinExpr sum;
+				for (int i = 0; i < parts[p].size(); i++)
+					sum += NodeValue(vars[parts[p][i]]);
+				for (int i = 0; i < other.size(); i++)
+					sum += NodeValue(vars[other[i]]);
+				cuts.push_back(sum <= (double)(parts[p].size() + other.size() - 1));
+			}
+		}
+	}
+};
+
+int DSSpace::Downsample(const LabelMap& labels, const DownsampleOptions& options, bool* output,
+	int* output_components, const int* fixed_components, atomic<bool>* interrupt, const int* hint_components, SolverStats* stats)
 {
 	const float BIG_NUM_MULTIPLIER = 1.5;
 
+	const int width = labels.width;
+	const int height = labels.height;
+	const int bigpixel_width = options.bigpixel_width;
+	const int bigpixel_height = options.bigpixel_height;
+
 	if (width % bigpixel_width != 0 || height % bigpixel_width != 0)
 	{
 		cout << "[Downsampling] error: width / height not dividable" << endl;
@@ -1879,80 +4026,48 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 
 	DWORD time_begin = timeGetTime();
 
-	GRBEnv env;
-
-	int cur_width = width;
-	int cur_height = height;
-	bool* cur_mask = new bool[cur_width * cur_height];
-	memcpy(cur_mask, mask, sizeof(bool) * cur_width * cur_height);
-
-	//let's label the topology of current mask first
-	unordered_map<int, pair<Vec2i, pair<bool, int>>> labels;
-	int num_lands = 0;
-	int num_waters = 0;
+	const int num_lands = labels.num_lands;
+	const int num_waters = labels.num_waters;
 
 	DWORD time = time_begin;
 
-	LabelTopology2(cur_width, cur_height, cur_mask, labels, num_lands, num_waters);
-
 	//find land-water boundaries
 	vector<pair<Vec2i,int>> boundaries;  //<land_index-water_index, size>
-	EnumerateBoundaries(cur_width, cur_height, labels, num_lands, num_waters, boundaries);
+	EnumerateBoundaries(labels, boundaries, options.parallel_boundaries, options.print_debug);
 
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
-		cout << "[Downsampling] LabelTopology/EnumerateBoundaries time:" << timeGetTime() - time << endl;
+		cout << "[Downsampling] EnumerateBoundaries time:" << timeGetTime() - time << endl;
 		time = timeGetTime();
 	}
 
 	//size of the new mask:
-	int new_width = cur_width / bigpixel_width;
-	int new_height = cur_height / bigpixel_height;
-
-	GRBModel model(env);
-
-	//for every connected compoent (islands and waters), collect its overlapping big-pixels
-	//and create the Boolean vars for each of its big-pixels
-	struct BigPixel  //a big-pixel of a component
-	{
-		Vec2i pos;  //in output grid
-		int score;  //"score" of this big-pixel w.s.t. the component
-		GRBVar var;
+	int new_width = width / bigpixel_width;
+	int new_height = height / bigpixel_height;
 
-		BigPixel()
-		{
-			pos = Vec2i(0);
-			score = 0;
-		}
-	};
-	vector<unordered_map<int, BigPixel>> components;  //big-pixels of every component (lands first then waters)
-	components.resize(num_lands + num_waters);
+	MILPProblem model;
 
-	//also record the occupying potential big-pixels of each big-pixel locations 
-	vector<unordered_map<int, bool>> bigpixels_map;  //row-major order. each is a map of component#
-	bigpixels_map.resize(new_width * new_height);
+	//for every connected compoent (islands and waters), collect its overlapping big-pixels (candidates)
+	//in a list per big-pixel. the presolve works on these, and the rest go to a CandidateTable
+	const int num_components = num_lands + num_waters;
+	vector<vector<BigPixelCandidate>> cells(new_width * new_height);  //row-major order
+	int num_candidates = 0;
 
 	//"pixel-neighborhood" way:
 	{
-		const int land_weight = g_ds_land_weight;
+		const int land_weight = options.land_weight;
 		const int water_weight = 1;
 
 		//get dist-based neighborhood mask
 		vector<Vec2i> neighborhood;
-		NeighborhoodMask(bigpixel_width / 4 + g_ds_neighobrhood_offset, neighborhood);
+		NeighborhoodMask(bigpixel_width / 4 + options.neighborhood_offset, neighborhood);
 
-		for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+		for (int i = 0; i < width * height; i++)
 		{
-			Vec2i xy = (*itr).second.first;
+			Vec2i xy(i % width, i / width);
 
 			//the actual component index:
-			int c = -1;
-			if (!(*itr).second.second.first)
-				c = (*itr).second.second.second;
-			else
-				c = num_lands + (*itr).second.second.second;
-
-			unordered_map<int, BigPixel>& component = components[c];
+			int c = labels.ids[i];
 
 			int weight = 0;
 			if (c < num_lands)  //land pixel?
@@ -1970,27 +4085,229 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 				if (xy_.x >= 0 && xy_.x < width && xy_.y >= 0 && xy_.y < height)
 				{
 					//to residing big-pixel coordinate:
-					Vec2i XY(xy_.x / bigpixel_width, xy_.y / bigpixel_height);
+					int bigpixel = (xy_.y / bigpixel_height) * new_width + xy_.x / bigpixel_width;
+					vector<BigPixelCandidate>& cell = cells[bigpixel];
+
+					int k = 0;
+					while (k < cell.size() && cell[k].component != c)
+						k++;
 
 					//first time for this big-pixel?
-					if (component.count(XY.y * new_width + XY.x) == 0)
+					if (k == cell.size())
 					{
-						component[XY.y * new_width + XY.x].pos = XY;
-						component[XY.y * new_width + XY.x].score = weight;
-						component[XY.y * new_width + XY.x].var = model.addVar(0, 1, 0, GRB_BINARY);
+						BigPixelCandidate candidate;
+						candidate.component = c;
+						candidate.bigpixel = bigpixel;
+						candidate.order = num_candidates++;
+						cell.push_back(candidate);
+					}
 
-						bigpixels_map[XY.y * new_width + XY.x][c] = true;
+					//accumulate a score
+					cell[k].score += weight;
+				}
+			}
+		}
+	}
+
+	//presolve: big-pixels w/ a single candidate (or a given fixed component) are fixed, and need no vars.
+	//a fixed big-pixel rules out the candidates of its neighbors that its local constraints forbid,
+	//which may leave them w/ a single candidate, too (propagated until nothing changes)
+	//options.presolve_dominance > 0: a big-pixel whose own pixels are all in one component (no boundary across it),
+	//w/ at least this share of its total score, is fixed to that component, too. this is a heuristic:
+	//the other candidates may be needed to keep a thin feature, so the exact model is solved if it is infeasible
+	int num_fixed = 0;
+	int num_dominated = 0;
+	int num_ruled_out = 0;
+	bool infeasible = false;
+	if (options.presolve)
+	{
+		//the component of all pixels of every big-pixel (-1 = more than one)
+		vector<int> pure_components;
+		if (options.presolve_dominance > 0)
+		{
+			pure_components.assign(new_width * new_height, -2);
+			for (int y = 0; y < height; y++)
+			{
+				const int* ids = &labels.ids[(size_t)y * width];
+				int* pures = &pure_components[(y / bigpixel_height) * new_width];
+				for (int x = 0; x < width; x++)
+				{
+					int& pure = pures[x / bigpixel_width];
+					if (pure == -2)
+						pure = ids[x];
+					else if (pure != ids[x])
+						pure = -1;
+				}
+			}
+		}
+
+		//# of candidates of every component
+		vector<int> num_component_candidates(num_components, 0);
+		for (int i = 0; i < new_width * new_height; i++)
+		{
+			for (int k = 0; k < cells[i].size(); k++)
+				num_component_candidates[cells[i][k].component]++;
+		}
+
+		vector<int> queue;  //fixed big-pixels to propagate
+		for (int i = 0; i < new_width * new_height; i++)
+		{
+			vector<BigPixelCandidate>& cell = cells[i];
+
+			//fixed big-pixels (e.g., tile interiors of DownsampleTiled)
+			int c = fixed_components ? fixed_components[i] : -1;
+			if (c < 0 && !pure_components.empty() && pure_components[i] >= 0 && cell.size() > 1)
+			{
+				int total_score = 0;
+				int pure_score = 0;
+				for (int k = 0; k < cell.size(); k++)
+				{
+					total_score += cell[k].score;
+					if (cell[k].component == pure_components[i])
+						pure_score = cell[k].score;
+				}
+				if (pure_score >= options.presolve_dominance * total_score)
+				{
+					c = pure_components[i];
+					num_dominated++;
+				}
+			}
+			if (c >= 0)
+			{
+				int kept = 0;
+				while (kept < cell.size() && cell[kept].component != c)
+					kept++;
+				if (kept < cell.size())
+				{
+					for (int k = 0; k < cell.size(); k++)
+					{
+						if (k != kept && --num_component_candidates[cell[k].component] == 0)
+							infeasible = true;  //a component lost all of its big-pixels
 					}
-					else
+					num_ruled_out += cell.size() - 1;
+					BigPixelCandidate candidate = cell[kept];
+					cell.assign(1, candidate);
+					if (fixed_components && fixed_components[i] >= 0)
+						num_fixed++;
+				}
+			}
+
+			if (cell.size() == 1)
+			{
+				cell[0].fixed = true;
+				queue.push_back(i);
+			}
+		}
+
+		for (int q = 0; q < queue.size() && options.local_constraint && !infeasible; q++)
+		{
+			int i = queue[q];
+			int c = cells[i][0].component;
+			bool c_is_land = (c < num_lands);
+			Vec2i XY(i % new_width, i / new_width);
+
+			//8 neighbors: another component of the same kind is forbidden across an edge, another land diagonally
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					Vec2i XY_ = XY + Vec2i(dx, dy);
+					if ((dx == 0 && dy == 0) || XY_.x < 0 || XY_.x >= new_width || XY_.y < 0 || XY_.y >= new_height)
+						continue;
+					bool is_diagonal = (dx != 0 && dy != 0);
+					if (is_diagonal && !c_is_land)
+						continue;
+
+					//keep the compatible candidates there
+					vector<BigPixelCandidate>& cell = cells[XY_.y * new_width + XY_.x];
+					int num_kept = 0;
+					for (int k = 0; k < cell.size(); k++)
 					{
-						//accumulate a score
-						component[XY.y * new_width + XY.x].score += weight;
+						int c1 = cell[k].component;
+						if (c1 != c && (c1 < num_lands) == c_is_land)
+						{
+							if (--num_component_candidates[c1] == 0)
+								infeasible = true;  //a component lost all of its big-pixels
+						}
+						else
+							cell[num_kept++] = cell[k];
+					}
+					if (num_kept == cell.size())
+						continue;
+
+					num_ruled_out += cell.size() - num_kept;
+					cell.resize(num_kept);
+
+					if (cell.empty())
+						infeasible = true;
+					else if (cell.size() == 1)
+					{
+						cell[0].fixed = true;
+						queue.push_back(XY_.y * new_width + XY_.x);
 					}
 				}
 			}
 		}
 	}
 
+	if (infeasible)
+	{
+		if (num_dominated > 0)
+		{
+			cout << "[Downsampling] presolve w/ dominated big-pixels is infeasible. solving the exact model" << endl;
+			DownsampleOptions exact_options = options;
+			exact_options.presolve_dominance = 0;
+			return Downsample(labels, exact_options, output, output_components, fixed_components, interrupt, hint_components, stats);
+		}
+		printf("[Downsampling] the problem is infeasible (presolve)");
+		return 2;
+	}
+
+	//the remaining candidates, by big-pixel and by component
+	CandidateTable candidates;
+	candidates.Build(cells, num_components);
+	vector<vector<BigPixelCandidate>>().swap(cells);
+
+	int num_fixed_bigpixels = 0;
+	for (int i = 0; i < new_width * new_height; i++)
+	{
+		if (candidates.NumCandidates(i) == 1 && candidates.entries[candidates.bigpixel_begins[i]].fixed)
+			num_fixed_bigpixels++;
+	}
+
+	//vars of the remaining candidates, in the order of discovery
+	vector<int> discovery_entries(num_candidates, -1);
+	for (int e = 0; e < candidates.entries.size(); e++)
+	{
+		discovery_entries[candidates.entries[e].order] = e;
+	}
+	int num_bigpixel_vars = 0;
+	for (int k = 0; k < num_candidates; k++)
+	{
+		int e = discovery_entries[k];
+		if (e < 0 || candidates.entries[e].fixed)
+			continue;
+
+		candidates.entries[e].var = model.addVar(0, 1, 0, MILP_BINARY);
+		num_bigpixel_vars++;
+	}
+
+	//w/o the presolve, fixed big-pixels are constrained
+	if (!options.presolve && fixed_components)
+	{
+		for (int i = 0; i < new_width * new_height; i++)
+		{
+			int e = (fixed_components[i] >= 0) ? candidates.Find(i, fixed_components[i]) : -1;
+			if (e >= 0)
+			{
+				model.addConstr(candidates.entries[e].var == 1);
+				num_fixed++;
+			}
+		}
+	}
+	if (options.print_debug && fixed_components)
+		cout << "[Downsampling] fixed big-pixels:" << num_fixed << "/" << new_width * new_height << endl;
+
 	////for each land-water boundary, we need to constraint its single-loop topology
 
 	//(constant) adjacent land and water faces of each of the 12 vertex configurations
@@ -2103,13 +4420,24 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 	vector< vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>> /*for every boundary*/> boundary_VCs(boundaries.size());
 	for (int b = 0; b < boundaries.size(); b++)
 	{
-		unordered_map<int, BigPixel> &land = components[boundaries[b].first.x];
-		unordered_map<int, BigPixel> &water = components[boundaries[b].first.y];
+		int land_index = boundaries[b].first.x;
+		int water_index = boundaries[b].first.y;
+
+		//every VC has land and water faces among the 4 faces of its vertex, so only the interior vertices
+		//w/ a face in the bounding boxes of both the land's and the water's candidates can have one
+		Vec2i land_min, land_max, water_min, water_max;
+		if (!candidates.ComponentBBox(land_index, new_width, land_min, land_max) ||
+			!candidates.ComponentBBox(water_index, new_width, water_min, water_max))
+			continue;
+		int min_vx = MAX2(1, MAX2(land_min.x, water_min.x));
+		int max_vx = MIN2(new_width - 1, MIN2(land_max.x, water_max.x) + 1);
+		int min_vy = MAX2(1, MAX2(land_min.y, water_min.y));
+		int max_vy = MIN2(new_height - 1, MIN2(land_max.y, water_max.y) + 1);
 
-		//search all new-map interior vertices
-		for (int vy = 1; vy < new_height; vy++)
+		//search these new-map interior vertices (in the same order as all of them)
+		for (int vy = min_vy; vy <= max_vy; vy++)
 		{
-			for (int vx = 1; vx < new_width; vx++)
+			for (int vx = min_vx; vx <= max_vx; vx++)
 			{
 				//there are 4 (incoming half-edge's dir) * 3 (outgoing half-edge's dir) = 12 possible vertex configurations
 				//check each VC's eligibility
@@ -2127,7 +4455,7 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 					for (int i = 0; i < land_offsets.size(); i++)
 					{
 						Vec2i p = Vec2i(vx, vy) + land_offsets[i];
-						if (land.count(p.y * new_width + p.x) == 0)
+						if (candidates.Find(p.y * new_width + p.x, land_index) < 0)
 						{
 							ok = false;
 							break;
@@ -2138,7 +4466,7 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 						for (int i = 0; i < water_offsets.size(); i++)
 						{
 							Vec2i p = Vec2i(vx, vy) + water_offsets[i];
-							if (water.count(p.y * new_width + p.x) == 0)
+							if (candidates.Find(p.y * new_width + p.x, water_index) < 0)
 							{
 								ok = false;
 								break;
@@ -2161,13 +4489,168 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 		}
 	}
 
+	//compatible next VCs of every VC (its out dir equals the next VC's in dir, at its pointing-to pos),
+	//and the VCs w/o any VC at their pointing-to pos (they cannot be active)
+	vector< vector< vector<int> > > boundary_VC_nexts(boundaries.size());
+	vector< vector<bool> > boundary_VC_ends(boundaries.size());
+	for (int b = 0; b < boundaries.size(); b++)
+	{
+		vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>>& VCs = boundary_VCs[b];
+
+		//build a quick map of VCs from Vec2i to index
+		map<int, vector<int>> VCs_map;  //key: y*new_width+x, value: list of indices in VCs at the position
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			VCs_map[VCs[i].second.y * new_width + VCs[i].second.x].push_back(i);
+		}
+
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			int type = VCs[i].first;  //0~11
+			Vec2i pos = VCs[i].second;
+
+			//locate the pointing-to pos according to type:
+			Vec2i pos_to;
+			int out_dir = 0;  //+y, +x, -y, -x
+			if (type == 0 || type == 4 || type == 8)  //out-going he is +y
+			{
+				pos_to = pos + Vec2i(0, 1);
+				out_dir = 0;
+			}
+			else if (type == 1 || type == 5 || type == 9)  //+x
+			{
+				pos_to = pos + Vec2i(1, 0);
+				out_dir = 1;
+			}
+			else if (type == 2 || type == 6 || type == 10)  //-y
+			{
+				pos_to = pos + Vec2i(0, -1);
+				out_dir = 2;
+			}
+			else if (type == 3 || type == 7 || type == 11)  //-x
+			{
+				pos_to = pos + Vec2i(-1, 0);
+				out_dir = 3;
+			}
+
+			//if this VC's pointing-to pos has no existing VC, this VC cannot be active
+			boundary_VC_ends[b].push_back(VCs_map.count(pos_to.y * new_width + pos_to.x) == 0);
+
+			vector<int> to_indices;
+			vector<int>& candidates = VCs_map[pos_to.y * new_width + pos_to.x];
+			for (int k = 0; k < candidates.size(); k++)
+			{
+				int to_type = VCs[candidates[k]].first;
+
+				int in_dir = 0;  //+y, +x, -y, -x
+				if (to_type == 0 || to_type == 1 || to_type == 2)  //+x
+					in_dir = 1;
+				else if (to_type == 3 || to_type == 4 || to_type == 5)  //+y
+					in_dir = 0;
+				else if (to_type == 6 || to_type == 7 || to_type == 8)  //-x
+					in_dir = 3;
+				else if (to_type == 9 || to_type == 10 || to_type == 11)  //-y
+					in_dir = 2;
+
+				if (out_dir == in_dir)
+					to_indices.push_back(candidates[k]);  //compatible!
+			}
+			boundary_VC_nexts[b].push_back(to_indices);
+		}
+	}
+
+	//a VC w/ all of its faces fixed (e.g., in the tile interiors of DownsampleTiled) is an active constant.
+	//fixed VCs linked by next VCs are contracted to a single node of the boundary's loop, and a boundary of fixed VCs only is
+	//left as it is. the vars and the loop constraints are on the nodes (a VC that isn't fixed is a node of its own),
+	//so the model only grows w/ the VCs that aren't fixed
+	vector< vector<int> > boundary_VC_nodes(boundaries.size());  //node of every VC (-1 = none: all fixed)
+	vector< vector< vector<int> > > boundary_node_nexts(boundaries.size());  //next nodes of every node
+	vector< vector<bool> > boundary_node_fixed(boundaries.size());
+	int num_fixed_VCs = 0;
+	for (int b = 0; b < boundaries.size(); b++)
+	{
+		int land_index = boundaries[b].first.x;
+		int water_index = boundaries[b].first.y;
+		vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>>& VCs = boundary_VCs[b];
+		vector< vector<int> >& VC_nexts = boundary_VC_nexts[b];
+		vector<int>& VC_nodes = boundary_VC_nodes[b];
+		VC_nodes.assign(VCs.size(), -1);
+
+		vector<bool> fixed(VCs.size());
+		int num_free = 0;
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			vector<Vec2i>& land_offsets = VCFaces[VCs[i].first].first;
+			vector<Vec2i>& water_offsets = VCFaces[VCs[i].first].second;
+
+			bool is_fixed = true;
+			for (int j = 0; j < land_offsets.size() && is_fixed; j++)
+			{
+				Vec2i p = VCs[i].second + land_offsets[j];
+				is_fixed = candidates.At(p.y * new_width + p.x, land_index).fixed;
+			}
+			for (int j = 0; j < water_offsets.size() && is_fixed; j++)
+			{
+				Vec2i p = VCs[i].second + water_offsets[j];
+				is_fixed = candidates.At(p.y * new_width + p.x, water_index).fixed;
+			}
+			fixed[i] = is_fixed;
+			if (is_fixed)
+				num_fixed_VCs++;
+			else
+				num_free++;
+		}
+		if (num_free == 0)
+			continue;
+
+		//groups of linked fixed VCs. a group's root is its first VC
+		vector<int> parent(VCs.size());
+		for (int i = 0; i < VCs.size(); i++)
+			parent[i] = i;
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			for (int k = 0; k < VC_nexts[i].size(); k++)
+			{
+				if (fixed[i] && fixed[VC_nexts[i][k]])
+					UnionLabels(parent, i, VC_nexts[i][k]);
+			}
+		}
+
+		//nodes in the order of their first VCs
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			int root = FindRootLabel(parent, i);
+			if (root == i)
+			{
+				VC_nodes[i] = boundary_node_fixed[b].size();
+				boundary_node_fixed[b].push_back(fixed[i]);
+			}
+			else
+				VC_nodes[i] = VC_nodes[root];
+		}
+		vector< vector<int> >& node_nexts = boundary_node_nexts[b];
+		node_nexts.resize(boundary_node_fixed[b].size());
+		for (int i = 0; i < VCs.size(); i++)
+		{
+			vector<int>& nexts = node_nexts[VC_nodes[i]];
+			for (int k = 0; k < VC_nexts[i].size(); k++)
+			{
+				int node = VC_nodes[VC_nexts[i][k]];
+				if (node != VC_nodes[i] && find(nexts.begin(), nexts.end(), node) == nexts.end())
+					nexts.push_back(node);
+			}
+		}
+	}
+	if (options.print_debug)
+		cout << "[Downsampling] fixed VCs:" << num_fixed_VCs << endl;
+
 	//for every boundary:
-	//1. create a Boolean var for every VC candidate
-	//2. create a Integer "distance" var for every VC candidate
-	//3. create a Boolean "last" var for every VC candidate
-	vector< vector<GRBVar> > boundary_VC_vars;
-	vector< vector<GRBVar> > boundary_dist_vars;
-	vector< vector<GRBVar> > boundary_last_vars;
+	//1. create a Boolean var for every node (none for a fixed one)
+	//2. create a Integer "distance" var for every node (not w/ lazy loops)
+	//3. create a Boolean "last" var for every node
+	vector< vector<MILPVar> > boundary_VC_vars;  //by node
+	vector< vector<MILPVar> > boundary_dist_vars;
+	vector< vector<MILPVar> > boundary_last_vars;
 	for (int b = 0; b < boundary_VCs.size(); b++)
 	{
 		//the length of this boundary in original resolution
@@ -2176,18 +4659,19 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 		//and cannot smaller than a value
 		int BIG_NUM = MAX2((boundary_size_ori / bigpixel_width) * BIG_NUM_MULTIPLIER, 10);
 		
-		if(g_ds_print_debug)
+		if(options.print_debug)
 			cout << "boundary_size_ori:" << boundary_size_ori << " BIG_NUM:" << BIG_NUM << endl;
 
-		vector<GRBVar> VC_vars;
-		vector<GRBVar> dist_vars;
-		vector<GRBVar> last_vars;
+		vector<MILPVar> VC_vars;
+		vector<MILPVar> dist_vars;
+		vector<MILPVar> last_vars;
 
-		for (int i = 0; i < boundary_VCs[b].size(); i++)
+		for (int n = 0; n < boundary_node_fixed[b].size(); n++)
 		{
-			VC_vars.push_back(model.addVar(0, 1, 0, GRB_BINARY));
-			dist_vars.push_back(model.addVar(0, BIG_NUM, 0, GRB_INTEGER));
-			last_vars.push_back(model.addVar(0, 1, 0, GRB_BINARY));
+			VC_vars.push_back(boundary_node_fixed[b][n] ? MILPVar() : model.addVar(0, 1, 0, MILP_BINARY));
+			if (!options.lazy_loops)
+				dist_vars.push_back(model.addVar(0, BIG_NUM, 0, MILP_INTEGER));
+			last_vars.push_back(model.addVar(0, 1, 0, MILP_BINARY));
 		}
 
 		boundary_VC_vars.push_back(VC_vars);
@@ -2195,31 +4679,27 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 		boundary_last_vars.push_back(last_vars);
 	}
 
-	model.update();
-
 	//objective function: maximize scores of active big pixels
-	GRBLinExpr obj;
-	for (int i = 0; i < components.size(); i++)
+	MILPLinExpr obj;
+	for (int e = 0; e < candidates.entries.size(); e++)
 	{
-		unordered_map<int, BigPixel>& component = components[i];
-		for (unordered_map<int, BigPixel>::iterator itr = component.begin(); itr != component.end(); itr++)
-		{
-			obj += (*itr).second.score * (*itr).second.var;
-		}
+		obj += candidates.entries[e].score * candidates.entries[e].Value();
 	}
-	model.setObjective(obj, GRB_MAXIMIZE);
+	model.setObjective(obj, MILP_MAXIMIZE);
 
 	//for every big-pixel, it is occupied by exactly one big-pixel var (of different components)
 	for (int Y = 0; Y < new_height; Y++)
 	{
 		for (int X = 0; X < new_width; X++)
 		{
-			GRBLinExpr sum;
+			MILPLinExpr sum;
 
-			unordered_map<int, bool>& components_here = bigpixels_map[Y * new_width + X];
-			for (unordered_map<int, bool>::iterator itr = components_here.begin(); itr != components_here.end(); itr++)
+			int i = Y * new_width + X;
+			if (candidates.entries[candidates.bigpixel_begins[i]].fixed)
+				continue;
+			for (int e = candidates.bigpixel_begins[i]; e < candidates.bigpixel_begins[i + 1]; e++)
 			{
-				sum += components[(*itr).first][Y * new_width + X].var;
+				sum += candidates.entries[e].var;
 			}
 
 			model.addConstr(sum == 1);
@@ -2227,32 +4707,35 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 	}
 
 	//for every connected component, at least one of its big-pixels needs to be active
-	for (int i = 0; i < components.size(); i++)
+	for (int i = 0; i < num_components; i++)
 	{
-		GRBLinExpr sum;
+		MILPLinExpr sum;
 
-		unordered_map<int, BigPixel>& component = components[i];
-		for (unordered_map<int, BigPixel>::iterator itr = component.begin(); itr != component.end(); itr++)
+		bool has_fixed = false;
+		for (int k = candidates.component_begins[i]; k < candidates.component_begins[i + 1] && !has_fixed; k++)
 		{
-			sum += (*itr).second.var;
+			const BigPixelCandidate& candidate = candidates.entries[candidates.component_entries[k]];
+			has_fixed = candidate.fixed;
+			sum += candidate.Value();
 		}
-		model.addConstr(sum >= 1);
+		if (!has_fixed)
+			model.addConstr(sum >= 1);
 	}
 
 	//for water components, because they are 4-connectivity, diagonal faces are not allowed?
 	if (true)
 	{
-		for (int c = 0; c < components.size(); c++)
+		for (int c = num_lands; c < num_components; c++)
 		{
-			if (c < num_lands)
+			//bounding box of the component's big-pixels
+			Vec2i bbox_min, bbox_max;
+			if (!candidates.ComponentBBox(c, new_width, bbox_min, bbox_max))
 				continue;
 
-			unordered_map<int, BigPixel>& C = components[c];
-
-			//check every interior vertex position:
-			for (int vy = 1; vy < new_height; vy++)
+			//check every interior vertex position (w/ a face in the bounding box):
+			for (int vy = MAX2(1, bbox_min.y); vy <= MIN2(new_height - 1, bbox_max.y + 1); vy++)
 			{
-				for (int vx = 1; vx < new_width; vx++)
+				for (int vx = MAX2(1, bbox_min.x); vx <= MIN2(new_width - 1, bbox_max.x + 1); vx++)
 				{
 					//this vertex (vx,vy)'s 4 adjacent face positions:
 					Vec2i f0(vx - 1, vy - 1);
@@ -2261,10 +4744,14 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 					Vec2i f3(vx - 1, vy);
 
 					//the presences of the 4 faces in this component:
-					bool F0 = C.count(f0.y * new_width + f0.x) > 0;
-					bool F1 = C.count(f1.y * new_width + f1.x) > 0;
-					bool F2 = C.count(f2.y * new_width + f2.x) > 0;
-					bool F3 = C.count(f3.y * new_width + f3.x) > 0;
+					int E0 = candidates.Find(f0.y * new_width + f0.x, c);
+					bool F0 = (E0 >= 0);
+					int E1 = candidates.Find(f1.y * new_width + f1.x, c);
+					bool F1 = (E1 >= 0);
+					int E2 = candidates.Find(f2.y * new_width + f2.x, c);
+					bool F2 = (E2 >= 0);
+					int E3 = candidates.Find(f3.y * new_width + f3.x, c);
+					bool F3 = (E3 >= 0);
 					int count = F0 + F1 + F2 + F3;
 
 					if (count <= 1)
@@ -2274,14 +4761,14 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 						//two possible diagonal ways:
 						if (F0 && F2)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPLinExpr FF0 = candidates.entries[E0].Value();
+							MILPLinExpr FF2 = candidates.entries[E2].Value();
 							model.addConstr(FF0 + FF2 <= 1);
 						}
 						else if (F1 && F3)
 						{
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPLinExpr FF1 = candidates.entries[E1].Value();
+							MILPLinExpr FF3 = candidates.entries[E3].Value();
 							model.addConstr(FF1 + FF3 <= 1);
 						}
 					}
@@ -2290,39 +4777,39 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 						//4 possible ways:
 						if (!F0)
 						{
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPLinExpr FF1 = candidates.entries[E1].Value();
+							MILPLinExpr FF2 = candidates.entries[E2].Value();
+							MILPLinExpr FF3 = candidates.entries[E3].Value();
 							model.addConstr(FF1 + (1 - FF2) + FF3 <= 2);
 						}
 						else if (!F1)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPLinExpr FF0 = candidates.entries[E0].Value();
+							MILPLinExpr FF2 = candidates.entries[E2].Value();
+							MILPLinExpr FF3 = candidates.entries[E3].Value();
 							model.addConstr(FF0 + (1 - FF3) + FF2 <= 2);
 						}
 						else if (!F2)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+							MILPLinExpr FF0 = candidates.entries[E0].Value();
+							MILPLinExpr FF1 = candidates.entries[E1].Value();
+							MILPLinExpr FF3 = candidates.entries[E3].Value();
 							model.addConstr(FF1 + (1 - FF0) + FF3 <= 2);
 						}
 						else if (!F3)
 						{
-							GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-							GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-							GRBVar FF2 = C[f2.y * new_width + f2.x].var;
+							MILPLinExpr FF0 = candidates.entries[E0].Value();
+							MILPLinExpr FF1 = candidates.entries[E1].Value();
+							MILPLinExpr FF2 = candidates.entries[E2].Value();
 							model.addConstr(FF0 + (1 - FF1) + FF2 <= 2);
 						}
 					}
 					else if (count == 4) //all present:
 					{
-						GRBVar FF0 = C[f0.y * new_width + f0.x].var;
-						GRBVar FF1 = C[f1.y * new_width + f1.x].var;
-						GRBVar FF2 = C[f2.y * new_width + f2.x].var;
-						GRBVar FF3 = C[f3.y * new_width + f3.x].var;
+						MILPLinExpr FF0 = candidates.entries[E0].Value();
+						MILPLinExpr FF1 = candidates.entries[E1].Value();
+						MILPLinExpr FF2 = candidates.entries[E2].Value();
+						MILPLinExpr FF3 = candidates.entries[E3].Value();
 						model.addConstr(FF0 + (1 - FF1) + FF2 + (1 - FF3) <= 3);
 						model.addConstr((1 - FF0) + FF1 + (1 - FF2) + FF3 <= 3);
 					}
@@ -2334,7 +4821,7 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 	//for each land or water pixel, its cannot be adajcent to big-pixels of any other land or water pixels
 	//let's check every interior half-edges, sum{ he->f + sum{all of he->f's incompatible faces) } <= 1
 	//v-connect=true case: (for land only?) also check each of the two diagonal ways
-	if(g_ds_local_constraint)
+	if(options.local_constraint)
 	{
 		//collect candidates at "adjacent" faces - either sharing an edge, or sharing a vertex (diagonally)
 		vector<tuple<Vec2i, Vec2i, bool>> candidates_pairs;  //<face_pos,face_pos,diagonal-flag>
@@ -2430,20 +4917,20 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 			Vec2i FO = get<1>(candidates_pairs[i]);
 			bool is_diagonal = get<2>(candidates_pairs[i]);
 
-			unordered_map<int, bool>& F_cs = bigpixels_map[F.y * new_width + F.x];
-			unordered_map<int, bool>& FO_cs = bigpixels_map[FO.y * new_width + FO.x];
+			int F_index = F.y * new_width + F.x;
+			int FO_index = FO.y * new_width + FO.x;
 
 			//for every big-pixel candidate at F:
-			for (unordered_map<int, bool>::iterator itr = F_cs.begin(); itr != F_cs.end(); itr++)
+			for (int e0 = candidates.bigpixel_begins[F_index]; e0 < candidates.bigpixel_begins[F_index + 1]; e0++)
 			{
-				int c0 = (*itr).first;
+				int c0 = candidates.entries[e0].component;
 				bool c0_is_land = (c0 < num_lands);
 
 				//collect incompatible big-pixel candidates at FO:
-				GRBLinExpr sum;
-				for (unordered_map<int, bool>::iterator itr = FO_cs.begin(); itr != FO_cs.end(); itr++)
+				MILPLinExpr sum;
+				for (int e1 = candidates.bigpixel_begins[FO_index]; e1 < candidates.bigpixel_begins[FO_index + 1]; e1++)
 				{
-					int c1 = (*itr).first;
+					int c1 = candidates.entries[e1].component;
 					bool c1_is_land = (c1 < num_lands);
 
 					if (!is_diagonal)
@@ -2453,7 +4940,7 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 						if ((c0_is_land && c1_is_land && c0 != c1) ||
 							(!c0_is_land && !c1_is_land && c0 != c1))
 						{
-							sum += components[c1][FO.y * new_width + FO.x].var;
+							sum += candidates.entries[e1].Value();
 						}
 					}
 					else
@@ -2461,23 +4948,23 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 						//diagonal: only for land-land case
 						if ((c0_is_land && c1_is_land && c0 != c1))
 						{
-							sum += components[c1][FO.y * new_width + FO.x].var;
+							sum += candidates.entries[e1].Value();
 						}
 					}
 				}
 
-				GRBVar F_var = components[c0][F.y * new_width + F.x].var;
+				MILPLinExpr F_var = candidates.entries[e0].Value();
 				model.addConstr(F_var + sum <= 1);
 			}
 		}
 	}
 
-	////model the boundary constraints:
+	////model the boundary constraints (on the nodes of the VCs):
 
 	for (int b = 0; b < boundaries.size(); b++)
 	{
-		unordered_map<int, BigPixel>& land = components[boundaries[b].first.x];
-		unordered_map<int, BigPixel>& water = components[boundaries[b].first.y];
+		int land_index = boundaries[b].first.x;
+		int water_index = boundaries[b].first.y;
 
 		//the length of this boundary in original resolution
 		int boundary_size_ori = boundaries[b].second;
@@ -2486,141 +4973,94 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 		int BIG_NUM = MAX2((boundary_size_ori / bigpixel_width) * BIG_NUM_MULTIPLIER, 10);
 
 		vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>> &VCs = boundary_VCs[b];
-		vector<GRBVar>& VC_vars = boundary_VC_vars[b];
-		vector<GRBVar>& dist_vars = boundary_dist_vars[b];
-		vector<GRBVar>& last_vars = boundary_last_vars[b];
-
-		//build a quick map of VCs from Vec2i to index
-		map<int, vector<int>> VCs_map;  //key: y*new_width+x, value: list of indices in VCs at the position
-		for (int i = 0; i < VCs.size(); i++)
-		{
-			VCs_map[VCs[i].second.y * new_width + VCs[i].second.x].push_back(i);
-		}
-
+		vector<int>& VC_nodes = boundary_VC_nodes[b];
+		vector< vector<int> >& node_nexts = boundary_node_nexts[b];
+		vector<MILPVar>& VC_vars = boundary_VC_vars[b];
+		vector<MILPVar>& dist_vars = boundary_dist_vars[b];
+		vector<MILPVar>& last_vars = boundary_last_vars[b];
+		if (!VCs.empty() && last_vars.empty())
+			continue;  //all fixed
+
+		vector<bool> node_done(last_vars.size(), false);
 		for (int i = 0; i < VCs.size(); i++)
 		{
-			int type = VCs[i].first;  //0~11
 			Vec2i pos = VCs[i].second;
-			
-			//locate the pointing-to pos according to type:
-			Vec2i pos_to;
-			if (type == 0 || type == 4 || type == 8)  //out-going he is +y
-			{
-				pos_to = pos + Vec2i(0, 1);
-			}
-			else if (type == 1 || type == 5 || type == 9)  //+x
-			{
-				pos_to = pos + Vec2i(1, 0);
-			}
-			else if (type == 2 || type == 6 || type == 10)  //-y
-			{
-				pos_to = pos + Vec2i(0, -1);
-			}
-			else if (type == 3 || type == 7 || type == 11)  //-x
-			{
-				pos_to = pos + Vec2i(-1, 0);
-			}
-
-			GRBVar VC_var = VC_vars[i];
-			GRBVar dist_var = dist_vars[i];
+			int n = VC_nodes[i];
+			MILPVar VC_var = VC_vars[n];  //(none for a fixed node)
 
 			//if this VC's pointing-to pos has no existing VC, this VC cannot be active
-			if (VCs_map.count(pos_to.y * new_width + pos_to.x) == 0)
+			if (boundary_VC_ends[b][i])
 			{
-				model.addConstr(VC_var == 0);
+				model.addConstr(NodeValue(VC_var) == 0);  //(infeasible for a fixed one)
 			}
 
-			//if a VC is inactive, its dist var must be 0
-			model.addConstr(dist_var <= BIG_NUM * VC_var);
-			
-			//connectivity-based constraints:
+			if (VC_var.index >= 0)
 			{
+				//if a VC is inactive, its dist var must be 0
+				if (!options.lazy_loops)
+					model.addConstr(dist_vars[n] <= BIG_NUM * VC_var);
+
+				//connectivity-based constraints:
 				//for a VC to be active, the needed faces all shall match exactly
 				vector<Vec2i>& land_offsets = VCFaces[VCs[i].first].first;  //value: relative 0 or 1
 				vector<Vec2i>& water_offsets = VCFaces[VCs[i].first].second;
 
-				GRBLinExpr sum;  //sum of the needed face vars
+				MILPLinExpr sum;  //sum of the needed face vars
 				for (int j = 0; j < land_offsets.size(); j++)
 				{
 					Vec2i p = pos + land_offsets[j];
-					sum += land[p.y * new_width + p.x].var;
+					sum += candidates.At(p.y * new_width + p.x, land_index).Value();
 				}
 				for (int j = 0; j < water_offsets.size(); j++)
 				{
 					Vec2i p = pos + water_offsets[j];
-					sum += water[p.y * new_width + p.x].var;
+					sum += candidates.At(p.y * new_width + p.x, water_index).Value();
 				}
 				int N = land_offsets.size() + water_offsets.size();
 				model.addConstr(sum - N * VC_var >= 0);
 				model.addConstr(sum - N * VC_var <= N-1);
+			}
 
-				//for a VC from vertex#i to vertex#j:
-				//VC_(i,j) - (sum<d_j>-d_i) V LAST_i * BIG_NUM <= 0
-				//d_i is the dist var of vertex#i
-				//sum<d_j> is the sum of dist vars of compatible vertex#j
-				//LAST_i is the "last" flag for vertex#i
+			//the loop constraints of a node go w/ its first VC
+			if (node_done[n])
+				continue;
+			node_done[n] = true;
 
-				//find the VC at pos_to w/ compatible types (i.e., this VC's out dir equals next VC's in dir)
-				vector<int> to_indices;
-				vector<int>& candidates = VCs_map[pos_to.y * new_width + pos_to.x];
-				
-				int out_dir = 0;  //+y, +x, -y, -x
-				if (type == 0 || type == 4 || type == 8)
-					out_dir = 0;
-				else if (type == 1 || type == 5 || type == 9)
-					out_dir = 1;
-				else if (type == 2 || type == 6 || type == 10)
-					out_dir = 2;
-				else if (type == 3 || type == 7 || type == 11)
-					out_dir = 3;
+			//for a VC from vertex#i to vertex#j:
+			//VC_(i,j) - (sum<d_j>-d_i) V LAST_i * BIG_NUM <= 0
+			//d_i is the dist var of vertex#i
+			//sum<d_j> is the sum of dist vars of compatible vertex#j
+			//LAST_i is the "last" flag for vertex#i
+			vector<int>& to_indices = node_nexts[n];
+			MILPVar last_var = last_vars[n];
 
-				for (int k = 0; k < candidates.size(); k++)
+			if (options.lazy_loops)
+			{
+				//w/o the dist vars: an active VC goes on to a next VC, unless it's the last.
+				//more than one loop is cut off lazily (BoundaryLoopCuts)
+				MILPLinExpr sum_to_vars;
+				for (int k = 0; k < to_indices.size(); k++)
 				{
-					int to_type = VCs[candidates[k]].first;
-
-					int in_dir = 0;  //+y, +x, -y, -x
-					if (to_type == 0 || to_type == 1 || to_type == 2)  //+x
-						in_dir = 1;
-					else if (to_type == 3 || to_type == 4 || to_type == 5)  //+y
-						in_dir = 0;
-					else if (to_type == 6 || to_type == 7 || to_type == 8)  //-x
-						in_dir = 3;
-					else if (to_type == 9 || to_type == 10 || to_type == 11)  //-y
-						in_dir = 2;
-
-					if (out_dir == in_dir)
-					{
-						//compatible!
-						to_indices.push_back(candidates[k]);
-					}
+					sum_to_vars += NodeValue(VC_vars[to_indices[k]]);
 				}
 
-				
-				/*if (b == 2)
-				{
-					cout << "VC#" << i << " type:" << type << " pos:" << pos << " pos_to:" << pos_to << " tis: ";
-					for (int k = 0; k < to_indices.size(); k++)
-					{
-						cout << to_indices[k] << ",";
-					}
-					cout << endl;
-				}*/
-
-				GRBLinExpr sum_dist_to_vars;
+				model.addConstr(NodeValue(VC_var) - sum_to_vars - last_var <= 0);
+			}
+			else
+			{
+				MILPLinExpr sum_dist_to_vars;
 				for (int k = 0; k < to_indices.size(); k++)
 				{
 					sum_dist_to_vars += dist_vars[to_indices[k]];
 				}
-				
-				GRBVar last_var = last_vars[i];
 
-				model.addConstr(VC_var - (sum_dist_to_vars - dist_var) - last_var * BIG_NUM <= 0);
+				model.addConstr(NodeValue(VC_var) - (sum_dist_to_vars - dist_vars[n]) - last_var * BIG_NUM <= 0);
 			}
 		}
 
 		//exactly one last flag for this boundary is true
 		{
-			GRBLinExpr sum;
+			MILPLinExpr sum;
 			for (int i = 0; i < last_vars.size(); i++)
 			{
 				sum += last_vars[i];
@@ -2629,117 +5069,337 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 		}
 	}
 
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
 		cout << "[Downsampling] program setup time:" << timeGetTime() - time << endl;
 		time = timeGetTime();
 	}
 
+	//warm start: a vote assignment and the boundary loops it makes
+	if (options.warm_start)
+	{
+		//every big-pixel goes to its highest-score candidate component (ties: hinted component, then smaller component index)
+		//or to its fixed component
+		vector<int> votes(new_width * new_height, -1);
+		vector<int> num_votes(num_components, 0);
+		int num_hinted = 0;
+		for (int i = 0; i < new_width * new_height; i++)
+		{
+			//the slice is sorted by component, so the first of the highest scores has the smallest index
+			int vote = -1;
+			for (int e = candidates.bigpixel_begins[i]; e < candidates.bigpixel_begins[i + 1]; e++)
+			{
+				if (vote < 0 || candidates.entries[e].score > candidates.entries[vote].score)
+					vote = e;
+			}
+			votes[i] = candidates.entries[vote].component;
+			int hint = hint_components ? hint_components[i] : -1;
+			if (hint >= 0 && hint != votes[i])
+			{
+				int h = candidates.Find(i, hint);
+				if (h >= 0 && candidates.entries[h].score == candidates.entries[vote].score)
+				{
+					votes[i] = hint;
+					num_hinted++;
+				}
+			}
+			if (fixed_components && fixed_components[i] >= 0 && candidates.Find(i, fixed_components[i]) >= 0)
+				votes[i] = fixed_components[i];
+			num_votes[votes[i]]++;
+		}
+
+		//repair: a component w/o big-pixels takes its best big-pixel from a component that can spare one
+		//(a big-pixel hinted to it first)
+		int num_repaired = 0;
+		for (int c = 0; c < num_components; c++)
+		{
+			if (num_votes[c] > 0)
+				continue;
+
+			int best = -1;
+			int best_score = 0;
+			bool best_hinted = false;
+			for (int k = candidates.component_begins[c]; k < candidates.component_begins[c + 1]; k++)
+			{
+				const BigPixelCandidate& candidate = candidates.entries[candidates.component_entries[k]];
+				int i = candidate.bigpixel;
+				if (fixed_components && fixed_components[i] >= 0)
+					continue;
+				if (num_votes[votes[i]] <= 1)
+					continue;
+				bool hinted = (hint_components && hint_components[i] == c);
+				if (best < 0 || (hinted && !best_hinted) || (hinted == best_hinted && candidate.score > best_score))
+				{
+					best = i;
+					best_score = candidate.score;
+					best_hinted = hinted;
+				}
+			}
+			if (best >= 0)
+			{
+				num_votes[votes[best]]--;
+				votes[best] = c;
+				num_votes[c]++;
+				num_repaired++;
+			}
+		}
+
+		for (int e = 0; e < candidates.entries.size(); e++)
+		{
+			const BigPixelCandidate& candidate = candidates.entries[e];
+			if (!candidate.fixed)
+				model.setStart(candidate.var, votes[candidate.bigpixel] == candidate.component ? 1 : 0);
+		}
+
+		//the VCs of every boundary follow from the assignment. 
+		//trace the active VCs as a loop to get dist and last. ambiguous or multi-loop boundaries are left to the solver
+		int num_traced = 0;
+		for (int b = 0; b < boundaries.size(); b++)
+		{
+			vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>>& VCs = boundary_VCs[b];
+			int land_index = boundaries[b].first.x;
+			int water_index = boundaries[b].first.y;
+
+			vector<int>& VC_nodes = boundary_VC_nodes[b];
+			const int num_nodes = boundary_node_nexts[b].size();
+			if (num_nodes == 0)
+				continue;  //no VCs, or all fixed
+
+			//a fixed node is active. another one is its VC
+			vector<bool> actives(num_nodes, false);
+			int num_actives = 0;
+			for (int n = 0; n < num_nodes; n++)
+			{
+				if (boundary_node_fixed[b][n])
+				{
+					actives[n] = true;
+					num_actives++;
+				}
+			}
+			for (int i = 0; i < VCs.size(); i++)
+			{
+				int n = VC_nodes[i];
+				if (boundary_node_fixed[b][n])
+					continue;
+
+				vector<Vec2i>& land_offsets = VCFaces[VCs[i].first].first;
+				vector<Vec2i>& water_offsets = VCFaces[VCs[i].first].second;
+
+				bool active = true;
+				for (int j = 0; j < land_offsets.size() && active; j++)
+				{
+					Vec2i p = VCs[i].second + land_offsets[j];
+					active = (votes[p.y * new_width + p.x] == land_index);
+				}
+				for (int j = 0; j < water_offsets.size() && active; j++)
+				{
+					Vec2i p = VCs[i].second + water_offsets[j];
+					active = (votes[p.y * new_width + p.x] == water_index);
+				}
+
+				actives[n] = active;
+				if (active)
+					num_actives++;
+				model.setStart(boundary_VC_vars[b][n], active ? 1 : 0);
+			}
+
+			//follow the unique active next node from the first active node, until it comes back
+			vector<int> dists(num_nodes, 0);
+			int last = -1;
+			bool traced = false;
+			if (num_actives == 0)
+			{
+				//the boundary is gone: no loop, any VC can be the last
+				last = 0;
+				traced = true;
+			}
+			else
+			{
+				int first = 0;
+				while (!actives[first])
+					first++;
+
+				int BIG_NUM = MAX2((boundaries[b].second / bigpixel_width) * BIG_NUM_MULTIPLIER, 10);
+
+				int cur = first;
+				int dist = 0;
+				while (true)
+				{
+					dists[cur] = dist;
+
+					int next = -1;
+					int num_nexts = 0;
+					vector<int>& nexts = boundary_node_nexts[b][cur];
+					for (int k = 0; k < nexts.size(); k++)
+					{
+						if (actives[nexts[k]])
+						{
+							next = nexts[k];
+							num_nexts++;
+						}
+					}
+					//(the dist of every node, the last one's too, must leave room for the next one: dist + 1 <= BIG_NUM)
+					if (num_nexts != 1 || (dist >= BIG_NUM && !options.lazy_loops))
+						break;  //ambiguous, open or too long (for the dist vars)
+					if (next == first)
+					{
+						last = cur;
+						//a single loop must visit every active VC
+						traced = (dist + 1 == num_actives);
+						break;
+					}
+					if (dists[next] > 0)
+						break;  //loops back not to the first one
+
+					cur = next;
+					dist++;
+				}
+			}
+
+			if (traced)
+			{
+				for (int n = 0; n < num_nodes; n++)
+				{
+					if (!options.lazy_loops)
+						model.setStart(boundary_dist_vars[b][n], dists[n]);
+					model.setStart(boundary_last_vars[b][n], n == last ? 1 : 0);
+				}
+				num_traced++;
+			}
+		}
+
+		if (options.print_debug)
+		{
+			cout << "[Downsampling] warm start: hinted big-pixels:" << num_hinted << " repaired components:" << num_repaired << " traced boundaries:" << num_traced <<
+				"/" << boundaries.size() << " time:" << timeGetTime() - time << endl;
+			time = timeGetTime();
+		}
+	}
+
+	if (options.print_debug)
+	{
+		cout << "[Downsampling] presolve: fixed big-pixels:" << num_fixed_bigpixels << "/" << new_width * new_height <<
+			" (dominated:" << num_dominated << ") ruled out candidates:" << num_ruled_out << " big-pixel vars:" << num_bigpixel_vars << "/" << num_candidates <<
+			" (" << (num_candidates > 0 ? 100.0f * num_bigpixel_vars / num_candidates : 0) << "%) model vars:" << model.numVars() <<
+			" constraints:" << model.constrs.size() << endl;
+	}
+
 	//solve!
-	model.getEnv().set(GRB_DoubleParam_TimeLimit, 60);
-	if(!g_ds_print_debug)
-		model.getEnv().set(GRB_IntParam_OutputFlag, false);  //silent
-	model.optimize();
-	int status = model.get(GRB_IntAttr_Status);
-	if (status == 3)
+	model.setTimeLimit(options.time_limit);
+	model.setThreads(options.milp_threads);
+	model.setMIPGap(options.mip_gap);
+	model.setNodeLimit(options.node_limit);
+	model.setMemLimit(options.mem_limit);
+	model.setSeed(options.seed);
+	model.setInterrupt(interrupt);
+	BoundaryLoopCuts loop_cuts(boundary_VC_vars, boundary_node_nexts);
+	if (options.lazy_loops)
+		model.setLazyConstraints(&loop_cuts);
+	if(!options.print_debug)
+		model.setOutputFlag(false);  //silent
+	int status = options.decompose ? SolveMILPDecomposed(model, options.milp_backend) : model.optimize(options.milp_backend);
+	if (stats)
 	{
+		SolverStats solve_stats;
+		solve_stats.num_solves = 1;
+		solve_stats.status = status;
+		solve_stats.runtime = model.runtime;
+		solve_stats.node_count = model.node_count;
+		solve_stats.gap = model.gap;
+		stats->Add(solve_stats);
+	}
+	if (status == MILP_INFEASIBLE)
+	{
+		if (num_dominated > 0)
+		{
+			cout << "[Downsampling] the problem w/ dominated big-pixels is infeasible. solving the exact model" << endl;
+			DownsampleOptions exact_options = options;
+			exact_options.presolve_dominance = 0;
+			return Downsample(labels, exact_options, output, output_components, fixed_components, interrupt, hint_components, stats);
+		}
+
 		//infeasible or timeout
 		printf("[Downsampling] the problem is infeasible");
 		return 2;
 	}
-	else if (status != 9/*time-out*/ && status != 2 && status != 11 && status != 13)
+	else if (status != MILP_TIME_LIMIT && status != MILP_NODE_LIMIT && status != MILP_OPTIMAL && status != MILP_INTERRUPTED && status != MILP_SUBOPTIMAL)
 	{
 		//some other failure
 		printf("[Downsampling] optimize failed! status:%d", status);
 		return 1;
 	}
+	else if (!model.hasSolution() && model.numVars() > 0)  //(w/o vars, the presolve fixed all)
+	{
+		//stopped before finding a solution
+		printf("[Downsampling] no solution found! status:%d", status);
+		return 1;
+	}
 
-	float runtime = model.get(GRB_DoubleAttr_Runtime);
+	float runtime = model.runtime;
 
-	printf("[Downsampling] optimize done! time:%f", runtime);
+	printf("[Downsampling] optimize done! time:%f nodes:%.0f gap:%g", runtime, model.node_count, model.gap);
+	if (options.lazy_loops)
+		printf(" violated loop constraints:%d", model.num_lazy_cuts);
 
 	//get results
 
-	if (g_ds_save_components_to_file)
+	if (output_components)
 	{
-		g_ds_input_components.clear();
-		g_ds_input_components.resize(width* height, 999999);
-
-		g_ds_output_components.clear();
-		g_ds_output_components.resize(new_width * new_height, 999999);
+		for (int i = 0; i < new_width * new_height; i++)
+			output_components[i] = -1;
 	}
 
 	memset(output, false, sizeof(bool) * new_width * new_height);
-	for (int i = 0; i < components.size(); i++)
+	for (int e = 0; e < candidates.entries.size(); e++)
 	{
-		for (unordered_map<int, BigPixel>::iterator itr = components[i].begin(); itr != components[i].end(); itr++)
-		{
-			Vec2i XY = (*itr).second.pos;
-
-			bool flag = (bool)((*itr).second.var.get(GRB_DoubleAttr_X));
-			if (flag)
-			{
-				if (i < num_lands)
-					output[XY.y * new_width + XY.x] = true;
-				else
-					output[XY.y * new_width + XY.x] = false;
-
-				//save output component indices?
-				if (g_ds_save_components_to_file)
-					g_ds_output_components[XY.y * new_width + XY.x] = i;
-			}
-		}
-	}
+		const BigPixelCandidate& candidate = candidates.entries[e];
+		int i = candidate.component;
 
-	//save input component indices?
-	if (g_ds_save_components_to_file)
-	{
-		for (unordered_map<int, pair<Vec2i, pair<bool, int>>>::iterator itr = labels.begin(); itr != labels.end(); itr++)
+		bool flag = candidate.fixed || (bool)(model.getX(candidate.var));
+		if (flag)
 		{
-			Vec2i xy = (*itr).second.first;
-
-			int c = -1;
-			if (!(*itr).second.second.first)
-				c = (*itr).second.second.second;
+			if (i < num_lands)
+				output[candidate.bigpixel] = true;
 			else
-				c = num_lands + (*itr).second.second.second;
+				output[candidate.bigpixel] = false;
 
-			g_ds_input_components[xy.y * width + xy.x] = c;
+			//output component indices?
+			if (output_components)
+				output_components[candidate.bigpixel] = i;
 		}
 	}
 
-	if (g_ds_print_debug)
+	if (options.print_debug)
 	{
-		//save solved boundaries
-		g_ds_output_boundaries.clear(); 
+		//print solved boundaries
 		for (int b = 0; b < boundaries.size(); b++)
 		{
 			vector<pair<int/*0~11 type*/, Vec2i/*pos of vertex*/>>& VCs = boundary_VCs[b];
-			vector<GRBVar>& VC_vars = boundary_VC_vars[b];
-			vector<GRBVar>& dist_vars = boundary_dist_vars[b];
-			vector<GRBVar>& last_vars = boundary_last_vars[b];
-
-			vector<tuple<Vec2i, int/*type*/, int/*dist*/>> output_boundaries;
+			vector<MILPVar>& VC_vars = boundary_VC_vars[b];
+			vector<MILPVar>& dist_vars = boundary_dist_vars[b];
+			vector<MILPVar>& last_vars = boundary_last_vars[b];
 
-			for (int i = 0; i < VC_vars.size(); i++)
+			int num_active = 0;
+			for (int i = 0; i < VCs.size(); i++)
 			{
-				bool flag = (bool)(VC_vars[i].get(GRB_DoubleAttr_X));
+				int n = boundary_VC_nodes[b][i];
+				if (n < 0)
+					continue;  //all fixed
+				bool flag = (VC_vars[n].index < 0) || (bool)(model.getX(VC_vars[n]));
 				if (flag)
 				{
-					int dist = (int)(dist_vars[i].get(GRB_DoubleAttr_X));
+					int dist = dist_vars.empty() ? 0 : (int)(model.getX(dist_vars[n]));
 
-					bool last = (bool)(last_vars[i].get(GRB_DoubleAttr_X));
+					bool last = (bool)(model.getX(last_vars[n]));
 
 					if(b==2)
 						cout << "active VC! type:" << VCs[i].first << " " << VCs[i].second << " dist:" << dist << " last:" << last << endl;
 
-					output_boundaries.push_back(make_tuple(VCs[i].second, VCs[i].first, dist));
+					num_active++;
 				}
 			}
 
-			cout << "boundary#" << b << ":" << output_boundaries.size() << endl;
-
-			g_ds_output_boundaries.push_back(output_boundaries);
+			cout << "boundary#" << b << ":" << num_active << endl;
 		}
 	}
 
@@ -2748,73 +5408,223 @@ int DSSpace::Downsample(int width, int height, bool* mask, int bigpixel_width, i
 }
 
 
-bool DSSpace::ErrorMetricsPng(const char* input_filename, const char* output_filename, 
-	float& IoU, float& Dice, float& Precision, float& Recall)
+int DSSpace::DownsampleTiled(int width, int height, bool* mask, const DownsampleOptions& options, bool* output)
 {
-	std::vector<unsigned char> in_buffer; //the raw pixels (RGBA)
-	unsigned width = 0, height = 0;
-	unsigned error = lodepng::decode(in_buffer, width, height, input_filename);
-	if (error)
+	//let's label the topology of the mask first
+	LabelMap labels;
+	LabelComponents(width, height, mask, labels, options.print_debug);
+
+	return DownsampleTiled(labels, options, output);
+}
+
+int DSSpace::DownsampleTiled(const LabelMap& labels, const DownsampleOptions& options, bool* output, int* output_components,
+	atomic<bool>* interrupt, SolverStats* stats)
+{
+	const int width = labels.width;
+	const int height = labels.height;
+	const int bigpixel_width = options.bigpixel_width;
+	const int bigpixel_height = options.bigpixel_height;
+	const int tile_size = options.tile_size;
+	const int halo_size = options.tile_halo;
+
+	if (width % bigpixel_width != 0 || height % bigpixel_width != 0)
 	{
-		cout << input_filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
-		return false;
+		cout << "[DownsampleTiled] error: width / height not dividable" << endl;
+		return 1;
+	}
+	if (tile_size <= 0 || halo_size < 0)
+	{
+		cout << "[DownsampleTiled] error: wrong tile size:" << tile_size << " halo size:" << halo_size << endl;
+		return 1;
 	}
 
-	std::vector<unsigned char> out_buffer; //the raw pixels (RGBA)
-	unsigned new_width = 0, new_height = 0;
-	error = lodepng::decode(out_buffer, new_width, new_height, output_filename);
-	if (error)
+	DWORD time_begin = timeGetTime();
+
+	//size of the new mask:
+	int new_width = width / bigpixel_width;
+	int new_height = height / bigpixel_height;
+
+	int num_tiles_x = (new_width + tile_size - 1) / tile_size;
+	int num_tiles_y = (new_height + tile_size - 1) / tile_size;
+	int num_tiles = num_tiles_x * num_tiles_y;
+
+	//components crossing tiles: their bounding boxes span more than one tile
+	vector<int> crossing_components;
+	for (int c = 0; c < labels.NumComponents(); c++)
 	{
-		cout << output_filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
-		return false;
+		const ComponentInfo& info = labels.components[c];
+		int tile_x0 = info.bbox_min.x / bigpixel_width / tile_size;
+		int tile_y0 = info.bbox_min.y / bigpixel_height / tile_size;
+		int tile_x1 = info.bbox_max.x / bigpixel_width / tile_size;
+		int tile_y1 = info.bbox_max.y / bigpixel_height / tile_size;
+		if (tile_x0 != tile_x1 || tile_y0 != tile_y1)
+			crossing_components.push_back(c);
+	}
+	cout << "[DownsampleTiled] tiles:" << num_tiles_x << "x" << num_tiles_y << " (" << tile_size << " big-pixels + halo " << 
+		halo_size << ") components crossing tiles:" << crossing_components.size() << "/" << labels.NumComponents() << endl;
+	if (options.print_debug)
+	{
+		for (int i = 0; i < crossing_components.size(); i++)
+		{
+			int c = crossing_components[i];
+			cout << (labels.IsLand(c) ? "land  " : "water ") << "C#" << c << " bbox:" << labels.components[c].bbox_min << "-" << 
+				labels.components[c].bbox_max << endl;
+		}
 	}
 
-	//turn the image buffers to binary masks
-	bool* input = new bool[width * height];
-	for (int y = 0; y < height; y++)
+	//1. solve every tile (w/ its halo) independently
+	//fixed component of every output big-pixel: a tile's solution at its interior (away from the seams by halo_size)
+	vector<int> fixed_components(new_width * new_height, -1);
+	//the rest of the tile's solution (the halo bands of its core) is the warm start hint of the stitching
+	vector<int> hint_components(new_width * new_height, -1);
+	int num_failed_tiles = 0;
+	vector<SolverStats> tile_stats(num_tiles);
+
+	//the tiles are solved concurrently. the solver threads are split between the workers
+	int num_workers = max(1, min(omp_get_max_threads(), num_tiles));
+	DownsampleOptions tile_options = options;
+	if (options.milp_threads > 0)
+		tile_options.milp_threads = max(1, options.milp_threads / num_workers);
+	else if (num_workers > 1)
+		tile_options.milp_threads = max(1, omp_get_num_procs() / num_workers);
+
+#pragma omp parallel for schedule(dynamic) num_threads(num_workers)
+	for (int t = 0; t < num_tiles; t++)
 	{
-		for (int x = 0; x < width; x++)
+		//tile and halo ranges in big-pixels: [X0,X1) x [Y0,Y1)
+		int X0 = (t % num_tiles_x) * tile_size;
+		int Y0 = (t / num_tiles_x) * tile_size;
+		int X1 = MIN2(X0 + tile_size, new_width);
+		int Y1 = MIN2(Y0 + tile_size, new_height);
+		int HX0 = MAX2(X0 - halo_size, 0);
+		int HY0 = MAX2(Y0 - halo_size, 0);
+		int HX1 = MIN2(X1 + halo_size, new_width);
+		int HY1 = MIN2(Y1 + halo_size, new_height);
+
+		int tile_width = (HX1 - HX0) * bigpixel_width;
+		int tile_height = (HY1 - HY0) * bigpixel_height;
+		int tile_new_width = HX1 - HX0;
+		int tile_new_height = HY1 - HY0;
+
+		//cut the tile's mask out of the labels
+		vector<char> tile_mask(tile_width * tile_height);
+		for (int y = 0; y < tile_height; y++)
 		{
-			int offset = (y * width + x) * 4;
-			Vec4<unsigned char> p(in_buffer[offset], in_buffer[offset + 1], in_buffer[offset + 2], in_buffer[offset + 3]);
+			for (int x = 0; x < tile_width; x++)
+			{
+				int c = labels.At(HX0 * bigpixel_width + x, HY0 * bigpixel_height + y);
+				tile_mask[y * tile_width + x] = labels.IsLand(c);
+			}
+		}
 
-			//binarilization: <128 = black, >128 = white
-			if (p[0] >= 128 && p[1] >= 128 && p[2] >= 128)
+		LabelMap tile_labels;
+		LabelComponents(tile_width, tile_height, (bool*)&tile_mask[0], tile_labels);
+
+		//a tile component is a part of a single global component
+		vector<int> to_global(tile_labels.NumComponents(), -1);
+		for (int y = 0; y < tile_height; y++)
+		{
+			for (int x = 0; x < tile_width; x++)
 			{
-				input[y * width + x] = true;
+				int c = tile_labels.At(x, y);
+				if (to_global[c] < 0)
+					to_global[c] = labels.At(HX0 * bigpixel_width + x, HY0 * bigpixel_height + y);
 			}
-			else
+		}
+
+		vector<char> tile_output(tile_new_width * tile_new_height);
+		vector<int> tile_components(tile_new_width * tile_new_height);
+		if (Downsample(tile_labels, tile_options, (bool*)&tile_output[0], &tile_components[0], NULL, interrupt, NULL, &tile_stats[t]) != 0)
+		{
+			//leave this tile to the stitching model
+#pragma omp atomic
+			num_failed_tiles++;
+			continue;
+		}
+
+		//fix the interior: away from the seams (not from the image borders) by halo_size
+		for (int Y = Y0; Y < Y1; Y++)
+		{
+			for (int X = X0; X < X1; X++)
 			{
-				input[y * width + x] = false;
+				int c = tile_components[(Y - HY0) * tile_new_width + (X - HX0)];
+				if (c < 0)
+					continue;
+
+				if ((X0 > 0 && X < X0 + halo_size) || (X1 < new_width && X >= X1 - halo_size) ||
+					(Y0 > 0 && Y < Y0 + halo_size) || (Y1 < new_height && Y >= Y1 - halo_size))
+					hint_components[Y * new_width + X] = to_global[c];  //halo band
+				else
+					fixed_components[Y * new_width + X] = to_global[c];
 			}
 		}
 	}
 
-	bool* output = new bool[new_width * new_height];
-	for (int y = 0; y < new_height; y++)
-	{
-		for (int x = 0; x < new_width; x++)
-		{
-			int offset = (y * new_width + x) * 4;
-			Vec4<unsigned char> p(out_buffer[offset], out_buffer[offset + 1], out_buffer[offset + 2], out_buffer[offset + 3]);
+	int num_fixed = 0;
+	for (int i = 0; i < new_width * new_height; i++)
+	{
+		if (fixed_components[i] >= 0)
+			num_fixed++;
+	}
+	cout << "[DownsampleTiled] tiles done. failed tiles:" << num_failed_tiles << " fixed big-pixels:" << num_fixed << "/" << 
+		new_width * new_height << " solver threads:" << tile_options.milp_threads << " time:" << timeGetTime() - time_begin << endl;
+	if (stats)
+	{
+		for (int t = 0; t < num_tiles; t++)
+			stats->Add(tile_stats[t]);
+	}
+
+	//2. stitch: w/ the tile interiors fixed, the model only has the halo bands (and the failed tiles):
+	//their big-pixels, the VCs there and the contracted boundary pieces of the interiors between them
+	int result = Downsample(labels, options, output, output_components, &fixed_components[0], interrupt, &hint_components[0], stats);
+	if (result != 0)
+	{
+		if (!(interrupt && *interrupt))
+			cout << "[DownsampleTiled] stitching failed. status:" << result << endl;
+		return result;
+	}
+
+	//check the Betti numbers
+	LabelMap output_labels;
+	LabelComponents(new_width, new_height, output, output_labels);
+	if (output_labels.num_lands == labels.num_lands && output_labels.num_waters == labels.num_waters)
+	{
+		cout << "[DownsampleTiled] Betti numbers preserved: h0:" << labels.num_lands << " h1:" << labels.num_waters << endl;
+	}
+	else
+	{
+		cout << "[DownsampleTiled] warning: Betti numbers changed! h0:" << labels.num_lands << "->" << output_labels.num_lands << 
+			" h1:" << labels.num_waters << "->" << output_labels.num_waters << endl;
+	}
+
+	cout << "[DownsampleTiled] done. total time:" << timeGetTime() - time_begin << endl;
+	return 0;
+}
+
+bool DSSpace::ErrorMetricsPng(const char* input_filename, const char* output_filename, 
+	float& IoU, float& Dice, float& Precision, float& Recall)
+{
+	//binarilization: <128 = black, >128 = white
+	BitMask input, output;
+	if (!LoadMask(input_filename, 128, input) || !LoadMask(output_filename, 128, output))
+		return false;
+
+	return ErrorMetrics(input, output, IoU, Dice, Precision, Recall);
+}
 
-			//binarilization: <128 = black, >128 = white
-			if (p[0] >= 128 && p[1] >= 128 && p[2] >= 128)
-			{
-				output[y * new_width + x] = true;
-			}
-			else
-			{
-				output[y * new_width + x] = false;
-			}
-		}
-	}
+//IoU etc from the # of small pixels of true positives, false positives and false negatives
+static void ErrorMetricsFromCounts(long long num_TP, long long num_FP, long long num_FN, float& IoU, float& Dice, float& Precision, float& Recall)
+{
+	IoU = (float)num_TP / ((float)num_TP + (float)num_FP + (float)num_FN);
+
+	//Dice = F1 score
+	Dice = 2 * (float)num_TP / (2 * (float)num_TP + (float)num_FP + (float)num_FN);
 
-	ErrorMetrics(width, height, input, new_width, new_height, output, IoU, Dice, Precision, Recall);
+	Precision = (float)num_TP / ((float)num_TP + (float)num_FP);
 
-	delete input;
-	delete output;
-	return true;
+	Recall = (float)num_TP / (float)(num_TP + num_FN);
+
+	printf("[ErrorMetrics] IoU:%f Dice:%f Precision:%f Recall:%f", IoU, Dice, Precision, Recall);
 }
 
 bool DSSpace::ErrorMetrics(int width, int height, bool* input/*size = width*height */,
@@ -2853,16 +5663,75 @@ bool DSSpace::ErrorMetrics(int width, int height, bool* input/*size = width*heig
 		}
 	}
 
-	IoU = (float)num_TP / ((float)num_TP + (float)num_FP + (float)num_FN);
+	ErrorMetricsFromCounts(num_TP, num_FP, num_FN, IoU, Dice, Precision, Recall);
+	return true;
+}
 
-	//Dice = F1 score
-	Dice = 2 * (float)num_TP / (2 * (float)num_TP + (float)num_FP + (float)num_FN);
+//set bits [begin, end) of a bit row
+static void SetBitRange(unsigned long long* row, int begin, int end)
+{
+	while (begin < end)
+	{
+		int word = begin >> 6;
+		int bit = begin & 63;
+		int count = min(64 - bit, end - begin);
+		row[word] |= (count == 64 ? ~0ull : ((1ull << count) - 1)) << bit;
+		begin += count;
+	}
+}
 
-	Precision = (float)num_TP / ((float)num_TP + (float)num_FP);
+bool DSSpace::ErrorMetrics(const BitMask& input, const BitMask& output, float& IoU, float& Dice, float& Precision, float& Recall)
+{
+	const int width = input.width;
+	const int height = input.height;
+	const int new_width = output.width;
+	const int new_height = output.height;
+	if (width == 0 || height == 0 || new_width == 0 || new_height == 0 || (width % new_width) != 0 || (height % new_height) != 0)
+	{
+		cout << "[CalculateErrors] wrong inputs" << endl;
+		return false;
+	}
 
-	Recall = (float)num_TP / (float)(num_TP + num_FN);
+	//small pixel -> big pixel mapping, w/ the same float arithmetic as the bool version so that the counts are identical.
+	//x_begins[X]: first small pixel x of big pixel X
+	vector<int> x_begins(new_width + 1, width);
+	for (int x = width - 1; x >= 0; x--)
+		x_begins[(int)(x * (float)new_width / (float)width)] = x;
+	for (int X = new_width - 1; X >= 0; X--)
+		x_begins[X] = min(x_begins[X], x_begins[X + 1]);
 
-	printf("[ErrorMetrics] IoU:%f Dice:%f Precision:%f Recall:%f", IoU, Dice, Precision, Recall);
+	//each output row is upsampled to a full-width bit row once, then compared against the input rows of the big pixel
+	const int words_per_row = input.words_per_row;
+	vector<unsigned long long> upsampled(words_per_row);
+	int upsampled_Y = -1;
+
+	long long num_TP = 0, num_FP = 0, num_FN = 0;
+	for (int y = 0; y < height; y++)
+	{
+		int Y = (int)(y * (float)new_height / (float)height);
+		if (Y != upsampled_Y)
+		{
+			fill(upsampled.begin(), upsampled.end(), 0ull);
+			const unsigned long long* out_row = output.Row(Y);
+			for (int X = 0; X < new_width; X++)
+			{
+				if (out_row[X >> 6] >> (X & 63) & 1)
+					SetBitRange(&upsampled[0], x_begins[X], x_begins[X + 1]);
+			}
+			upsampled_Y = Y;
+		}
+
+		//padding bits are zero in both rows
+		const unsigned long long* in_row = input.Row(y);
+		for (int i = 0; i < words_per_row; i++)
+		{
+			num_TP += PopCount(in_row[i] & upsampled[i]);
+			num_FP += PopCount(~in_row[i] & upsampled[i]);
+			num_FN += PopCount(in_row[i] & ~upsampled[i]);
+		}
+	}
+
+	ErrorMetricsFromCounts(num_TP, num_FP, num_FN, IoU, Dice, Precision, Recall);
 	return true;
 }
 
@@ -3046,184 +5915,477 @@ int ConnectedComponentsN4(vector<bool> &buffer)
 	return 0;
 }
 
-bool DSSpace::DownsampleACN(int width, int height, bool* mask/*size = width*height */, bool* output)
+//ACN of every 3x3 neighborhood: the 9-bit code of a neighborhood has the pixel (X + x_, Y + y_) at bit (y_ + 1) * 3 + (x_ + 1)
+static void BuildACNTable(vector<char>& table)
 {
-	if (width % 2 != 0 || height % 2 != 0)
+	table.resize(512);
+	for (int code = 0; code < 512; code++)
 	{
-		cout << "[DownsampleACN] error: width / height not dividable" << endl;
-		return false;
-	}
+		vector<bool> neighborhood(9);  //row-major left-to-right bottom-to-top
+		for (int i = 0; i < 9; i++)
+		{
+			neighborhood[i] = (code >> i) & 1;
+		}
 
-	//calculate per-pixel adaptive crossing numbers
-	vector<int> ACNs(width * height, 0);
+		bool val = neighborhood[4];
 
-	//note: just assume boundary pixels' ACNs are 0. we don't tackle them
-	for (int Y = 1; Y < height - 1; Y++)
-	{
-		for (int X = 1; X < width - 1; X++)
+		//p is the center point
+		// 
+		//calculate n^I(p)
+		int nIp = 0;
+		for (int i = 0; i < 9; i++)
 		{
-			//prepare the 3x3 neighborhood:
-			vector<bool> neighborhood;  //row-major left-to-right bottom-to-top
-			for (int y_ = -1; y_ <= 1; y_++)
-			{
-				for (int x_ = -1; x_ <= 1; x_++)
-				{
-					neighborhood.push_back(mask[(Y + y_)*width + (X + x_)]);
-				}
-			}
+			if (i != 4 && neighborhood[i] == val)
+				nIp++;
+		}
 
-			bool val = neighborhood[4];
+		//depends on nI(p):
+		if (nIp < 4)  //count # of N4-connected components of p's N8-neighbors w/ opposite value
+			table[code] = ConnectedComponentsN8(neighborhood);
+		else  //count # of N8-connected components of p's N4-neighbors
+			table[code] = ConnectedComponentsN4(neighborhood);
+	}
+}
 
-			//p is this point (x,y)
-			// 
-			//calculate n^I(p)
-			int nIp = 0;
-			for (int y_ = 0; y_ <= 2; y_++)
-			{
-				for (int x_ = 0; x_ <= 2; x_++)
-				{
-					if (x_ == 1 && y_ == 1)
-						continue;  //skip itself
-					
-					if (neighborhood[y_ * 3 + x_] == val)
-						nIp++;
-				}
-			}
+//ACN of a pixel, looked up by its neighborhood code
+//ACN of image pixel (X,Y). band: image rows [band_y, band_y + band.height), which include Y's neighbors
+static int PixelACN(const BitMask& band, int band_y, int image_height, const vector<char>& ACN_table, int X, int Y)
+{
+	//note: just assume boundary pixels' ACNs are 0. we don't tackle them
+	if (X < 1 || Y < 1 || X >= band.width - 1 || Y >= image_height - 1)
+		return 0;
 
-			//depends on nI(p):
-			if (nIp < 4)  //count # of N4-connected components of p's N8-neighbors w/ opposite value
-			{
-				ACNs[Y * width + X] = ConnectedComponentsN8(neighborhood);
-			}
-			else  //count # of N8-connected components of p's N4-neighbors
-			{
-				ACNs[Y * width + X] = ConnectedComponentsN4(neighborhood);
-			}
+	int code = 0;
+	for (int y_ = -1; y_ <= 1; y_++)
+	{
+		const unsigned long long* row = band.Row(Y + y_ - band_y);
+		for (int x_ = -1; x_ <= 1; x_++)
+		{
+			int x = X + x_;
+			code |= (int)((row[x >> 6] >> (x & 63)) & 1) << ((y_ + 1) * 3 + (x_ + 1));
 		}
 	}
+	return ACN_table[code];
+}
 
+//ACN downsampling of output rows [Y0, Y1). band: image rows [band_y, band_y + band.height), 
+//which include input rows [Y0 * 2 - 1, Y1 * 2 + 1) (as far as the image goes)
+static void DownsampleACNRows(const BitMask& band, int band_y, int image_height, const vector<char>& ACN_table,
+	int Y0, int Y1, BitMask& output)
+{
 	//now, write to output buffer according to ACNs
 	//(for every 2x2 bigpixel, pick the pixel with the highest ACN. pick first one in tie)
-	int new_width = width / 2;
-	int new_height = height / 2;
-	for (int Y = 0; Y < new_height; Y++)
+	for (int Y = Y0; Y < Y1; Y++)
 	{
-		for (int X = 0; X < new_width; X++)
+		for (int X = 0; X < output.width; X++)
 		{
 			//(X,Y) is bigpixel coord
 
 			//the ACNs of the 4 pixels:
-			int ACN0 = ACNs[(Y * 2) * width + (X * 2)];
-			int ACN1 = ACNs[(Y * 2) * width + (X * 2 + 1)];
-			int ACN2 = ACNs[(Y * 2 + 1) * width + (X * 2 + 1)];
-			int ACN3 = ACNs[(Y * 2 + 1) * width + (X * 2)];
+			int ACN0 = PixelACN(band, band_y, image_height, ACN_table, X * 2, Y * 2);
+			int ACN1 = PixelACN(band, band_y, image_height, ACN_table, X * 2 + 1, Y * 2);
+			int ACN2 = PixelACN(band, band_y, image_height, ACN_table, X * 2 + 1, Y * 2 + 1);
+			int ACN3 = PixelACN(band, band_y, image_height, ACN_table, X * 2, Y * 2 + 1);
 
 			bool val = false;
 
 			//ACN0 win?
 			if (ACN0 >= ACN1 && ACN0 >= ACN2 && ACN0 >= ACN3)
 			{
-				val = mask[(Y * 2) * width + (X * 2)];
+				val = band.Get(X * 2, Y * 2 - band_y);
 			}
 			else if (ACN1 > ACN0 && ACN1 >= ACN2 && ACN1 >= ACN3)
 			{
-				val = mask[(Y * 2) * width + (X * 2 + 1)];
+				val = band.Get(X * 2 + 1, Y * 2 - band_y);
 			}
 			else if (ACN2 > ACN0 && ACN2 > ACN1 && ACN2 >= ACN3)
 			{
-				val = mask[(Y * 2 + 1) * width + (X * 2 + 1)];
+				val = band.Get(X * 2 + 1, Y * 2 + 1 - band_y);
 			}
 			else
 			{
-				val = mask[(Y * 2 + 1) * width + (X * 2)];
+				val = band.Get(X * 2, Y * 2 + 1 - band_y);
 			}
 
-			output[Y * new_width + X] = val;
+			output.Set(X, Y, val);
 		}
 	}
+}
+
+bool DSSpace::DownsampleACN(int width, int height, bool* mask/*size = width*height */, bool* output)
+{
+	if (width % 2 != 0 || height % 2 != 0)
+	{
+		cout << "[DownsampleACN] error: width / height not dividable" << endl;
+		return false;
+	}
 
+	BitMask mask_bits, output_bits;
+	PackMask(width, height, mask, mask_bits);
+	if (!DownsampleACN(mask_bits, output_bits))
+		return false;
+	UnpackMask(output_bits, output);
 	return true;
 }
 
-bool DSSpace::DownsampleACNPng(const char* input_filename)
+bool DSSpace::DownsampleACN(const BitMask& mask, BitMask& output)
 {
-	std::vector<unsigned char> in_buffer; //the raw pixels (RGBA)
-	unsigned width = 0, height = 0;
-	unsigned error = lodepng::decode(in_buffer, width, height, input_filename);
-	if (error)
+	if (mask.width % 2 != 0 || mask.height % 2 != 0)
 	{
-		cout << input_filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+		cout << "[DownsampleACN] error: width / height not dividable" << endl;
 		return false;
 	}
 
-	if ((width % 2) != 0 || (height % 2) != 0)
+	//per-pixel adaptive crossing numbers only depend on the 3x3 neighborhoods
+	vector<char> ACN_table;
+	BuildACNTable(ACN_table);
+
+	output.Resize(mask.width / 2, mask.height / 2);
+	DownsampleACNRows(mask, 0, mask.height, ACN_table, 0, output.height, output);
+	return true;
+}
+
+//band mode of DownsampleACNPng: the input is streamed in bands w/ 1 row of halo (the 3x3 neighborhoods),
+//which gives the same result as the whole image at once
+static bool DownsampleACNPngBands(const char* input_filename, const DownsampleOptions& options, BitMask& output)
+{
+	PngBandReader reader;
+	if (!reader.Open(input_filename, options.png_threshold))
+		return false;
+
+	if ((reader.width % 2) != 0 || (reader.height % 2) != 0)
 	{
 		cout << "error: width / height not dividable!" << endl;
 		return false;
 	}
 
-	//turn the image buffer to a binary mask buffer
-	bool* mask = new bool[width * height];
-	for (int y = 0; y < height; y++)
+	vector<char> ACN_table;
+	BuildACNTable(ACN_table);
+
+	output.Resize(reader.width / 2, reader.height / 2);
+	BitMask band;
+	while (reader.next_row < reader.height)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			int offset = (y * width + x) * 4;
-			Vec4<unsigned char> p(in_buffer[offset], in_buffer[offset + 1], in_buffer[offset + 2], in_buffer[offset + 3]);
+		int core_begin = reader.next_row;
+		int band_y = 0;
+		if (!reader.ReadBand(options.band_height * 2, 1, band, band_y))
+			return false;
+		DownsampleACNRows(band, band_y, reader.height, ACN_table, core_begin / 2, reader.next_row / 2, output);
+	}
+	return true;
+}
 
-			//binarilization: <threshold = black, >threshold = white
-			if (p[0] >= g_ds_png_treshold && p[1] >= g_ds_png_treshold && p[2] >= g_ds_png_treshold)
-			{
-				mask[y * width + x] = true;
-			}
-			else
+bool DSSpace::DownsampleACNPng(const char* input_filename, const DownsampleOptions& options)
+{
+	BitMask output;
+	bool ret = false;
+	if (options.band_height > 0)
+	{
+		//too large to load? stream it in bands
+		ret = DownsampleACNPngBands(input_filename, options, output);
+	}
+	else
+	{
+		BitMask mask;
+		if (!LoadMask(input_filename, options.png_threshold, mask))
+			return false;
+		ret = DownsampleACN(mask, output);
+	}
+	int new_width = output.width;
+	int new_height = output.height;
+
+	if(ret)
+	{
+		//save to a png file!
+		string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
+		output_filename += ".ACN.png";
+
+		SavePngMask(output_filename.c_str(), output, options.png_effort);
+	}
+	
+	return ret;
+}
+
+//
+//weighted vote
+//
+
+//the NeighborhoodMask footprint of the big-pixel scores (see Downsample), by rows:
+//a pixel adds to the big-pixels of pixels (x + dx, y + dy), |dx| <= half_widths[dy + radius] (-1 = no pixel in row dy)
+static int VoteFootprint(const DownsampleOptions& options, vector<int>& half_widths)
+{
+	vector<Vec2i> neighborhood;
+	NeighborhoodMask(options.bigpixel_width / 4 + options.neighborhood_offset, neighborhood);
+
+	int radius = 0;
+	for (int i = 0; i < neighborhood.size(); i++)
+		radius = max(radius, abs(neighborhood[i].y));
+	half_widths.assign(radius * 2 + 1, -1);
+	for (int i = 0; i < neighborhood.size(); i++)
+	{
+		int& half_width = half_widths[neighborhood[i].y + radius];
+		half_width = max(half_width, abs(neighborhood[i].x));  //a disk: its rows are symmetric runs
+	}
+	return radius;
+}
+
+//# of land pixels of a row left of x (clamped to the row). prefix: # of land pixels before every word of the row
+inline int RowLandCount(const unsigned long long* row, const vector<int>& prefix, int width, int x)
+{
+	x = max(0, min(width, x));
+	int count = prefix[x >> 6];
+	if (x & 63)
+		count += PopCount(row[x >> 6] & ((1ULL << (x & 63)) - 1));
+	return count;
+}
+
+//64 pixels of a row from x on (0 outside the row)
+inline unsigned long long RowBits(const unsigned long long* row, int words_per_row, int x)
+{
+	int w = (x >= 0) ? x / 64 : -((63 - x) / 64);
+	int b = x - w * 64;
+	unsigned long long low = (w >= 0 && w < words_per_row) ? row[w] : 0;
+	if (b == 0)
+		return low;
+	unsigned long long high = (w + 1 >= 0 && w + 1 < words_per_row) ? row[w + 1] : 0;
+	return (low >> b) | (high << (64 - b));
+}
+
+//weighted vote of output rows [Y0, Y1). band: image rows [band_y, band_y + band.height), 
+//which include input rows [Y0 * bigpixel_height - radius, Y1 * bigpixel_height + radius) (as far as the image goes)
+//
+//the land score of a big-pixel [s, e) x [Y * bigpixel_height, (Y + 1) * bigpixel_height) sums,
+//over every footprint offset (dx, dy), the land pixels of [s - dx, e - dx) in row y - dy. 
+//in row y, K(d) of the footprint rows that hit the big-pixel have half widths >= d, which makes it V(e) - V(s) w/
+//V(t) = sum_{u=-radius..radius} K(|u|) * P(t + u), P(t) = # of land pixels left of t
+//     = sum_u K(|u|) * P(t) + sum_{j=0..2*radius-1} c_j * (pixel t - radius + j),
+//i.e., a popcount and table lookups of the bytes of the 2*radius pixels around t. K and c only depend on y - Y * bigpixel_height.
+//the water score is the rest of the footprint's in-image pixels
+static void DownsampleVoteRows(const BitMask& band, int band_y, int image_height, const DownsampleOptions& options,
+	const vector<int>& half_widths, int Y0, int Y1, BitMask& output)
+{
+	const int width = band.width;
+	const int new_width = output.width;
+	const int bigpixel_width = options.bigpixel_width;
+	const int bigpixel_height = options.bigpixel_height;
+	const int radius = (half_widths.size() - 1) / 2;
+
+	//per row r = y - Y * bigpixel_height + radius of a big-pixel row: sum_u K(|u|), and V's byte tables of the window
+	const int num_rows = bigpixel_height + radius * 2;
+	const int num_bytes = (radius * 2 + 7) / 8;
+	vector<int> K_sums(num_rows, 0);
+	vector<int> byte_tables((size_t)num_rows * num_bytes * 256, 0);  //by (r * num_bytes + byte) * 256 + value
+	for (int r = 0; r < num_rows; r++)
+	{
+		vector<int> K(radius + 2, 0);
+		for (int dy = -radius; dy <= radius; dy++)
+		{
+			int y_ = r - radius + dy;  //y + dy, relative to the big-pixel row
+			if (y_ < 0 || y_ >= bigpixel_height)
+				continue;
+			for (int d = 0; d <= half_widths[dy + radius]; d++)
+				K[d]++;
+		}
+		K_sums[r] = K[0];
+		for (int u = 1; u <= radius; u++)
+			K_sums[r] += K[u] * 2;
+
+		//c_j: pixel t + i (i >= 0) is left of t + u for every u > i, pixel t - i (i >= 1) is not left of t - u for every u >= i
+		vector<int> c(radius * 2, 0);
+		int W = 0;  //sum_{u > i} K(u)
+		for (int i = radius - 1; i >= 0; i--)
+		{
+			W += K[i + 1];
+			c[radius + i] = W;
+			c[radius - 1 - i] = -W;
+		}
+		for (int b = 0; b < num_bytes; b++)
+		{
+			int* table = &byte_tables[((size_t)r * num_bytes + b) * 256];
+			for (int value = 0; value < 256; value++)
 			{
-				mask[y * width + x] = false;
+				for (int k = 0; k < 8 && b * 8 + k < radius * 2; k++)
+				{
+					if (value & (1 << k))
+						table[value] += c[b * 8 + k];
+				}
 			}
 		}
 	}
 
-	int new_width = width / 2;
-	int new_height = height / 2;
-	bool* output = new bool[new_width * new_height];
+	//in-image pixels of the footprint rows w/ every half width a (the x part of the water scores), by a * new_width + X
+	vector<long long> row_pixels((radius + 1) * new_width, 0);
+	for (int a = 0; a <= radius; a++)
+	{
+		for (int X = 0; X < new_width; X++)
+		{
+			for (int dx = -a; dx <= a; dx++)
+				row_pixels[a * new_width + X] += max(0, min(width, (X + 1) * bigpixel_width - dx) - max(0, X * bigpixel_width - dx));
+		}
+	}
 
-	bool ret = DownsampleACN(width, height, mask, output);
-	if(ret)
+#pragma omp parallel
 	{
-		//save to a png file!
-		std::vector<unsigned char> out_buffer(new_width * new_height * 4);
-		for (int y = 0; y < new_height; y++)
+		vector<long long> land_scores(new_width);
+		vector<long long> V(new_width + 1);
+		vector<int> prefix(band.words_per_row + 1);
+
+#pragma omp for schedule(dynamic)
+		for (int Y = Y0; Y < Y1; Y++)
 		{
-			for (int x = 0; x < new_width; x++)
+			const int y_begin = Y * bigpixel_height;
+			const int y_end = y_begin + bigpixel_height;
+			fill(land_scores.begin(), land_scores.end(), 0);
+
+			for (int y = max(0, y_begin - radius); y < min(image_height, y_end + radius); y++)
 			{
-				int offset = (y * new_width + x) * 4;
+				const int r = y - y_begin + radius;
+				if (K_sums[r] == 0)
+					continue;
+				const int* tables = &byte_tables[(size_t)r * num_bytes * 256];
 
-				if (output[y * new_width + x])
+				const unsigned long long* row = band.Row(y - band_y);
+				prefix[0] = 0;
+				for (int w = 0; w < band.words_per_row; w++)
+					prefix[w + 1] = prefix[w] + PopCount(row[w]);
+
+				for (int X = 0; X <= new_width; X++)
 				{
-					//white
-					out_buffer[offset] = 255;
-					out_buffer[offset + 1] = 255;
-					out_buffer[offset + 2] = 255;
-					out_buffer[offset + 3] = 255;
+					int t = X * bigpixel_width;
+					long long v = (long long)K_sums[r] * RowLandCount(row, prefix, width, t);
+					for (int b = 0; b < num_bytes; b += 8)
+					{
+						unsigned long long window = RowBits(row, band.words_per_row, t - radius + b * 8);
+						for (int b_ = b; b_ < num_bytes && b_ < b + 8; b_++)
+							v += tables[b_ * 256 + ((window >> ((b_ - b) * 8)) & 255)];
+					}
+					V[X] = v;
 				}
-				else
+				for (int X = 0; X < new_width; X++)
+					land_scores[X] += V[X + 1] - V[X];
+			}
+
+			for (int X = 0; X < new_width; X++)
+			{
+				long long num_pixels = 0;
+				for (int dy = -radius; dy <= radius; dy++)
 				{
-					//black
-					out_buffer[offset] = 0;
-					out_buffer[offset + 1] = 0;
-					out_buffer[offset + 2] = 0;
-					out_buffer[offset + 3] = 255;
+					int a = half_widths[dy + radius];
+					int num_rows = min(image_height, y_end - dy) - max(0, y_begin - dy);
+					if (a >= 0 && num_rows > 0)
+						num_pixels += num_rows * row_pixels[a * new_width + X];
 				}
+				long long water_score = num_pixels - land_scores[X];
+				output.Set(X, Y, land_scores[X] * options.land_weight > water_score);
 			}
 		}
+	}
+}
+
+bool DSSpace::DownsampleVote(int width, int height, bool* mask, const DownsampleOptions& options, bool* output)
+{
+	BitMask mask_bits, output_bits;
+	PackMask(width, height, mask, mask_bits);
+	if (!DownsampleVote(mask_bits, options, output_bits))
+		return false;
+	UnpackMask(output_bits, output);
+	return true;
+}
+
+bool DSSpace::DownsampleVote(const BitMask& mask, const DownsampleOptions& options, BitMask& output)
+{
+	if ((mask.width % options.bigpixel_width) != 0 || (mask.height % options.bigpixel_height) != 0)
+	{
+		cout << "[DownsampleVote] error: width / height not dividable" << endl;
+		return false;
+	}
+
+	vector<int> half_widths;
+	VoteFootprint(options, half_widths);
+
+	output.Resize(mask.width / options.bigpixel_width, mask.height / options.bigpixel_height);
+	DownsampleVoteRows(mask, 0, mask.height, options, half_widths, 0, output.height, output);
+	return true;
+}
+
+//band mode of DownsampleVotePng: the input is streamed in bands w/ the footprint's radius as the halo,
+//which gives the same result as the whole image at once
+static bool DownsampleVotePngBands(const char* input_filename, const DownsampleOptions& options, BitMask& output)
+{
+	PngBandReader reader;
+	if (!reader.Open(input_filename, options.png_threshold))
+		return false;
+
+	if ((reader.width % options.bigpixel_width) != 0 || (reader.height % options.bigpixel_height) != 0)
+	{
+		cout << "error: width / height not dividable!" << endl;
+		return false;
+	}
+
+	vector<int> half_widths;
+	int radius = VoteFootprint(options, half_widths);
+
+	output.Resize(reader.width / options.bigpixel_width, reader.height / options.bigpixel_height);
+	BitMask band;
+	while (reader.next_row < reader.height)
+	{
+		int core_begin = reader.next_row;
+		int band_y = 0;
+		if (!reader.ReadBand(options.band_height * options.bigpixel_height, radius, band, band_y))
+			return false;
+		DownsampleVoteRows(band, band_y, reader.height, options, half_widths, 
+			core_begin / options.bigpixel_height, reader.next_row / options.bigpixel_height, output);
+	}
+	return true;
+}
+
+bool DSSpace::DownsampleVotePng(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result)
+{
+	DWORD time_begin = timeGetTime();
+	result = DownsampleResult();
+	bool ret = false;
+	if (options.band_height > 0)
+	{
+		//too large to load? stream it in bands
+		ret = DownsampleVotePngBands(input_filename, options, result.output);
+	}
+	else
+	{
+		if (!LoadMask(input_filename, options.png_threshold, result.input))
+			return false;
+		ret = DownsampleVote(result.input, options, result.output);
+	}
+	if (!ret)
+	{
+		result.output = BitMask();
+		return false;
+	}
+	const int new_width = result.output.width;
+	const int new_height = result.output.height;
+	cout << "[DownsamplePng] vote: " << new_width << "x" << new_height << " time:" << timeGetTime() - time_begin << endl;
+
+	if (options.calculate_error_metrics)
+	{
+		if (options.band_height > 0)
+			cout << "[DownsamplePng] error metrics need the whole input, skipped in band mode" << endl;
+		else
+		{
+			ErrorMetrics(result.input, result.output, result.IoU, result.Dice, result.Precision, result.Recall);
+			cout << endl;
+		}
+	}
 
+	if (options.save)
+	{
 		string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
-		output_filename += ".ACN.png";
+		output_filename += ".lw" + to_string(options.land_weight);
+		if (options.neighborhood_offset != 0)
+			output_filename += ".no" + to_string(options.neighborhood_offset);
+		output_filename += ".vote.png";
 
-		lodepng::encode(output_filename, out_buffer, new_width, new_height);
+		SavePngMask(output_filename.c_str(), result.output, options.png_effort);
 	}
-	
-	return ret;
+	return true;
 }
 
 int DSSpace::DownsamplePassat2022(int width, int height, bool* mask, int bigpixel_size, 
@@ -3661,16 +6823,13 @@ int DSSpace::DownsamplePassat2022(int width, int height, bool* mask, int bigpixe
 	}
 }
 
-bool DSSpace::DownsamplePassat2022Png(const char* input_filename, int bigpixel_size, bool print_debug)
+bool DSSpace::DownsamplePassat2022Png(const char* input_filename, int bigpixel_size, const DownsampleOptions& options)
 {
-	std::vector<unsigned char> in_buffer; //the raw pixels (RGBA)
-	unsigned width = 0, height = 0;
-	unsigned error = lodepng::decode(in_buffer, width, height, input_filename);
-	if (error)
-	{
-		cout << input_filename << " lodepng::decode error:" << error << " " << lodepng_error_text(error) << endl;
+	BitMask packed_mask;
+	if (!LoadMask(input_filename, options.png_threshold, packed_mask))
 		return false;
-	}
+	const int width = packed_mask.width;
+	const int height = packed_mask.height;
 
 	if ((width % 2) != 0 || (height % 2) != 0)
 	{
@@ -3678,66 +6837,25 @@ bool DSSpace::DownsamplePassat2022Png(const char* input_filename, int bigpixel_s
 		return false;
 	}
 
-	//turn the image buffer to a binary mask buffer
 	bool* mask = new bool[width * height];
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++)
-		{
-			int offset = (y * width + x) * 4;
-			Vec4<unsigned char> p(in_buffer[offset], in_buffer[offset + 1], in_buffer[offset + 2], in_buffer[offset + 3]);
-
-			//binarilization: <threshold = black, >threshold = white
-			if (p[0] >= g_ds_png_treshold && p[1] >= g_ds_png_treshold && p[2] >= g_ds_png_treshold)
-			{
-				mask[y * width + x] = true;
-			}
-			else
-			{
-				mask[y * width + x] = false;
-			}
-		}
-	}
+	UnpackMask(packed_mask, mask);
 
 	int new_width = width / bigpixel_size;
 	int new_height = height / bigpixel_size;
 	bool* output = new bool[new_width * new_height];
 
-	int ret = DownsamplePassat2022(width, height, mask, bigpixel_size, output, print_debug);
+	int ret = DownsamplePassat2022(width, height, mask, bigpixel_size, output, options.print_debug);
 	cout << "ret: " << ret << endl;
 	if (ret != 2)
 	{
 		//save to a png file!
-		std::vector<unsigned char> out_buffer(new_width * new_height * 4);
-		for (int y = 0; y < new_height; y++)
-		{
-			for (int x = 0; x < new_width; x++)
-			{
-				int offset = (y * new_width + x) * 4;
-
-				if (output[y * new_width + x])
-				{
-					//white
-					out_buffer[offset] = 255;
-					out_buffer[offset + 1] = 255;
-					out_buffer[offset + 2] = 255;
-					out_buffer[offset + 3] = 255;
-				}
-				else
-				{
-					//black
-					out_buffer[offset] = 0;
-					out_buffer[offset + 1] = 0;
-					out_buffer[offset + 2] = 0;
-					out_buffer[offset + 3] = 255;
-				}
-			}
-		}
+		BitMask packed_output;
+		PackMask(new_width, new_height, output, packed_output);
 
 		string output_filename = string(input_filename) + "." + to_string(new_width) + "x" + to_string(new_height);
 		output_filename += ".Passat.png";
 
-		lodepng::encode(output_filename, out_buffer, new_width, new_height);
+		SavePngMask(output_filename.c_str(), packed_output, options.png_effort);
 	}
 	else
 	{
@@ -4,6 +4,230 @@ using namespace std;
 
 namespace DSSpace
 {
+	//bit-packed binary mask: 1 bit per pixel in 64-bit words, least significant bit first.
+	//every row starts at a word boundary, and the padding bits at the end of a row are 0.
+	//a mask can also be a read-only view of words elsewhere (e.g. a memory-mapped file), which its copies share
+	struct BitMask
+	{
+		int width;
+		int height;
+		int words_per_row;
+		vector<unsigned long long> words;  //row-major. empty for a view
+		const unsigned long long* view;  //a view's words. NULL: the words are owned
+		shared_ptr<void> view_owner;  //keeps a view's memory alive
+
+		BitMask()
+		{
+			width = height = words_per_row = 0;
+			view = NULL;
+		}
+		BitMask(int width_, int height_)
+		{
+			Resize(width_, height_);
+		}
+
+		//all 0
+		void Resize(int width_, int height_)
+		{
+			width = width_;
+			height = height_;
+			words_per_row = (width + 63) / 64;
+			words.assign((size_t)words_per_row * height, 0);
+			view = NULL;
+			view_owner.reset();
+		}
+
+		//a view's words are copied into words (and the view dropped). no-op if the words are owned
+		void Own()
+		{
+			if (!view)
+				return;
+			words.assign(view, view + (size_t)words_per_row * height);
+			view = NULL;
+			view_owner.reset();
+		}
+
+		//views are read-only: a mutable access copies a view's words first (copy-on-write. not thread-safe on a view)
+		unsigned long long* Row(int y)
+		{
+			Own();
+			return words.data() + (size_t)y * words_per_row;
+		}
+		const unsigned long long* Row(int y) const { return (view ? view : words.data()) + (size_t)y * words_per_row; }
+		bool Get(int x, int y) const { return (Row(y)[x >> 6] >> (x & 63)) & 1; }
+		void Set(int x, int y, bool value)
+		{
+			if (value)
+				Row(y)[x >> 6] |= 1ULL << (x & 63);
+			else
+				Row(y)[x >> 6] &= ~(1ULL << (x & 63));
+		}
+	};
+
+	//conversions between bool masks (1 byte per pixel) and bit masks
+	void PackMask(int width, int height, const bool* mask/*size = width*height */, BitMask& bits);
+	void UnpackMask(const BitMask& bits, bool* mask/*size = width*height */);
+
+	//decode a png into a binary mask: a pixel is land (true) if its r, g and b are >= threshold.
+	//the image is streamed (see PngBandReader): inflated, unfiltered and thresholded scanline by scanline in its own color type,
+	//w/o the whole file, the inflated data or an RGBA copy in memory. interlaced pngs are decoded by lodepng as a whole
+	bool LoadPngMask(const char* filename, int threshold, BitMask& mask);
+	//save a binary mask as a 1-bit greyscale png. effort: zlib effort, 0 (stored) ~ 3 (smallest file)
+	bool SavePngMask(const char* filename, const BitMask& mask, int effort = 2);
+
+	//load a binary mask from a png, a binary PBM (P4) or a raw bit mask file. the format is sniffed from the header.
+	//PBM and raw files are memory-mapped: PBM rows are converted in one pass (black = water), and
+	//a raw file becomes a view of the mapping w/o any copy. threshold: for pngs only
+	bool LoadMask(const char* filename, int threshold, BitMask& mask);
+	//raw bit mask file (.bmask): a 16-byte header {"BMSK", width, height, 0} of little-endian 32-bit integers,
+	//then the words of the BitMask as they are in memory (rows of (width + 63) / 64 little-endian 64-bit words)
+	bool SaveRawMask(const char* filename, const BitMask& mask);
+
+	//streaming png reader for masks larger than memory: reads a binary mask a horizontal band at a time.
+	//the IDAT data is inflated incrementally (only the 32KB zlib window is kept), and rows are
+	//unfiltered and thresholded as they come out. non-interlaced pngs only
+	class PngBandReader
+	{
+	public:
+		int width;
+		int height;
+		int next_row;  //first row of the next band
+
+		PngBandReader();
+		~PngBandReader();
+
+		bool Open(const char* filename, int threshold);
+		void Close();
+
+		//read the next num_rows rows (fewer at the bottom) w/ up to halo more rows above and below them.
+		//band_y: image row of the band's first row. the halo must not grow between calls.
+		//return false on errors. past the last row: true w/ an empty band
+		bool ReadBand(int num_rows, int halo, BitMask& band, int& band_y);
+
+	private:
+		struct Stream;
+		Stream* stream;  //decoder state
+
+		PngBandReader(const PngBandReader&);  //not copyable
+		PngBandReader& operator=(const PngBandReader&);
+	};
+
+	//settings of a downsampling job. every entry point takes them explicitly (no globals),
+	//so that jobs can run concurrently
+	struct DownsampleOptions
+	{
+		int bigpixel_width;  //width and height of a big-pixel in terms of small pixels
+		int bigpixel_height;
+		int land_weight;  //w.r.t water_weight=1, land_weight=?
+		float land_bias_ratio;  //(DownsampleByEuler) land bias as % of max-possible value
+		int png_threshold;  //threshold for determining a grey pixel is black (0~256)
+		int neighborhood_offset;  //added to the neighborhood size (bigpixel_width / 4) of the big-pixel scores
+		bool local_constraint;
+		bool parallel_boundaries;  //row-parallel boundary enumeration?
+		bool vote;  //(DownsamplePng) weighted majority vote per big-pixel instead of the MILP (no topology preservation)
+
+		int milp_backend;  //MILP solver backend (MILP_BACKEND_*)
+		int milp_threads;  //solver threads (0 = solver default)
+		float time_limit;  //solver time limit of every MILP in seconds (0 = no limit)
+		float mip_gap;  //a solve stops at this relative gap between the objective bound and the solution (0 = solver default)
+		double node_limit;  //max branch-and-bound nodes of a solve (0 = no limit)
+		float mem_limit;  //solver memory limit in GB (0 = no limit. Gurobi only)
+		int seed;  //solver random seed (0 = solver default. Gurobi only)
+		bool warm_start;  //give the solver a vote-based start solution?
+		bool decompose;  //solve independent blocks of the MILP separately?
+		bool presolve;  //(Downsample) fix unambiguous big-pixels before building the MILP?
+		float presolve_dominance;  //presolve: also fix big-pixels w/o a boundary whose component has this share of the score (0 = off)
+		bool lazy_loops;  //(Downsample) single-loop boundaries by lazy cuts of sub-loops instead of the dist/last (MTZ) encoding?
+
+		int tile_size;  //tiled mode: tile size in big-pixels (0 = no tiling)
+		int tile_halo;  //tiled mode: halo size in big-pixels
+		int band_height;  //band mode: stream the input png in bands of this many big-pixel rows (0 = load it whole)
+		int pyramid_levels;  //pyramid mode: # of levels, w/ big-pixels 1, 2, 4, .. times the size (0 or 1 = single level)
+
+		bool alternative_offsets;  //(DownsamplePng) also try shifted big-pixel grids and keep the best?
+		int offset_workers;  //alternative offsets solved concurrently (0 = #cores)
+		float target_IoU;  //alternative offsets: stop at the first one w/ IoU >= this (0 = try all, keep the best)
+
+		bool calculate_error_metrics;
+		bool save;  //save result image?
+		int png_effort;  //zlib effort of saved images: 0 (stored) ~ 3 (smallest file)
+		bool save_components_to_file;  //output component index map
+		bool print_debug;
+
+		DownsampleOptions();  //defaults
+	};
+
+	//statistics of the MILP solves of a downsampling (all of them: tiles, bands, levels, ..)
+	struct SolverStats
+	{
+		int num_solves;
+		int status;  //status of the last solve (MILP_OPTIMAL, MILP_TIME_LIMIT, ...). 0 = no solve
+		float runtime;  //seconds, in total
+		double node_count;  //branch-and-bound nodes, in total
+		double gap;  //max relative gap between a found solution and its objective bound (0 = all optimal, INFINITY = no solution found)
+
+		SolverStats();
+		void Add(const SolverStats& stats);
+	};
+
+	//results of a downsampling job
+	struct DownsampleResult
+	{
+		BitMask input;  //input binary mask (empty in band mode)
+		BitMask output;  //output binary mask. empty (0x0) if failed
+		vector<int> input_components;  //component indices of input (if save_components_to_file)
+		vector<int> output_components;  //component indices of output (if save_components_to_file)
+		int h_offset;  //best horizontal and vertical buffer offsets
+		int v_offset;
+		float IoU, Dice, Precision, Recall;  //error metrics of the output (if calculated)
+		vector<BitMask> levels;  //pyramid mode: output of every level (levels[0] = output). empty if a level failed
+		SolverStats solver_stats;  //of the output (of the best offset)
+
+		DownsampleResult();
+	};
+
+	//a connected component of a label map
+	struct ComponentInfo
+	{
+		bool is_water;  //false=land, true=water
+		int index;  //# of island; # of sea (0) or lakes (>0)
+		int num_pixels;  //# of pixels of this component (= #F)
+		int num_vertices;  //#V of the union of its pixels' closed squares
+		int num_edges;  //#E of the union of its pixels' closed squares
+		Vec2i bbox_min;  //bounding box of the component's pixels (inclusive)
+		Vec2i bbox_max;
+		bool touches_border;  //"touching-boundary" flag: has a pixel on the image border?
+	};
+
+	//dense label map of a mask: 4 bytes per pixel instead of a hash map entry per pixel
+	struct LabelMap
+	{
+		int width;
+		int height;
+		vector<int> ids;  //row-major, every pixel's actual component index (lands first then waters). -1 = unlabeled
+		vector<ComponentInfo> components;  //in actual component index order
+		int num_lands;  //"h0"
+		int num_waters;  //"h1"
+
+		LabelMap()
+		{
+			width = height = 0;
+			num_lands = num_waters = 0;
+		}
+
+		int NumComponents() const { return num_lands + num_waters; }
+		bool IsLand(int c) const { return c < num_lands; }
+		int At(int x, int y) const { return ids[y * width + x]; }
+	};
+
+	//union-find two-pass connected-component labeling (lands are 8-connected, waters are 4-connected)
+	//components are numbered in raster order of their first pixels, exactly as LabelTopology does
+	void LabelComponents(int width, int height, bool* mask, LabelMap& labels, bool print_debug = false);
+	void LabelComponents(const BitMask& mask, LabelMap& labels, bool print_debug = false);
+
+	//Eulers: each component's #V, #E, #F (i.e., the union of its pixels' closed faces)
+	//these are counted by LabelComponents in its labeling pass, so this only collects them
+	void ComponentEulers(const LabelMap& labels, vector<tuple<int, int, int>>& Eulers, bool print_debug = false);
 
 	//label topology (i.e., lands (=islands) and water (= sea and lakes) of a given mask
 	//we will mark every pixel of the mask as:
@@ -13,38 +237,103 @@ namespace DSSpace
 	//Eulers: each component's #V, #E, #F
 	//is_boundary_flags: "touching-boundary" flags of components 
 	void LabelTopology(int width, int height, bool* mask, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
-		int& num_lands, int& num_waters, vector<tuple<int,int,int>>& Eulers, vector<bool>& is_boundary_flags);
+		int& num_lands, int& num_waters, vector<tuple<int,int,int>>& Eulers, vector<bool>& is_boundary_flags, bool print_debug = false);
+	//LabelMap version. "touching-boundary" flags are in labels.components
+	void LabelTopology(int width, int height, bool* mask, LabelMap& labels, vector<tuple<int, int, int>>& Eulers,
+		bool print_debug = false);
+	void LabelTopology(const BitMask& mask, LabelMap& labels, vector<tuple<int, int, int>>& Eulers, bool print_debug = false);
 
 	//simpler version w/o Eulers calculation etc
 	void LabelTopology2(int width, int height, bool* mask, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
-		int& num_lands, int& num_waters);
+		int& num_lands, int& num_waters, bool print_debug = false);
 
 	//enumerate land-water boundaries given a label map
 	//boundaries: <list of land component-index and water component index, and boundary size> 
 	bool EnumerateBoundaries(int width, int height, unordered_map<int, pair<Vec2i, pair<bool, int>>>& labels,
-		int num_lands, int num_waters, vector<pair<Vec2i,int>> &boundaries);
+		int num_lands, int num_waters, vector<pair<Vec2i,int>> &boundaries, bool print_debug = false);
+	//LabelMap version: one streaming pass over the edges, boundaries are sorted by (land, water) index
+	//row_parallel: count rows on multiple threads (per-thread tables are merged at the end)
+	bool EnumerateBoundaries(const LabelMap& labels, vector<pair<Vec2i, int>>& boundaries, bool row_parallel = false,
+		bool print_debug = false);
 
 	//load a black-and-white png file, down downsampling, save the result to another png file
+	//(the *Png functions also take PBM P4 and raw bit mask files. see LoadMask)
 	//output filename = input_file.WxH.png (e.g., "input.png.256x256.png")
-	//png_threshold: upper threshold (out of 256) for a pixel to be considered as black   
-	bool DownsamplePng(const char* input_filename, bool calculate_error_metrics);
+	//options.png_threshold: upper threshold (out of 256) for a pixel to be considered as black   
+	//result: the input and the (best) output masks, error metrics, etc
+	//pyramid mode (options.pyramid_levels > 1): every level is downsampled from the input (decoded and labeled once),
+	//from the coarsest one. each level's solution, upsampled 2x, is the warm start of the next finer level
+	bool DownsamplePng(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result);
+
+	//a job of a batch: an input file w/ its options, and its outcome
+	struct BatchJob
+	{
+		string input_filename;
+		DownsampleOptions options;
+
+		//outcome (filled by DownsampleBatch)
+		bool success;
+		int time;  //milliseconds
+		int output_width, output_height;
+		float IoU, Dice, Precision, Recall;  //error metrics (if calculated)
+		SolverStats solver_stats;
+	};
+
+	//run DownsamplePng on every job in one process. the jobs are taken by num_workers threads (0 = #cores),
+	//and the solver threads (options.milp_threads, 0 = #cores) are split between them
+	//summary_filename: if given, a CSV file w/ a row per job (parameters, success, time, error metrics, solver stats)
+	//return: # of succeeded jobs
+	int DownsampleBatch(vector<BatchJob>& jobs, int num_workers, const char* summary_filename = NULL);
 
 	//(old way) topology preserving downsampling of a binary mask of a grid
-	//we turn every bigpixel_width X bigpixel_height small pixels into a big pixel
+	//we turn every options.bigpixel_width X options.bigpixel_height small pixels into a big pixel
 	//this means that width and height should be dividable by them
 	//return: 0=success, 2=failure by infeasible, 1=other failures
 	int DownsampleByEuler(int width, int height, bool* mask/*size = width*height */,
-		int bigpixel_width, int bigpixel_height, bool* output);
+		const DownsampleOptions& options, bool* output);
+	//LabelMap version: labels of the mask (e.g., from LabelComponents)
+	int DownsampleByEuler(const LabelMap& labels, const DownsampleOptions& options, bool* output);
 
 	//using new boundary-based topology constraints
 	int Downsample(int width, int height, bool* mask/*size = width*height */,
-		int bigpixel_width, int bigpixel_height, bool* output);
+		const DownsampleOptions& options, bool* output);
+	//bit mask version. output is resized to the new size
+	int Downsample(const BitMask& mask, const DownsampleOptions& options, BitMask& output);
+	//LabelMap version: labels of the mask (e.g., from LabelComponents)
+	//output_components: if given, the component index of every output big-pixel (-1 = none) is returned here
+	//fixed_components: if given, a component index for every output big-pixel (-1 = free).
+	//  the big-pixel is fixed to that component (where it is a candidate)
+	//interrupt: if given, the solve is cancelled once *interrupt becomes true
+	//hint_components: if given, a component index for every output big-pixel (-1 = none).
+	//  the warm start puts the big-pixel in that component (where it is a candidate) instead of its best-score one
+	//stats: if given, the solve's statistics are added to it
+	int Downsample(const LabelMap& labels, const DownsampleOptions& options, bool* output,
+		int* output_components = NULL, const int* fixed_components = NULL, atomic<bool>* interrupt = NULL,
+		const int* hint_components = NULL, SolverStats* stats = NULL);
+
+	//tiled version of Downsample for very large images:
+	//1. the output grid is split into tiles of options.tile_size x options.tile_size big-pixels. every tile grows by a halo of
+	//   options.tile_halo big-pixels (clamped by the image), and is downsampled independently (in parallel)
+	//2. a stitching model fixes every tile's interior big-pixels to its tile's solution, and re-optimizes only the halo bands
+	//   along the tile seams (w/ the rest of the tiles' solutions as the warm start). the interiors are constants,
+	//   and their boundary pieces are contracted (see Downsample), so the model grows w/ the seams, not the image.
+	//   if it fails (e.g., infeasible), so does DownsampleTiled
+	//components crossing tiles are reported, and the Betti numbers of the output are checked against the input
+	//return: same as Downsample
+	int DownsampleTiled(int width, int height, bool* mask/*size = width*height */,
+		const DownsampleOptions& options, bool* output);
+	//output_components, interrupt, stats: same as Downsample
+	//(the concurrent tiles split the solver threads, like the workers of DownsamplePng and DownsampleBatch)
+	int DownsampleTiled(const LabelMap& labels, const DownsampleOptions& options, bool* output,
+		int* output_components = NULL, atomic<bool>* interrupt = NULL, SolverStats* stats = NULL);
 
 	//calculate error metrics between an input buffer and an output (smaller) buffer
 	//width should be dividable by new_width, etc
 	bool ErrorMetrics(int width, int height, bool* input/*size = width*height */,
 		int new_width, int new_height, bool* output/*size = new_width*new_height */,
 		float &IoU, float &Dice, float &Precision, float &Recall);
+	//bit mask version: word-parallel. each output row is upsampled to a bit row and compared w/ popcounts
+	bool ErrorMetrics(const BitMask& input, const BitMask& output, float& IoU, float& Dice, float& Precision, float& Recall);
 	//file-input version:
 	bool ErrorMetricsPng(const char* input_filename, const char* output_filename, 
 		float& IoU, float& Dice, float& Precision, float& Recall);
@@ -56,21 +345,37 @@ namespace DSSpace
 
 	//binay image thinning 
 	//https://homepages.inf.ed.ac.uk/rbf/HIPR2/thin.htm
+	//every structuring element removes all of its matches at once, 64 pixels per word operation
 	bool Thinning(int width, int height, bool* input/*size = width*height*/, bool *output/*size = width*height */);
+	bool Thinning(const BitMask& input, BitMask& output);
 
 	//fill a smallest hole
 	bool FillHole(int width, int height, bool *mask/*size = width*height*/);
+	//LabelMap version: labels are the mask's labels (e.g., from LabelComponents)
+	bool FillHole(const LabelMap& labels, bool* mask/*size = width*height*/);
 
 	//ADAPTIVE CROSSING NUMBERS AND THEIR APPLICATION TO BINARY DOWNSAMPLING
 	//always do 2x2 -> 1x1 downsampling
 	bool DownsampleACN(int width, int height, bool* mask/*size = width*height */, 
 		bool* output/*size = (width/2)*(height/2) */);
+	//bit mask version. output is resized to the new size
+	bool DownsampleACN(const BitMask& mask, BitMask& output);
 	//do many levels of DownsampleACN to an input png file. until 1x1 or failure
-	bool DownsampleACNPng(const char* input_filename);
+	bool DownsampleACNPng(const char* input_filename, const DownsampleOptions& options);
+
+	//weighted majority vote w/o topology preservation: a big-pixel is land if options.land_weight * its land score > its water score,
+	//w/ the scores of Downsample (every pixel adds 1 to the big-pixels its NeighborhoodMask footprint covers).
+	//any options.bigpixel_width/height. the scores are popcounts of whole words of the bit mask rows
+	bool DownsampleVote(int width, int height, bool* mask/*size = width*height */, const DownsampleOptions& options,
+		bool* output/*size = (width/bigpixel_width)*(height/bigpixel_height) */);
+	//bit mask version. output is resized to the new size
+	bool DownsampleVote(const BitMask& mask, const DownsampleOptions& options, BitMask& output);
+	//DownsamplePng w/ options.vote: output filename = input_file.WxH.lwN.vote.png. band mode streams the input
+	bool DownsampleVotePng(const char* input_filename, const DownsampleOptions& options, DownsampleResult& result);
 
 	//Passat2022 (Homotopic affine transformations in the 2D Cartesian Grid)
 	//return: 0=success. 1=success after "sigma-flips". 2=failed
 	int DownsamplePassat2022(int width, int height, bool* mask/*size = width*height */,
 		int bigpixel_size, bool* output/*size = (width/bsize)*(height/bsize) */, bool print_debug);
-	bool DownsamplePassat2022Png(const char* input_filename, int bigpixel_size, bool print_debug);
+	bool DownsamplePassat2022Png(const char* input_filename, int bigpixel_size, const DownsampleOptions& options);
 }
\ No newline at end of file
@@ -0,0 +1,1175 @@
+#include <windows.h>
+#include <vector>
+#include <iostream>
+#include <cmath>
+#include <tuple>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <omp.h>  //OpenMP
+#include "milp.h"
+
+using namespace DSSpace;
+
+#define MILP_EPS 1e-6
+
+//
+//linear expressions
+//
+
+MILPLinExpr& MILPLinExpr::operator+=(const MILPLinExpr& expr)
+{
+	terms.insert(terms.end(), expr.terms.begin(), expr.terms.end());
+	constant += expr.constant;
+	return *this;
+}
+
+MILPLinExpr& MILPLinExpr::operator-=(const MILPLinExpr& expr)
+{
+	for (int i = 0; i < expr.terms.size(); i++)
+	{
+		terms.push_back(make_pair(expr.terms[i].first, -expr.terms[i].second));
+	}
+	constant -= expr.constant;
+	return *this;
+}
+
+MILPLinExpr& MILPLinExpr::operator*=(double multiplier)
+{
+	for (int i = 0; i < terms.size(); i++)
+	{
+		terms[i].second *= multiplier;
+	}
+	constant *= multiplier;
+	return *this;
+}
+
+MILPLinExpr DSSpace::operator+(const MILPLinExpr& a, const MILPLinExpr& b)
+{
+	MILPLinExpr expr = a;
+	expr += b;
+	return expr;
+}
+
+MILPLinExpr DSSpace::operator-(const MILPLinExpr& a, const MILPLinExpr& b)
+{
+	MILPLinExpr expr = a;
+	expr -= b;
+	return expr;
+}
+
+MILPLinExpr DSSpace::operator-(const MILPLinExpr& a)
+{
+	MILPLinExpr expr = a;
+	expr *= -1;
+	return expr;
+}
+
+MILPLinExpr DSSpace::operator*(double multiplier, const MILPLinExpr& a)
+{
+	MILPLinExpr expr = a;
+	expr *= multiplier;
+	return expr;
+}
+
+MILPLinExpr DSSpace::operator*(const MILPLinExpr& a, double multiplier)
+{
+	return multiplier * a;
+}
+
+MILPTempConstr DSSpace::operator<=(const MILPLinExpr& lhs, const MILPLinExpr& rhs)
+{
+	MILPTempConstr constr;
+	constr.expr = lhs - rhs;
+	constr.sense = MILP_LESS_EQUAL;
+	return constr;
+}
+
+MILPTempConstr DSSpace::operator>=(const MILPLinExpr& lhs, const MILPLinExpr& rhs)
+{
+	MILPTempConstr constr;
+	constr.expr = lhs - rhs;
+	constr.sense = MILP_GREATER_EQUAL;
+	return constr;
+}
+
+MILPTempConstr DSSpace::operator==(const MILPLinExpr& lhs, const MILPLinExpr& rhs)
+{
+	MILPTempConstr constr;
+	constr.expr = lhs - rhs;
+	constr.sense = MILP_EQUAL;
+	return constr;
+}
+
+//
+//problem
+//
+
+MILPProblem::MILPProblem()
+{
+	obj_constant = 0;
+	obj_sense = MILP_MINIMIZE;
+	time_limit = 0;
+	output_flag = true;
+	threads = 0;
+	mip_gap = 0;
+	node_limit = 0;
+	mem_limit = 0;
+	seed = 0;
+	interrupt = NULL;
+	lazy = NULL;
+
+	status = MILP_LOADED;
+	runtime = 0;
+	obj_val = 0;
+	obj_bound = 0;
+	gap = INFINITY;
+	node_count = 0;
+	num_lazy_cuts = 0;
+}
+
+MILPVar MILPProblem::addVar(double lb, double ub, double obj, char type)
+{
+	lbs.push_back(lb);
+	ubs.push_back(ub);
+	objs.push_back(obj);
+	types.push_back(type);
+	starts.push_back(NAN);
+
+	return MILPVar(lbs.size() - 1);
+}
+
+void MILPProblem::addConstr(const MILPTempConstr& constr)
+{
+	addConstr(constr.expr, constr.sense, 0);
+}
+
+void MILPProblem::addConstr(const MILPLinExpr& lhs, char sense, double rhs)
+{
+	MILPConstr constr;
+	constr.sense = sense;
+	constr.rhs = rhs - lhs.constant;
+
+	//merge repeated vars and drop canceled terms
+	constr.terms = lhs.terms;
+	sort(constr.terms.begin(), constr.terms.end());
+	int num_terms = 0;
+	for (int i = 0; i < constr.terms.size(); i++)
+	{
+		if (num_terms > 0 && constr.terms[num_terms - 1].first == constr.terms[i].first)
+			constr.terms[num_terms - 1].second += constr.terms[i].second;
+		else
+			constr.terms[num_terms++] = constr.terms[i];
+	}
+	constr.terms.resize(num_terms);
+	num_terms = 0;
+	for (int i = 0; i < constr.terms.size(); i++)
+	{
+		if (constr.terms[i].second != 0)
+			constr.terms[num_terms++] = constr.terms[i];
+	}
+	constr.terms.resize(num_terms);
+
+	//w/o vars (e.g., all of them fixed by a presolve), a constraint that holds is dropped
+	if (constr.terms.empty())
+	{
+		const double EPS = 1e-9;
+		if ((constr.sense == MILP_LESS_EQUAL && 0 <= constr.rhs + EPS) ||
+			(constr.sense == MILP_GREATER_EQUAL && 0 >= constr.rhs - EPS) ||
+			(constr.sense == MILP_EQUAL && fabs(constr.rhs) <= EPS))
+			return;
+	}
+
+	constrs.push_back(constr);
+}
+
+void MILPProblem::setObjective(const MILPLinExpr& obj, int sense)
+{
+	objs.assign(lbs.size(), 0);
+	for (int i = 0; i < obj.terms.size(); i++)
+	{
+		objs[obj.terms[i].first] += obj.terms[i].second;
+	}
+	obj_constant = obj.constant;
+	obj_sense = sense;
+}
+
+void MILPProblem::setStart(const MILPVar& var, double value)
+{
+	starts[var.index] = value;
+}
+
+void MILPProblem::setTimeLimit(double seconds)
+{
+	time_limit = seconds;
+}
+
+void MILPProblem::setOutputFlag(bool flag)
+{
+	output_flag = flag;
+}
+
+void MILPProblem::setThreads(int num_threads)
+{
+	threads = num_threads;
+}
+
+void MILPProblem::setMIPGap(double gap)
+{
+	mip_gap = gap;
+}
+
+void MILPProblem::setNodeLimit(double num_nodes)
+{
+	node_limit = num_nodes;
+}
+
+void MILPProblem::setMemLimit(double gigabytes)
+{
+	mem_limit = gigabytes;
+}
+
+void MILPProblem::setSeed(int random_seed)
+{
+	seed = random_seed;
+}
+
+void MILPProblem::setInterrupt(atomic<bool>* flag)
+{
+	interrupt = flag;
+}
+
+void MILPProblem::setLazyConstraints(const MILPLazyConstraints* lazy_constraints)
+{
+	lazy = lazy_constraints;
+}
+
+int MILPProblem::optimize(int backend)
+{
+	solution.clear();
+
+#ifndef DS_NO_GUROBI
+	if (backend == MILP_BACKEND_GUROBI)
+		return SolveMILPGurobi(*this);
+#else
+	if (backend == MILP_BACKEND_GUROBI)
+		cout << "[MILP] Gurobi backend is not compiled in (DS_NO_GUROBI). using branch-and-bound" << endl;
+#endif
+
+	return SolveMILPBranchAndBound(*this);
+}
+
+#ifdef DS_NO_GUROBI
+void DSSpace::ReleaseMILPEnvironments()
+{
+	//no solver environment to release
+}
+#endif
+
+//
+//branch-and-bound backend
+//
+
+//search state of SolveMILPBranchAndBound.
+//internally, it maximizes f = -obj_sense * (sum of obj coef * var)
+//all vars are binaries or integers with finite bounds
+class BranchAndBound
+{
+public:
+	const MILPProblem& problem;
+	int n;
+
+	//current domains
+	vector<double> lbs;
+	vector<double> ubs;
+	vector<double> gains;  //objective coefs of f
+
+	//var -> (constr, coef) adjacency, CSR
+	vector<int> var_constr_begins;
+	vector<pair<int, double>> var_constrs;
+
+	//constraint activities over the current domains
+	vector<double> min_acts;
+	vector<double> max_acts;
+	vector<double> max_ranges;  //max |coef| * (ub - lb) at the root: no tightening is possible beyond this slack
+
+	//"choice" groups: equality constraints sum of binaries == 1. a var is in at most one group
+	//the objective bound of a group is its best free member rather than the sum of them
+	vector<int> var_groups;  //-1 = no group
+	vector<vector<int>> groups;
+	vector<double> group_bests;
+
+	double obj_bound;  //upper bound of f over the current domains
+
+	//undo log of bound changes: var, old lb, old ub
+	vector<tuple<int, double, double>> trail;
+
+	vector<int> queue;
+	vector<bool> in_queue;
+
+	BranchAndBound(const MILPProblem& problem_) : problem(problem_)
+	{
+		n = problem.numVars();
+		lbs = problem.lbs;
+		ubs = problem.ubs;
+		gains.resize(n);
+		for (int v = 0; v < n; v++)
+		{
+			gains[v] = -problem.obj_sense * problem.objs[v];
+
+			//integral bounds
+			lbs[v] = ceil(lbs[v] - MILP_EPS);
+			ubs[v] = floor(ubs[v] + MILP_EPS);
+		}
+
+		//adjacency
+		vector<int> counts(n + 1, 0);
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			for (int i = 0; i < problem.constrs[c].terms.size(); i++)
+				counts[problem.constrs[c].terms[i].first + 1]++;
+		}
+		for (int v = 0; v < n; v++)
+			counts[v + 1] += counts[v];
+		var_constr_begins = counts;
+		var_constrs.resize(counts[n]);
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			for (int i = 0; i < problem.constrs[c].terms.size(); i++)
+			{
+				int v = problem.constrs[c].terms[i].first;
+				var_constrs[counts[v]++] = make_pair(c, problem.constrs[c].terms[i].second);
+			}
+		}
+
+		//activities
+		min_acts.assign(problem.constrs.size(), 0);
+		max_acts.assign(problem.constrs.size(), 0);
+		max_ranges.assign(problem.constrs.size(), 0);
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			const MILPConstr& constr = problem.constrs[c];
+			for (int i = 0; i < constr.terms.size(); i++)
+			{
+				int v = constr.terms[i].first;
+				double a = constr.terms[i].second;
+				min_acts[c] += (a > 0) ? a * lbs[v] : a * ubs[v];
+				max_acts[c] += (a > 0) ? a * ubs[v] : a * lbs[v];
+				max_ranges[c] = max(max_ranges[c], fabs(a) * (ubs[v] - lbs[v]));
+			}
+		}
+
+		//choice groups
+		var_groups.assign(n, -1);
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			const MILPConstr& constr = problem.constrs[c];
+			if (constr.sense != MILP_EQUAL || fabs(constr.rhs - 1) > MILP_EPS)
+				continue;
+
+			bool is_choice = true;
+			for (int i = 0; i < constr.terms.size() && is_choice; i++)
+			{
+				int v = constr.terms[i].first;
+				if (constr.terms[i].second != 1 || lbs[v] < 0 || ubs[v] > 1 || var_groups[v] >= 0)
+					is_choice = false;
+			}
+			if (!is_choice)
+				continue;
+
+			vector<int> group;
+			for (int i = 0; i < constr.terms.size(); i++)
+			{
+				var_groups[constr.terms[i].first] = groups.size();
+				group.push_back(constr.terms[i].first);
+			}
+			groups.push_back(group);
+		}
+
+		//objective bound
+		obj_bound = 0;
+		for (int v = 0; v < n; v++)
+		{
+			if (var_groups[v] < 0)
+				obj_bound += max(gains[v] * lbs[v], gains[v] * ubs[v]);
+		}
+		group_bests.assign(groups.size(), 0);
+		for (int g = 0; g < groups.size(); g++)
+		{
+			group_bests[g] = GroupBest(g);
+			obj_bound += group_bests[g];
+		}
+
+		in_queue.assign(problem.constrs.size(), false);
+	}
+
+	double GroupBest(int g)
+	{
+		bool found = false;
+		double best = 0;
+		for (int i = 0; i < groups[g].size(); i++)
+		{
+			int v = groups[g][i];
+			if (ubs[v] > 0.5 && (!found || gains[v] > best))
+			{
+				best = gains[v];
+				found = true;
+			}
+		}
+		return best;  //no free member: infeasible, which the propagation will find
+	}
+
+	//update activities and the objective bound for a domain change of v (lbs/ubs[v] already hold the new domain)
+	void ApplyDomainChange(int v, double old_lb, double old_ub)
+	{
+		double new_lb = lbs[v];
+		double new_ub = ubs[v];
+		for (int i = var_constr_begins[v]; i < var_constr_begins[v + 1]; i++)
+		{
+			int c = var_constrs[i].first;
+			double a = var_constrs[i].second;
+			if (a > 0)
+			{
+				min_acts[c] += a * (new_lb - old_lb);
+				max_acts[c] += a * (new_ub - old_ub);
+			}
+			else
+			{
+				min_acts[c] += a * (new_ub - old_ub);
+				max_acts[c] += a * (new_lb - old_lb);
+			}
+		}
+
+		int g = var_groups[v];
+		if (g < 0)
+		{
+			obj_bound += max(gains[v] * new_lb, gains[v] * new_ub) - max(gains[v] * old_lb, gains[v] * old_ub);
+		}
+		else
+		{
+			obj_bound -= group_bests[g];
+			group_bests[g] = GroupBest(g);
+			obj_bound += group_bests[g];
+		}
+	}
+
+	void SetBounds(int v, double lb, double ub)
+	{
+		trail.push_back(make_tuple(v, lbs[v], ubs[v]));
+		double old_lb = lbs[v];
+		double old_ub = ubs[v];
+		lbs[v] = lb;
+		ubs[v] = ub;
+		ApplyDomainChange(v, old_lb, old_ub);
+
+		for (int i = var_constr_begins[v]; i < var_constr_begins[v + 1]; i++)
+		{
+			int c = var_constrs[i].first;
+			if (!in_queue[c])
+			{
+				in_queue[c] = true;
+				queue.push_back(c);
+			}
+		}
+	}
+
+	void Undo(int trail_size)
+	{
+		while (trail.size() > trail_size)
+		{
+			int v = std::get<0>(trail.back());
+			double old_lb = lbs[v];
+			double old_ub = ubs[v];
+			lbs[v] = std::get<1>(trail.back());
+			ubs[v] = std::get<2>(trail.back());
+			trail.pop_back();
+			ApplyDomainChange(v, old_lb, old_ub);
+		}
+
+		for (int i = 0; i < queue.size(); i++)
+			in_queue[queue[i]] = false;
+		queue.clear();
+	}
+
+	void EnqueueAll()
+	{
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			in_queue[c] = true;
+			queue.push_back(c);
+		}
+	}
+
+	//tighten domains until a fixpoint. return: false if a constraint cannot be satisfied
+	bool Propagate()
+	{
+		while (!queue.empty())
+		{
+			int c = queue.back();
+			queue.pop_back();
+			in_queue[c] = false;
+
+			const MILPConstr& constr = problem.constrs[c];
+
+			//sum <= rhs: every term's increase from its min is bounded by the slack
+			if (constr.sense != MILP_GREATER_EQUAL)
+			{
+				double slack = constr.rhs - min_acts[c];
+				if (slack < -MILP_EPS)
+					return false;
+				if (slack < max_ranges[c] - MILP_EPS)
+				{
+					for (int i = 0; i < constr.terms.size(); i++)
+					{
+						int v = constr.terms[i].first;
+						double a = constr.terms[i].second;
+						if (lbs[v] == ubs[v])
+							continue;
+						if (a > 0)
+						{
+							double ub = floor(lbs[v] + slack / a + MILP_EPS);
+							if (ub < ubs[v])
+								SetBounds(v, lbs[v], ub);
+						}
+						else
+						{
+							double lb = ceil(ubs[v] + slack / a - MILP_EPS);
+							if (lb > lbs[v])
+								SetBounds(v, lb, ubs[v]);
+						}
+					}
+				}
+			}
+
+			//sum >= rhs: every term's decrease from its max is bounded by the slack
+			if (constr.sense != MILP_LESS_EQUAL)
+			{
+				double slack = max_acts[c] - constr.rhs;
+				if (slack < -MILP_EPS)
+					return false;
+				if (slack < max_ranges[c] - MILP_EPS)
+				{
+					for (int i = 0; i < constr.terms.size(); i++)
+					{
+						int v = constr.terms[i].first;
+						double a = constr.terms[i].second;
+						if (lbs[v] == ubs[v])
+							continue;
+						if (a > 0)
+						{
+							double lb = ceil(ubs[v] - slack / a - MILP_EPS);
+							if (lb > lbs[v])
+								SetBounds(v, lb, ubs[v]);
+						}
+						else
+						{
+							double ub = floor(lbs[v] - slack / a + MILP_EPS);
+							if (ub < ubs[v])
+								SetBounds(v, lbs[v], ub);
+						}
+					}
+				}
+			}
+		}
+
+		return true;
+	}
+
+	//is a full assignment feasible?
+	bool IsFeasible(const vector<double>& x) const
+	{
+		for (int v = 0; v < n; v++)
+		{
+			if (x[v] != x[v]/*NAN*/ || x[v] < problem.lbs[v] - MILP_EPS || x[v] > problem.ubs[v] + MILP_EPS ||
+				fabs(x[v] - floor(x[v] + 0.5)) > MILP_EPS)
+				return false;
+		}
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			const MILPConstr& constr = problem.constrs[c];
+			double sum = 0;
+			for (int i = 0; i < constr.terms.size(); i++)
+				sum += constr.terms[i].second * x[constr.terms[i].first];
+
+			if ((constr.sense != MILP_GREATER_EQUAL && sum > constr.rhs + MILP_EPS) ||
+				(constr.sense != MILP_LESS_EQUAL && sum < constr.rhs - MILP_EPS))
+				return false;
+		}
+		return true;
+	}
+
+	double Gain(const vector<double>& x) const
+	{
+		double f = 0;
+		for (int v = 0; v < n; v++)
+			f += gains[v] * x[v];
+		return f;
+	}
+};
+
+//relative gap between a solution's objective and a bound (as Gurobi's MIPGap)
+static double RelativeGap(double obj_val, double obj_bound)
+{
+	double difference = fabs(obj_bound - obj_val);
+	if (difference <= MILP_EPS)
+		return 0;
+	return (obj_val != 0) ? difference / fabs(obj_val) : INFINITY;
+}
+
+//does a full assignment violate the lazy constraints of a problem? (the violated ones are counted)
+static bool ViolatesLazyConstraints(const MILPProblem& problem, const vector<double>& x, int& num_cuts)
+{
+	if (!problem.lazy)
+		return false;
+
+	vector<MILPTempConstr> cuts;
+	problem.lazy->Separate(x, cuts);
+	num_cuts += cuts.size();
+	return !cuts.empty();
+}
+
+int DSSpace::SolveMILPBranchAndBound(MILPProblem& problem)
+{
+	DWORD time_begin = timeGetTime();
+
+	BranchAndBound bnb(problem);
+	const int n = bnb.n;
+
+	vector<double> incumbent;
+	double incumbent_gain = 0;
+	int num_cuts = 0;
+	int num_rejected = 0;  //leaves violating lazy constraints
+
+	//a feasible start solution is the first incumbent
+	vector<double> start(n);
+	for (int v = 0; v < n; v++)
+		start[v] = floor(problem.starts[v] + 0.5);
+	if (n > 0 && bnb.IsFeasible(start) && !ViolatesLazyConstraints(problem, start, num_cuts))
+	{
+		incumbent = start;
+		incumbent_gain = bnb.Gain(start);
+		if (problem.output_flag)
+			cout << "[MILP] start solution accepted. objective:" << -problem.obj_sense * incumbent_gain + problem.obj_constant << endl;
+	}
+
+	//depth-first search. each decision splits the domain of a var in two:
+	//the first branch is tried right away, the alternative on backtracking
+	struct Decision
+	{
+		int var;
+		double alt_lb;
+		double alt_ub;
+		int trail_size;  //before the first branch
+		int cursor;  //all vars before this are fixed at the node
+		bool alt_tried;
+	};
+	vector<Decision> decisions;
+
+	bool timeout = false;
+	bool interrupted = false;
+	bool node_limit_reached = false;
+	long long num_nodes = 0;
+	long long next_check = 256;  //the time limit and the interrupt are checked every 256 nodes
+	double pruned_bound = -INFINITY;  //max bound of the nodes pruned by the incumbent
+
+	//root: empty domains or propagation failure = infeasible
+	bool ok = true;
+	for (int v = 0; v < n; v++)
+	{
+		if (bnb.lbs[v] > bnb.ubs[v])
+			ok = false;
+	}
+	if (ok)
+	{
+		bnb.EnqueueAll();
+		ok = bnb.Propagate();
+	}
+	bool root_feasible = ok;
+	double root_bound = bnb.obj_bound;
+
+	while (root_feasible)
+	{
+		//prune by bound (w/in the relative gap of the incumbent, if given)
+		if (ok && !incumbent.empty())
+		{
+			double tolerance = MILP_EPS;
+			if (problem.mip_gap > 0)
+				tolerance = max(tolerance, problem.mip_gap * fabs(-problem.obj_sense * incumbent_gain + problem.obj_constant));
+			if (bnb.obj_bound <= incumbent_gain + tolerance)
+			{
+				pruned_bound = max(pruned_bound, bnb.obj_bound);
+				ok = false;
+			}
+		}
+
+		if (ok)
+		{
+			int cursor = decisions.empty() ? 0 : decisions.back().cursor;
+			while (cursor < n && bnb.lbs[cursor] == bnb.ubs[cursor])
+				cursor++;
+
+			if (cursor == n)
+			{
+				//all fixed and consistent: a new incumbent (the bound is exact here), unless lazy constraints reject it
+				if (ViolatesLazyConstraints(problem, bnb.lbs, num_cuts))
+				{
+					num_rejected++;
+				}
+				else
+				{
+					incumbent = bnb.lbs;
+					incumbent_gain = bnb.Gain(incumbent);
+					if (problem.output_flag)
+					{
+						cout << "[MILP] new incumbent. objective:" << -problem.obj_sense * incumbent_gain + problem.obj_constant <<
+							" nodes:" << num_nodes << " time:" << (timeGetTime() - time_begin) / 1000.0 << endl;
+					}
+				}
+				ok = false;
+			}
+			else
+			{
+				//choose a branching var and its first branch
+				Decision decision;
+				decision.var = cursor;
+				decision.cursor = cursor;
+				decision.trail_size = bnb.trail.size();
+				decision.alt_tried = false;
+
+				double first_lb, first_ub;
+				int g = bnb.var_groups[cursor];
+				if (g >= 0)
+				{
+					//choose the group member of the start solution, else the one w/ the best gain
+					int best = -1;
+					for (int i = 0; i < bnb.groups[g].size(); i++)
+					{
+						int v = bnb.groups[g][i];
+						if (bnb.lbs[v] == bnb.ubs[v])
+							continue;
+						if (best < 0 ||
+							(problem.starts[v] > 0.5 && !(problem.starts[best] > 0.5)) ||
+							((problem.starts[v] > 0.5) == (problem.starts[best] > 0.5) && bnb.gains[v] > bnb.gains[best]))
+							best = v;
+					}
+					decision.var = best;
+					first_lb = first_ub = 1;
+					decision.alt_lb = decision.alt_ub = 0;
+				}
+				else
+				{
+					double lb = bnb.lbs[cursor];
+					double ub = bnb.ubs[cursor];
+					double mid = floor((lb + ub) / 2);
+					double hint = problem.starts[cursor];
+
+					//the lower half first, unless the start value or the gain prefers the upper half
+					bool upper_first = (hint == hint) ? (hint > mid) : (bnb.gains[cursor] > 0);
+					if (upper_first)
+					{
+						first_lb = mid + 1;
+						first_ub = ub;
+						decision.alt_lb = lb;
+						decision.alt_ub = mid;
+					}
+					else
+					{
+						first_lb = lb;
+						first_ub = mid;
+						decision.alt_lb = mid + 1;
+						decision.alt_ub = ub;
+					}
+				}
+
+				decisions.push_back(decision);
+				bnb.SetBounds(decision.var, first_lb, first_ub);
+				ok = bnb.Propagate();
+				num_nodes++;
+			}
+		}
+
+		if (!ok)
+		{
+			//backtrack to the deepest decision w/ an untried alternative
+			while (!decisions.empty() && decisions.back().alt_tried)
+			{
+				bnb.Undo(decisions.back().trail_size);
+				decisions.pop_back();
+			}
+			if (decisions.empty())
+				break;  //search exhausted
+
+			Decision& decision = decisions.back();
+			bnb.Undo(decision.trail_size);
+			decision.alt_tried = true;
+			bnb.SetBounds(decision.var, decision.alt_lb, decision.alt_ub);
+			ok = bnb.Propagate();
+			num_nodes++;
+		}
+
+		if (num_nodes >= next_check)
+		{
+			//(an iteration may add 2 nodes, so a threshold rather than num_nodes % 256)
+			next_check = num_nodes + 256;
+			if (problem.time_limit > 0 && (timeGetTime() - time_begin) / 1000.0 >= problem.time_limit)
+			{
+				timeout = true;
+				break;
+			}
+			if (problem.interrupt && *problem.interrupt)
+			{
+				interrupted = true;
+				break;
+			}
+		}
+		if (problem.node_limit > 0 && num_nodes >= problem.node_limit)
+		{
+			node_limit_reached = true;
+			break;
+		}
+	}
+
+	problem.runtime = (timeGetTime() - time_begin) / 1000.0;
+	problem.node_count = num_nodes;
+	problem.num_lazy_cuts = num_cuts;
+	problem.solution = incumbent;
+	problem.gap = INFINITY;
+	if (!incumbent.empty())
+	{
+		problem.obj_val = -problem.obj_sense * incumbent_gain + problem.obj_constant;
+
+		//the bound: a finished search has only pruned nodes left. a stopped one has the root's
+		bool finished = !timeout && !interrupted && !node_limit_reached;
+		double bound = finished ? max(incumbent_gain, pruned_bound) : max(incumbent_gain, root_bound);
+		problem.obj_bound = -problem.obj_sense * bound + problem.obj_constant;
+		problem.gap = RelativeGap(problem.obj_val, problem.obj_bound);
+	}
+
+	if (timeout)
+		problem.status = MILP_TIME_LIMIT;
+	else if (interrupted)
+		problem.status = MILP_INTERRUPTED;
+	else if (node_limit_reached)
+		problem.status = MILP_NODE_LIMIT;
+	else if (!incumbent.empty())
+		problem.status = MILP_OPTIMAL;
+	else
+		problem.status = MILP_INFEASIBLE;
+
+	if (problem.output_flag)
+	{
+		cout << "[MILP] branch-and-bound done. status:" << problem.status << " nodes:" << num_nodes <<
+			" rejected by lazy constraints:" << num_rejected << " time:" << problem.runtime << endl;
+	}
+
+	return problem.status;
+}
+
+
+//
+//decomposition
+//
+
+static int FindRootVar(vector<int>& parent, int v)
+{
+	while (parent[v] != v)
+	{
+		parent[v] = parent[parent[v]];
+		v = parent[v];
+	}
+	return v;
+}
+
+//lazy constraints of a block of a decomposed problem: a block solution is completed w/ the vars fixed at the root
+//(the other blocks' vars are unknown), and the cuts over the block's vars (and fixed vars) are kept
+class BlockLazyConstraints : public MILPLazyConstraints
+{
+public:
+	const MILPLazyConstraints* lazy;  //of the problem
+	const vector<double>& fixed_values;  //of all vars. NAN if free
+	const vector<int>& vars;  //of the block
+	const vector<int>& var_blocks;  //block of every var (-1: fixed)
+	const vector<int>& local_index;  //index of every var in its block
+	int block;
+
+	BlockLazyConstraints(const MILPLazyConstraints* lazy_, const vector<double>& fixed_values_, const vector<int>& vars_,
+		const vector<int>& var_blocks_, const vector<int>& local_index_, int block_) :
+		fixed_values(fixed_values_), vars(vars_), var_blocks(var_blocks_), local_index(local_index_)
+	{
+		lazy = lazy_;
+		block = block_;
+	}
+
+	void Separate(const vector<double>& solution, vector<MILPTempConstr>& cuts) const
+	{
+		vector<double> x = fixed_values;
+		for (int i = 0; i < vars.size(); i++)
+			x[vars[i]] = solution[i];
+
+		vector<MILPTempConstr> problem_cuts;
+		lazy->Separate(x, problem_cuts);
+		for (int c = 0; c < problem_cuts.size(); c++)
+		{
+			const MILPLinExpr& expr = problem_cuts[c].expr;
+
+			MILPTempConstr cut;
+			cut.sense = problem_cuts[c].sense;
+			cut.expr.constant = expr.constant;
+			bool in_block = true;
+			for (int i = 0; i < expr.terms.size() && in_block; i++)
+			{
+				int v = expr.terms[i].first;
+				if (var_blocks[v] < 0)
+					cut.expr.constant += expr.terms[i].second * fixed_values[v];
+				else if (var_blocks[v] == block)
+					cut.expr.terms.push_back(make_pair(local_index[v], expr.terms[i].second));
+				else
+					in_block = false;
+			}
+			if (in_block)
+				cuts.push_back(cut);
+		}
+	}
+};
+
+int DSSpace::SolveMILPDecomposed(MILPProblem& problem, int backend)
+{
+	DWORD time_begin = timeGetTime();
+
+	problem.solution.clear();
+
+	//root propagation fixes many vars (e.g., big-pixels w/ a single candidate)
+	BranchAndBound root(problem);
+	const int n = root.n;
+	bool ok = true;
+	for (int v = 0; v < n; v++)
+	{
+		if (root.lbs[v] > root.ubs[v])
+			ok = false;
+	}
+	if (ok)
+	{
+		root.EnqueueAll();
+		ok = root.Propagate();
+	}
+	if (!ok)
+	{
+		problem.status = MILP_INFEASIBLE;
+		problem.runtime = (timeGetTime() - time_begin) / 1000.0;
+		if (problem.output_flag)
+			cout << "[MILP] infeasible at the root" << endl;
+		return problem.status;
+	}
+
+	//the remaining constraints over the free vars: fixed vars go to the rhs, and
+	//constraints that hold for any values of the free vars are dropped
+	vector<MILPConstr> constrs;
+	for (int c = 0; c < problem.constrs.size(); c++)
+	{
+		const MILPConstr& constr = problem.constrs[c];
+
+		MILPConstr reduced;
+		reduced.sense = constr.sense;
+		reduced.rhs = constr.rhs;
+		double min_act = 0, max_act = 0;
+		for (int i = 0; i < constr.terms.size(); i++)
+		{
+			int v = constr.terms[i].first;
+			double a = constr.terms[i].second;
+			if (root.lbs[v] == root.ubs[v])
+			{
+				reduced.rhs -= a * root.lbs[v];
+			}
+			else
+			{
+				reduced.terms.push_back(constr.terms[i]);
+				min_act += (a > 0) ? a * root.lbs[v] : a * root.ubs[v];
+				max_act += (a > 0) ? a * root.ubs[v] : a * root.lbs[v];
+			}
+		}
+
+		if (reduced.terms.empty())
+			continue;
+		bool le_holds = (max_act <= reduced.rhs + MILP_EPS);
+		bool ge_holds = (min_act >= reduced.rhs - MILP_EPS);
+		if ((reduced.sense == MILP_LESS_EQUAL && le_holds) || (reduced.sense == MILP_GREATER_EQUAL && ge_holds) ||
+			(reduced.sense == MILP_EQUAL && le_holds && ge_holds))
+			continue;
+
+		constrs.push_back(reduced);
+	}
+
+	//blocks: free vars connected by the remaining constraints
+	vector<int> parent(n);
+	for (int v = 0; v < n; v++)
+		parent[v] = v;
+	for (int c = 0; c < constrs.size(); c++)
+	{
+		int r0 = FindRootVar(parent, constrs[c].terms[0].first);
+		for (int i = 1; i < constrs[c].terms.size(); i++)
+		{
+			int r1 = FindRootVar(parent, constrs[c].terms[i].first);
+			if (r0 != r1)
+				parent[r1] = r0;
+		}
+	}
+
+	int num_free = 0;
+	vector<int> block_of_root(n, -1);
+	vector<vector<int>> block_vars;
+	for (int v = 0; v < n; v++)
+	{
+		if (root.lbs[v] == root.ubs[v])
+			continue;
+		num_free++;
+		int r = FindRootVar(parent, v);
+		if (block_of_root[r] < 0)
+		{
+			block_of_root[r] = block_vars.size();
+			block_vars.push_back(vector<int>());
+		}
+		block_vars[block_of_root[r]].push_back(v);
+	}
+	int num_blocks = block_vars.size();
+
+	//sub-problems
+	vector<int> local_index(n, -1);
+	vector<int> var_blocks(n, -1);
+	vector<MILPProblem> blocks(num_blocks);
+	for (int b = 0; b < num_blocks; b++)
+	{
+		MILPProblem& block = blocks[b];
+		for (int i = 0; i < block_vars[b].size(); i++)
+		{
+			int v = block_vars[b][i];
+			local_index[v] = i;
+			var_blocks[v] = b;
+			block.addVar(root.lbs[v], root.ubs[v], problem.objs[v], problem.types[v]);
+			block.starts[i] = problem.starts[v];
+		}
+		block.obj_sense = problem.obj_sense;
+		block.time_limit = 0;  //the remaining time when the block starts (see below)
+		block.output_flag = false;
+		block.threads = (num_blocks > 1) ? 1 : problem.threads;  //the blocks share the threads
+		block.mip_gap = problem.mip_gap;
+		block.node_limit = problem.node_limit;
+		block.mem_limit = problem.mem_limit;
+		block.seed = problem.seed;
+		block.interrupt = problem.interrupt;
+	}
+	for (int c = 0; c < constrs.size(); c++)
+	{
+		MILPConstr& constr = constrs[c];
+		int b = block_of_root[FindRootVar(parent, constr.terms[0].first)];
+		for (int i = 0; i < constr.terms.size(); i++)
+			constr.terms[i].first = local_index[constr.terms[i].first];
+		blocks[b].constrs.push_back(constr);
+	}
+
+	//lazy constraints of the blocks
+	vector<double> fixed_values(n, NAN);
+	for (int v = 0; v < n; v++)
+	{
+		if (root.lbs[v] == root.ubs[v])
+			fixed_values[v] = root.lbs[v];
+	}
+	vector<unique_ptr<BlockLazyConstraints>> block_lazies;
+	if (problem.lazy)
+	{
+		for (int b = 0; b < num_blocks; b++)
+		{
+			block_lazies.push_back(unique_ptr<BlockLazyConstraints>(
+				new BlockLazyConstraints(problem.lazy, fixed_values, block_vars[b], var_blocks, local_index, b)));
+			blocks[b].lazy = block_lazies[b].get();
+		}
+	}
+
+	//solve the blocks concurrently, largest first
+	vector<pair<int, int>> order;
+	int max_block_size = 0;
+	for (int b = 0; b < num_blocks; b++)
+	{
+		order.push_back(make_pair(-(int)block_vars[b].size(), b));
+		max_block_size = max(max_block_size, (int)block_vars[b].size());
+	}
+	sort(order.begin(), order.end());
+
+	if (problem.output_flag)
+	{
+		cout << "[MILP] decomposed. vars:" << n << " free:" << num_free << " constraints:" << constrs.size() << "/" << 
+			problem.constrs.size() << " blocks:" << num_blocks << " largest block:" << max_block_size << endl;
+	}
+
+	int num_workers = (problem.threads > 0) ? problem.threads : omp_get_max_threads();
+	//the time limit is for the whole solve, not per block: a block gets the time left when it starts
+	DWORD time_deadline = time_begin + (DWORD)(problem.time_limit * 1000);
+#pragma omp parallel for schedule(dynamic) num_threads(num_workers)
+	for (int i = 0; i < num_blocks; i++)
+	{
+		MILPProblem& block = blocks[order[i].second];
+		if (problem.time_limit > 0)
+		{
+			int remaining = (int)(time_deadline - timeGetTime());
+			if (remaining <= 0)
+			{
+				block.status = MILP_TIME_LIMIT;
+				continue;
+			}
+			block.time_limit = remaining / 1000.0;
+		}
+		block.optimize(backend);
+	}
+
+	//merge. the status is the worst of the blocks' statuses
+	problem.status = MILP_OPTIMAL;
+	problem.node_count = 0;
+	problem.num_lazy_cuts = 0;
+	problem.gap = INFINITY;
+	bool all_solved = true;
+	for (int b = 0; b < num_blocks; b++)
+	{
+		problem.node_count += blocks[b].node_count;
+		problem.num_lazy_cuts += blocks[b].num_lazy_cuts;
+		if (blocks[b].status == MILP_INFEASIBLE)
+			problem.status = MILP_INFEASIBLE;
+		else if (blocks[b].status != MILP_OPTIMAL && problem.status == MILP_OPTIMAL)
+			problem.status = blocks[b].status;
+		if (!blocks[b].hasSolution())
+			all_solved = false;
+	}
+
+	if (problem.status != MILP_INFEASIBLE && all_solved)
+	{
+		problem.solution = root.lbs;
+		for (int b = 0; b < num_blocks; b++)
+		{
+			for (int i = 0; i < block_vars[b].size(); i++)
+				problem.solution[block_vars[b][i]] = blocks[b].solution[i];
+		}
+
+		problem.obj_val = problem.obj_constant;
+		for (int v = 0; v < n; v++)
+			problem.obj_val += problem.objs[v] * problem.solution[v];
+
+		//the blocks' bounds add up
+		problem.obj_bound = problem.obj_val;
+		for (int b = 0; b < num_blocks; b++)
+			problem.obj_bound += blocks[b].obj_bound - blocks[b].obj_val;
+		problem.gap = RelativeGap(problem.obj_val, problem.obj_bound);
+
+		//w/o blocks, nothing checked the vars fixed at the root
+		if (ViolatesLazyConstraints(problem, problem.solution, problem.num_lazy_cuts))
+		{
+			problem.status = MILP_INFEASIBLE;
+			problem.solution.clear();
+		}
+	}
+
+	problem.runtime = (timeGetTime() - time_begin) / 1000.0;
+
+	if (problem.output_flag)
+		cout << "[MILP] decomposed solve done. status:" << problem.status << " nodes:" << problem.node_count << " gap:" << problem.gap <<
+			" time:" << problem.runtime << endl;
+
+	return problem.status;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+using namespace std;
+
+//thin MILP modelling interface. the model-building code in downsampling.cpp targets this instead of Gurobi,
+//and a backend solves it:
+//  MILP_BACKEND_GUROBI: Gurobi (needs a license. not available when compiled with DS_NO_GUROBI)
+//  MILP_BACKEND_BNB: bundled branch-and-bound w/ bound propagation (no license, no dependency)
+//the API mirrors GRBModel/GRBVar/GRBLinExpr so that the model code reads the same
+
+#define MILP_BACKEND_GUROBI 0
+#define MILP_BACKEND_BNB 1
+
+//variable types
+#define MILP_BINARY 'B'
+#define MILP_INTEGER 'I'
+
+//constraint senses
+#define MILP_LESS_EQUAL '<'
+#define MILP_GREATER_EQUAL '>'
+#define MILP_EQUAL '='
+
+//objective senses
+#define MILP_MINIMIZE 1
+#define MILP_MAXIMIZE -1
+
+//optimization status codes: same values as Gurobi's
+#define MILP_LOADED 1
+#define MILP_OPTIMAL 2
+#define MILP_INFEASIBLE 3
+#define MILP_NODE_LIMIT 8
+#define MILP_TIME_LIMIT 9
+#define MILP_INTERRUPTED 11
+#define MILP_SUBOPTIMAL 13
+
+namespace DSSpace
+{
+	//a variable is just its index in the problem
+	class MILPVar
+	{
+	public:
+		int index;
+
+		MILPVar()
+		{
+			index = -1;
+		}
+		explicit MILPVar(int index_)
+		{
+			index = index_;
+		}
+	};
+
+	//sum of coef * var + constant. terms may repeat a var (they are merged when added to a problem)
+	class MILPLinExpr
+	{
+	public:
+		vector<pair<int/*var index*/, double/*coef*/>> terms;
+		double constant;
+
+		MILPLinExpr(double constant_ = 0)
+		{
+			constant = constant_;
+		}
+		MILPLinExpr(const MILPVar& var)
+		{
+			terms.push_back(make_pair(var.index, 1.0));
+			constant = 0;
+		}
+
+		MILPLinExpr& operator+=(const MILPLinExpr& expr);
+		MILPLinExpr& operator-=(const MILPLinExpr& expr);
+		MILPLinExpr& operator*=(double multiplier);
+	};
+
+	MILPLinExpr operator+(const MILPLinExpr& a, const MILPLinExpr& b);
+	MILPLinExpr operator-(const MILPLinExpr& a, const MILPLinExpr& b);
+	MILPLinExpr operator-(const MILPLinExpr& a);
+	MILPLinExpr operator*(double multiplier, const MILPLinExpr& a);
+	MILPLinExpr operator*(const MILPLinExpr& a, double multiplier);
+
+	//"lhs sense rhs", as produced by the comparison operators
+	struct MILPTempConstr
+	{
+		MILPLinExpr expr;  //lhs - rhs
+		char sense;
+	};
+
+	MILPTempConstr operator<=(const MILPLinExpr& lhs, const MILPLinExpr& rhs);
+	MILPTempConstr operator>=(const MILPLinExpr& lhs, const MILPLinExpr& rhs);
+	MILPTempConstr operator==(const MILPLinExpr& lhs, const MILPLinExpr& rhs);
+
+	//a linear constraint: sum of coef * var (sense) rhs. each var appears at most once
+	struct MILPConstr
+	{
+		vector<pair<int/*var index*/, double/*coef*/>> terms;
+		char sense;
+		double rhs;
+	};
+
+	//constraints checked on the found solutions instead of being added up front (e.g., too many to add them all).
+	//Gurobi adds the ones violated by a new incumbent in a callback, and branch-and-bound rejects such an incumbent
+	class MILPLazyConstraints
+	{
+	public:
+		virtual ~MILPLazyConstraints() {}
+
+		//add constraints violated by a solution (values of all vars. NAN = unknown) to cuts. they must hold for
+		//every solution that satisfies the lazy constraints. called concurrently by the blocks of a decomposed solve
+		virtual void Separate(const vector<double>& solution, vector<MILPTempConstr>& cuts) const = 0;
+	};
+
+	class MILPProblem
+	{
+	public:
+		//variables
+		vector<double> lbs;
+		vector<double> ubs;
+		vector<double> objs;  //objective coefs
+		vector<char> types;
+		vector<double> starts;  //start solution. NAN = not given
+
+		vector<MILPConstr> constrs;
+		double obj_constant;
+		int obj_sense;
+
+		//parameters
+		double time_limit;  //seconds. <= 0: no limit
+		bool output_flag;  //print solver logs?
+		int threads;  //solver threads. 0: backend default
+		double mip_gap;  //stop at this relative gap between the objective bound and the solution. <= 0: backend default
+		double node_limit;  //max # of branch-and-bound nodes. <= 0: no limit
+		double mem_limit;  //GB (Gurobi only, a soft limit: the solve stops w/ GRB_MEM_LIMIT). <= 0: no limit
+		int seed;  //random seed (Gurobi only). 0: backend default
+		atomic<bool>* interrupt;  //if given, solving stops (MILP_INTERRUPTED) once *interrupt becomes true
+		const MILPLazyConstraints* lazy;  //if given, solutions must satisfy its constraints too
+
+		//results of optimize()
+		int status;
+		double runtime;  //seconds
+		double obj_val;
+		vector<double> solution;  //empty if no feasible solution was found
+		double obj_bound;  //bound of the optimal objective
+		double gap;  //relative gap |obj_bound - obj_val| / |obj_val| (if a solution was found)
+		double node_count;  //branch-and-bound nodes explored
+		int num_lazy_cuts;  //violated lazy constraints found
+
+		MILPProblem();
+
+		MILPVar addVar(double lb, double ub, double obj, char type);
+		void addConstr(const MILPTempConstr& constr);
+		void addConstr(const MILPLinExpr& lhs, char sense, double rhs);
+		void setObjective(const MILPLinExpr& obj, int sense);
+
+		void setStart(const MILPVar& var, double value);
+		void setTimeLimit(double seconds);
+		void setOutputFlag(bool flag);
+		void setThreads(int num_threads);
+		void setMIPGap(double gap);
+		void setNodeLimit(double num_nodes);
+		void setMemLimit(double gigabytes);
+		void setSeed(int random_seed);
+		void setInterrupt(atomic<bool>* flag);
+		void setLazyConstraints(const MILPLazyConstraints* lazy_constraints);
+
+		//solve with a backend (MILP_BACKEND_*). return: status (MILP_OPTIMAL, MILP_INFEASIBLE, ...)
+		int optimize(int backend);
+
+		int numVars() const { return lbs.size(); }
+		bool hasSolution() const { return !solution.empty(); }
+		//value of a var in the found solution
+		double getX(const MILPVar& var) const { return solution[var.index]; }
+	};
+
+	//backends. they fill status, runtime, obj_val and solution of the problem and return the status
+#ifndef DS_NO_GUROBI
+	//every running solve has a Gurobi environment of its own, from a pool (created lazily, one per concurrent solve)
+	int SolveMILPGurobi(MILPProblem& problem);
+#endif
+	//release the solver environments of the workers (call at shutdown, w/o solves running. a later solve creates new ones)
+	void ReleaseMILPEnvironments();
+	//depth-first branch-and-bound. bounds are tightened by propagating every linear constraint,
+	//and a node is pruned by the objective bound of the current variable domains.
+	//a feasible start solution is used as the first incumbent. solutions violating lazy constraints are rejected
+	int SolveMILPBranchAndBound(MILPProblem& problem);
+
+	//split a problem into independent blocks and solve them concurrently w/ a backend:
+	//vars fixed by propagation at the root are removed, and so are constraints that hold for any values of the rest.
+	//the remaining vars, connected by the remaining constraints, make the blocks.
+	//the time limit covers the whole solve: a block gets the time left when it starts (none: MILP_TIME_LIMIT, unsolved)
+	int SolveMILPDecomposed(MILPProblem& problem, int backend);
+}
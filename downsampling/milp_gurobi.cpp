@@ -0,0 +1,237 @@
+#ifndef DS_NO_GUROBI
+#include <windows.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include "gurobi_c++.h"
+#include "milp.h"
+
+using namespace DSSpace;
+
+static char GurobiSense(char sense)
+{
+	if (sense == MILP_LESS_EQUAL)
+		return GRB_LESS_EQUAL;
+	else if (sense == MILP_GREATER_EQUAL)
+		return GRB_GREATER_EQUAL;
+	return GRB_EQUAL;
+}
+
+//stops Gurobi once the problem's interrupt flag is raised,
+//and adds the lazy constraints violated by every new incumbent
+class GurobiCallback : public GRBCallback
+{
+public:
+	atomic<bool>* interrupt;
+	const MILPLazyConstraints* lazy;
+	const vector<GRBVar>& vars;
+	int num_cuts;
+
+	GurobiCallback(atomic<bool>* interrupt_, const MILPLazyConstraints* lazy_, const vector<GRBVar>& vars_) : vars(vars_)
+	{
+		interrupt = interrupt_;
+		lazy = lazy_;
+		num_cuts = 0;
+	}
+
+protected:
+	void callback()
+	{
+		if (interrupt && *interrupt)
+		{
+			abort();
+			return;
+		}
+
+		if (lazy && where == GRB_CB_MIPSOL && !vars.empty())
+		{
+			double* values = getSolution(&vars[0], vars.size());
+			vector<double> solution(values, values + vars.size());
+			delete[] values;
+
+			vector<MILPTempConstr> cuts;
+			lazy->Separate(solution, cuts);
+			for (int i = 0; i < cuts.size(); i++)
+			{
+				const MILPLinExpr& expr = cuts[i].expr;
+				GRBLinExpr sum;
+				for (int j = 0; j < expr.terms.size(); j++)
+					sum += expr.terms[j].second * vars[expr.terms[j].first];
+				addLazy(sum, GurobiSense(cuts[i].sense), -expr.constant);
+			}
+			num_cuts += cuts.size();
+		}
+	}
+};
+
+//Gurobi environments aren't thread-safe, so every concurrent solve has one of its own:
+//a pool of environments, each lent to one solve at a time. they are created when all the others are in use
+//(license checkout, etc. once per worker, not per solve), and released by ReleaseMILPEnvironments
+static vector<GRBEnv*> g_gurobi_envs;  //all of them
+static vector<GRBEnv*> g_free_gurobi_envs;  //not lent
+
+//lends an environment for the lifetime of the object. throws GRBException as GRBEnv does
+struct GurobiEnvLease
+{
+	GRBEnv* env;
+
+	GurobiEnvLease()
+	{
+		env = NULL;
+		bool failed = false;
+		string message;
+		int error_code = 0;
+#pragma omp critical(gurobi_env)
+		{
+			try
+			{
+				if (g_free_gurobi_envs.empty())
+				{
+					GRBEnv* new_env = new GRBEnv();
+					g_gurobi_envs.push_back(new_env);
+					g_free_gurobi_envs.push_back(new_env);
+				}
+				env = g_free_gurobi_envs.back();
+				g_free_gurobi_envs.pop_back();
+			}
+			catch (GRBException e)
+			{
+				failed = true;  //not thrown out of the critical section
+				message = e.getMessage();
+				error_code = e.getErrorCode();
+			}
+		}
+		if (failed)
+			throw GRBException(message, error_code);
+	}
+	~GurobiEnvLease()
+	{
+#pragma omp critical(gurobi_env)
+		g_free_gurobi_envs.push_back(env);
+	}
+
+private:
+	GurobiEnvLease(const GurobiEnvLease&);  //not copyable
+	GurobiEnvLease& operator=(const GurobiEnvLease&);
+};
+
+void DSSpace::ReleaseMILPEnvironments()
+{
+#pragma omp critical(gurobi_env)
+	{
+		for (int i = 0; i < g_gurobi_envs.size(); i++)
+			delete g_gurobi_envs[i];
+		g_gurobi_envs.clear();
+		g_free_gurobi_envs.clear();
+	}
+}
+
+//Gurobi backend of MILPProblem
+int DSSpace::SolveMILPGurobi(MILPProblem& problem)
+{
+	try
+	{
+		GurobiEnvLease lease;  //(outlives the model)
+		GRBModel model(*lease.env);
+
+		//variables
+		vector<GRBVar> vars(problem.numVars());
+		for (int v = 0; v < problem.numVars(); v++)
+		{
+			char type = (problem.types[v] == MILP_BINARY) ? GRB_BINARY : GRB_INTEGER;
+			vars[v] = model.addVar(problem.lbs[v], problem.ubs[v], problem.objs[v], type);
+		}
+		model.update();
+
+		//objective
+		GRBLinExpr obj = problem.obj_constant;
+		for (int v = 0; v < problem.numVars(); v++)
+		{
+			if (problem.objs[v] != 0)
+				obj += problem.objs[v] * vars[v];
+		}
+		model.setObjective(obj, problem.obj_sense == MILP_MAXIMIZE ? GRB_MAXIMIZE : GRB_MINIMIZE);
+
+		//constraints
+		vector<double> coefs;
+		vector<GRBVar> term_vars;
+		for (int c = 0; c < problem.constrs.size(); c++)
+		{
+			const MILPConstr& constr = problem.constrs[c];
+
+			coefs.clear();
+			term_vars.clear();
+			for (int i = 0; i < constr.terms.size(); i++)
+			{
+				term_vars.push_back(vars[constr.terms[i].first]);
+				coefs.push_back(constr.terms[i].second);
+			}
+			GRBLinExpr sum;
+			if (!coefs.empty())
+				sum.addTerms(&coefs[0], &term_vars[0], coefs.size());
+
+			model.addConstr(sum, GurobiSense(constr.sense), constr.rhs);
+		}
+
+		//start solution
+		for (int v = 0; v < problem.numVars(); v++)
+		{
+			if (problem.starts[v] == problem.starts[v]/*not NAN*/)
+				vars[v].set(GRB_DoubleAttr_Start, problem.starts[v]);
+		}
+
+		//parameters (of this model only)
+		if (problem.time_limit > 0)
+			model.set(GRB_DoubleParam_TimeLimit, problem.time_limit);
+		if (!problem.output_flag)
+			model.set(GRB_IntParam_OutputFlag, false);  //silent
+		if (problem.threads > 0)
+			model.set(GRB_IntParam_Threads, problem.threads);
+		if (problem.mip_gap > 0)
+			model.set(GRB_DoubleParam_MIPGap, problem.mip_gap);
+		if (problem.node_limit > 0)
+			model.set(GRB_DoubleParam_NodeLimit, problem.node_limit);
+		if (problem.mem_limit > 0)  //(MemLimit is an environment param and can't be changed on a started env)
+			model.set(GRB_DoubleParam_SoftMemLimit, problem.mem_limit);
+		if (problem.seed != 0)
+			model.set(GRB_IntParam_Seed, problem.seed);
+
+		GurobiCallback callback(problem.interrupt, problem.lazy, vars);
+		if (problem.lazy)
+			model.set(GRB_IntParam_LazyConstraints, 1);
+		if (problem.interrupt || problem.lazy)
+			model.setCallback(&callback);
+
+		model.optimize();
+
+		problem.num_lazy_cuts = callback.num_cuts;
+
+		problem.status = model.get(GRB_IntAttr_Status);
+		problem.runtime = model.get(GRB_DoubleAttr_Runtime);
+		problem.node_count = model.get(GRB_DoubleAttr_NodeCount);
+		problem.gap = INFINITY;
+		problem.solution.clear();
+		if (model.get(GRB_IntAttr_SolCount) > 0)
+		{
+			problem.obj_val = model.get(GRB_DoubleAttr_ObjVal);
+			problem.obj_bound = model.get(GRB_DoubleAttr_ObjBound);
+			problem.gap = model.get(GRB_DoubleAttr_MIPGap);
+			problem.solution.resize(problem.numVars());
+			for (int v = 0; v < problem.numVars(); v++)
+			{
+				problem.solution[v] = vars[v].get(GRB_DoubleAttr_X);
+			}
+		}
+	}
+	catch (GRBException e)
+	{
+		cout << "[MILP] Gurobi error code:" << e.getErrorCode() << " " << e.getMessage() << endl;
+		problem.status = MILP_INTERRUPTED;
+		problem.solution.clear();
+	}
+
+	return problem.status;
+}
+#endif